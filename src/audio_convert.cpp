@@ -0,0 +1,282 @@
+/*
+ * This file is part of bino, a 3D video player.
+ *
+ * Copyright (C) 2010-2011
+ * Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <cstring>
+#include <cmath>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+#include "audio_convert.h"
+
+#include "dbg.h"
+
+
+/* Read one sample as float in [-1,1], or write one float sample with clipping. */
+
+static inline float read_sample(const void *src, audio_blob::sample_format_t format, size_t i)
+{
+    switch (format)
+    {
+    case audio_blob::u8:
+        return (static_cast<const uint8_t *>(src)[i] - 128) / 128.0f;
+    case audio_blob::s16:
+        return static_cast<const int16_t *>(src)[i] / 32768.0f;
+    case audio_blob::f32:
+        return static_cast<const float *>(src)[i];
+    case audio_blob::d64:
+    default:
+        return static_cast<const double *>(src)[i];
+    }
+}
+
+static inline float clip(float x)
+{
+    return (x < -1.0f ? -1.0f : x > +1.0f ? +1.0f : x);
+}
+
+static inline void write_sample(void *dst, audio_blob::sample_format_t format, size_t i, float x)
+{
+    switch (format)
+    {
+    case audio_blob::u8:
+        static_cast<uint8_t *>(dst)[i] = static_cast<uint8_t>(std::floor(clip(x) * 127.0f + 128.5f));
+        break;
+    case audio_blob::s16:
+        static_cast<int16_t *>(dst)[i] = static_cast<int16_t>(std::floor(clip(x) * 32767.0f + 0.5f));
+        break;
+    case audio_blob::f32:
+        static_cast<float *>(dst)[i] = x;
+        break;
+    case audio_blob::d64:
+        static_cast<double *>(dst)[i] = x;
+        break;
+    }
+}
+
+/* The fast paths. Each returns the number of samples it converted; the scalar
+ * code converts the rest. */
+
+static size_t f32_to_s16(const float *src, int16_t *dst, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= n; i += 8)
+    {
+        // Load both halves before storing, so that this works in place.
+        __m128 x0 = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+        __m128 x1 = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+        // Rounding conversion, then saturating pack: this clips to [-32768,32767].
+        __m128i y = _mm_packs_epi32(_mm_cvtps_epi32(x0), _mm_cvtps_epi32(x1));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), y);
+    }
+#else
+    (void)src;
+    (void)dst;
+    (void)n;
+#endif
+    return i;
+}
+
+static size_t d64_to_f32(const double *src, float *dst, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 x0 = _mm_cvtpd_ps(_mm_loadu_pd(src + i));
+        __m128 x1 = _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2));
+        _mm_storeu_ps(dst + i, _mm_movelh_ps(x0, x1));
+    }
+#else
+    (void)src;
+    (void)dst;
+    (void)n;
+#endif
+    return i;
+}
+
+void convert_audio_samples(const void *src, audio_blob::sample_format_t src_format,
+        void *dst, audio_blob::sample_format_t dst_format, size_t n)
+{
+    if (src_format == dst_format)
+    {
+        if (dst != src)
+        {
+            audio_blob tmp;
+            tmp.sample_format = src_format;
+            std::memmove(dst, src, n * (tmp.sample_bits() / 8));
+        }
+        return;
+    }
+    size_t i = 0;
+    if (src_format == audio_blob::f32 && dst_format == audio_blob::s16)
+    {
+        i = f32_to_s16(static_cast<const float *>(src), static_cast<int16_t *>(dst), n);
+    }
+    else if (src_format == audio_blob::d64 && dst_format == audio_blob::f32)
+    {
+        i = d64_to_f32(static_cast<const double *>(src), static_cast<float *>(dst), n);
+    }
+    for (; i < n; i++)
+    {
+        write_sample(dst, dst_format, i, read_sample(src, src_format, i));
+    }
+}
+
+void convert_audio_samples_s32_to_f32(const int32_t *src, float *dst, size_t n)
+{
+    // Multiplying instead of dividing by the positive or negative maximum gives
+    // the same floats, since 2^31-1 is not representable as a float anyway.
+    const float scale = 1.0f / 2147483648.0f;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 vscale = _mm_set1_ps(scale);
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), vscale));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        dst[i] = src[i] * scale;
+    }
+}
+
+audio_downmix_matrix::audio_downmix_matrix(int c) : channels(c)
+{
+    assert(channels >= 1 && channels <= 8);
+    const float m3db = 0.70710678f;     // -3 dB
+    const float m6db = 0.5f;            // -6 dB
+    for (int i = 0; i < 8; i++)
+    {
+        coef[0][i] = 0.0f;
+        coef[1][i] = 0.0f;
+    }
+    if (channels == 1)
+    {
+        coef[0][0] = m3db;
+        coef[1][0] = m3db;
+        return;
+    }
+    // FL, FR
+    coef[0][0] = 1.0f;
+    coef[1][1] = 1.0f;
+    if (channels == 4)
+    {
+        // BL, BR
+        coef[0][2] = m3db;
+        coef[1][3] = m3db;
+    }
+    else if (channels >= 6)
+    {
+        // FC
+        coef[0][2] = m3db;
+        coef[1][2] = m3db;
+        if (channels == 7)
+        {
+            // BC, SL, SR
+            coef[0][4] = m6db;
+            coef[1][4] = m6db;
+            coef[0][5] = m3db;
+            coef[1][6] = m3db;
+        }
+        else
+        {
+            // BL, BR, and SL, SR for 8 channels
+            for (int i = 4; i < channels; i += 2)
+            {
+                coef[0][i] = m3db;
+                coef[1][i + 1] = m3db;
+            }
+        }
+    }
+    normalize();
+}
+
+void audio_downmix_matrix::normalize()
+{
+    for (int o = 0; o < 2; o++)
+    {
+        float sum = 0.0f;
+        for (int i = 0; i < channels; i++)
+        {
+            sum += std::fabs(coef[o][i]);
+        }
+        if (sum > 1.0f)
+        {
+            for (int i = 0; i < channels; i++)
+            {
+                coef[o][i] /= sum;
+            }
+        }
+    }
+}
+
+void downmix_audio_samples(const float *src, float *dst, size_t n, const audio_downmix_matrix &matrix)
+{
+    const size_t channels = matrix.channels;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // Each frame is one matrix-vector product with a horizontal sum at the end.
+    // Frames are read with 4-float loads, so stop where a load would cross the end.
+    const __m128 l0 = _mm_loadu_ps(matrix.coef[0]);
+    const __m128 l1 = _mm_loadu_ps(matrix.coef[0] + 4);
+    const __m128 r0 = _mm_loadu_ps(matrix.coef[1]);
+    const __m128 r1 = _mm_loadu_ps(matrix.coef[1] + 4);
+    const size_t loads = (channels <= 4 ? 4 : 8);
+    for (; i * channels + loads <= n * channels; i++)
+    {
+        const float *s = src + i * channels;
+        __m128 x0 = _mm_loadu_ps(s);
+        __m128 l = _mm_mul_ps(x0, l0);
+        __m128 r = _mm_mul_ps(x0, r0);
+        if (loads == 8)
+        {
+            __m128 x1 = _mm_loadu_ps(s + 4);
+            l = _mm_add_ps(l, _mm_mul_ps(x1, l1));
+            r = _mm_add_ps(r, _mm_mul_ps(x1, r1));
+        }
+        // The coefficients of unused channels are zero, so loading samples of the
+        // next frame does not matter.
+        __m128 t = _mm_add_ps(_mm_unpacklo_ps(l, r), _mm_unpackhi_ps(l, r));
+        t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+        _mm_storel_pi(reinterpret_cast<__m64 *>(dst + 2 * i), t);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        const float *s = src + i * channels;
+        float l = 0.0f;
+        float r = 0.0f;
+        for (size_t c = 0; c < channels; c++)
+        {
+            l += matrix.coef[0][c] * s[c];
+            r += matrix.coef[1][c] * s[c];
+        }
+        dst[2 * i + 0] = l;
+        dst[2 * i + 1] = r;
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of bino, a 3D video player.
+ *
+ * Copyright (C) 2010-2011
+ * Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIO_CONVERT_H
+#define AUDIO_CONVERT_H
+
+#include <cstddef>
+#include <stdint.h>
+
+#include "media_data.h"
+
+/* Conversion of audio samples between sample formats.
+ * Samples are interleaved. Integer formats are scaled to [-1,1] for
+ * floating point formats; conversions to integer formats clip.
+ * The hot paths use SSE2 if the compiler targets it (always on x86_64); a scalar
+ * fallback handles everything else, including unaligned data. */
+
+/* Convert n samples. Conversions that do not widen the samples (for example
+ * from f32 to s16) can be done in place, i.e. dst may be equal to src. */
+void convert_audio_samples(const void *src, audio_blob::sample_format_t src_format,
+        void *dst, audio_blob::sample_format_t dst_format, size_t n);
+
+/* Convert n signed 32 bit samples to float. This can be done in place. */
+void convert_audio_samples_s32_to_f32(const int32_t *src, float *dst, size_t n);
+
+/* A matrix that mixes up to 8 input channels down to stereo.
+ * The default coefficients follow ITU-R BS.775 for the channel layouts that
+ * audio_blob supports, in FFmpeg channel order: 4 = FL FR BL BR,
+ * 6 = FL FR FC LFE BL BR, 7 = FL FR FC LFE BC SL SR, 8 = FL FR FC LFE BL BR SL SR.
+ * The LFE channel is dropped. The coefficients can be changed freely; call
+ * normalize() afterwards if the output must not clip. */
+class audio_downmix_matrix
+{
+public:
+    int channels;                       // Number of input channels
+    float coef[2][8];                   // Coefficients for the left and right output channel
+
+    audio_downmix_matrix(int channels = 2);
+
+    // Scale the coefficients so that the output cannot exceed the input range.
+    void normalize();
+};
+
+/* Mix n frames of interleaved float samples down to stereo. */
+void downmix_audio_samples(const float *src, float *dst, size_t n, const audio_downmix_matrix &matrix);
+
+#endif
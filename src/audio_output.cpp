@@ -43,7 +43,7 @@
 const size_t audio_output::_num_buffers = 3;
 const size_t audio_output::_buffer_size = 20160 * 2;
 
-audio_output::audio_output() : controller(), _initialized(false)
+audio_output::audio_output() : controller(), _initialized(false), _downmix_matrix(2)
 {
 }
 
@@ -308,32 +308,104 @@ ALenum audio_output::get_al_format(const audio_blob &blob)
             }
         }
     }
+    return format;
+}
+
+ALenum audio_output::get_al_format_and_data(const audio_blob &blob, audio_blob &al_blob)
+{
+    al_blob = blob;
+    ALenum format = get_al_format(al_blob);
+    // If OpenAL does not support the sample format, try f32 (to keep the precision)
+    // and then s16 (which is always supported).
+    if (format == 0 && blob.sample_format != audio_blob::f32)
+    {
+        al_blob.sample_format = audio_blob::f32;
+        format = get_al_format(al_blob);
+    }
+    if (format == 0 && blob.sample_format != audio_blob::s16)
+    {
+        al_blob.sample_format = audio_blob::s16;
+        format = get_al_format(al_blob);
+    }
+    // If OpenAL does not support the number of channels, mix them down to stereo.
+    bool downmix = false;
+    if (format == 0 && blob.channels > 2)
+    {
+        downmix = true;
+        al_blob.channels = 2;
+        al_blob.sample_format = audio_blob::f32;
+        format = get_al_format(al_blob);
+        if (format == 0)
+        {
+            al_blob.sample_format = audio_blob::s16;
+            format = get_al_format(al_blob);
+        }
+    }
     if (format == 0)
     {
         throw exc(str::asprintf(_("No OpenAL format available for "
                         "audio data format %s."), blob.format_name().c_str()));
     }
+    if (downmix)
+    {
+        if (_downmix_matrix.channels != blob.channels)
+        {
+            msg::inf(_("Mixing %d audio channels down to stereo."), blob.channels);
+            _downmix_matrix = audio_downmix_matrix(blob.channels);
+        }
+        size_t frames = blob.size / (blob.channels * blob.sample_bits() / 8);
+        const float *src = static_cast<const float *>(blob.data);
+        if (blob.sample_format != audio_blob::f32)
+        {
+            _conv_buffer.resize(frames * blob.channels * sizeof(float));
+            convert_audio_samples(blob.data, blob.sample_format,
+                    &(_conv_buffer[0]), audio_blob::f32, frames * blob.channels);
+            src = reinterpret_cast<const float *>(&(_conv_buffer[0]));
+        }
+        _downmix_buffer.resize(frames * 2 * sizeof(float));
+        float *dst = reinterpret_cast<float *>(&(_downmix_buffer[0]));
+        downmix_audio_samples(src, dst, frames, _downmix_matrix);
+        // This conversion does not widen the samples, so it can be done in place.
+        convert_audio_samples(dst, audio_blob::f32, dst, al_blob.sample_format, frames * 2);
+        al_blob.data = dst;
+        al_blob.size = frames * 2 * al_blob.sample_bits() / 8;
+    }
+    else if (al_blob.sample_format != blob.sample_format)
+    {
+        size_t samples = blob.size / (blob.sample_bits() / 8);
+        _conv_buffer.resize(samples * (al_blob.sample_bits() / 8));
+        convert_audio_samples(blob.data, blob.sample_format,
+                &(_conv_buffer[0]), al_blob.sample_format, samples);
+        al_blob.data = &(_conv_buffer[0]);
+        al_blob.size = _conv_buffer.size();
+    }
     return format;
 }
 
 void audio_output::data(const audio_blob &blob)
 {
     assert(blob.data);
-    ALenum format = get_al_format(blob);
+    audio_blob al_blob;
+    ALenum format = get_al_format_and_data(blob, al_blob);
+    // The size of one OpenAL buffer after sample format conversion and downmixing,
+    // computed in whole sample frames
+    size_t al_buffer_size = _buffer_size / (blob.channels * blob.sample_bits() / 8)
+        * al_blob.channels * al_blob.sample_bits() / 8;
     msg::dbg(std::string("Buffering ") + str::from(blob.size) + " bytes of audio data.");
     if (_state == 0)
     {
         // Initial buffering
         assert(blob.size == _num_buffers * _buffer_size);
-        char *data = static_cast<char *>(blob.data);
+        al_buffer_size = al_blob.size / _num_buffers;
+        char *data = static_cast<char *>(al_blob.data);
         for (size_t j = 0; j < _num_buffers; j++)
         {
             _buffer_channels.push_back(blob.channels);
             _buffer_sample_bits.push_back(blob.sample_bits());
             _buffer_rates.push_back(blob.rate);
-            alBufferData(_buffers[j], format, data, _buffer_size, blob.rate);
+            alBufferData(_buffers[j], format, data, al_buffer_size, blob.rate);
             alSourceQueueBuffers(_source, 1, &(_buffers[j]));
-            data += _buffer_size;
+            data += al_buffer_size;
         }
         if (alGetError() != AL_NO_ERROR)
         {
@@ -347,7 +419,7 @@ void audio_output::data(const audio_blob &blob)
         ALuint buf = 0;
         alSourceUnqueueBuffers(_source, 1, &buf);
         assert(buf != 0);
-        alBufferData(buf, format, blob.data, _buffer_size, blob.rate);
+        alBufferData(buf, format, al_blob.data, al_buffer_size, blob.rate);
         alSourceQueueBuffers(_source, 1, &buf);
         if (alGetError() != AL_NO_ERROR)
         {
@@ -34,6 +34,7 @@
 #endif
 
 #include "media_data.h"
+#include "audio_convert.h"
 #include "controller.h"
 
 
@@ -57,14 +58,23 @@ private:
     std::vector<int64_t> _buffer_sample_bits;   // Number of sample bits
     std::vector<int64_t> _buffer_rates;         // Sample rate in Hz
 
+    // Buffers for audio data that needs to be converted to a format that OpenAL supports
+    std::vector<unsigned char> _conv_buffer;
+    std::vector<unsigned char> _downmix_buffer;
+    audio_downmix_matrix _downmix_matrix;
+
     // Time management
     int64_t _past_time;                 // Time that represents all finished buffers
     int64_t _last_timestamp;            // 
     int64_t _ext_timer_at_last_timestamp;
     int64_t _last_reported_timestamp;
 
-    // Get an OpenAL source format for the audio data in blob (or throw an exception)
+    // Get an OpenAL source format for the audio data in blob (or 0 if there is none)
     ALenum get_al_format(const audio_blob &blob);
+    // Get an OpenAL source format for the audio data in blob, and convert the
+    // data to a supported sample format and/or downmix it to stereo if necessary
+    // (or throw an exception).
+    ALenum get_al_format_and_data(const audio_blob &blob, audio_blob &al_blob);
 
 public:
     audio_output();
@@ -398,19 +398,8 @@ namespace str
 
     /* Convert a string from one character set to another */
 
-    std::string convert(const std::string &src, const std::string &from_charset, const std::string &to_charset)
+    static std::string convert(iconv_t cd, const std::string &src, const std::string &from_charset, const std::string &to_charset)
     {
-        if (from_charset.compare(to_charset) == 0)
-        {
-            return src;
-        }
-
-        iconv_t cd = iconv_open(to_charset.c_str(), from_charset.c_str());
-        if (cd == reinterpret_cast<iconv_t>(static_cast<size_t>(-1)))
-        {
-            throw exc(str::asprintf(_("Cannot convert %s to %s."), from_charset.c_str(), to_charset.c_str()), errno);
-        }
-
         size_t inbytesleft = src.length() + 1;
         const char *inbuf = src.c_str();
         size_t outbytesleft = inbytesleft;
@@ -425,14 +414,12 @@ namespace str
         char *orig_outbuf = static_cast<char *>(malloc(outbytesleft));
         if (!orig_outbuf)
         {
-            iconv_close(cd);
             throw exc(str::asprintf(_("Cannot convert %s to %s."), from_charset.c_str(), to_charset.c_str()), ENOMEM);
         }
         char *outbuf = orig_outbuf;
 
         size_t s = iconv(cd, const_cast<ICONV_CONST char **>(&inbuf), &inbytesleft, &outbuf, &outbytesleft);
         int saved_errno = errno;
-        iconv_close(cd);
         if (s == static_cast<size_t>(-1))
         {
             free(orig_outbuf);
@@ -452,4 +439,72 @@ namespace str
         free(orig_outbuf);
         return dst;
     }
+
+    std::string convert(const std::string &src, const std::string &from_charset, const std::string &to_charset)
+    {
+        if (from_charset.compare(to_charset) == 0)
+        {
+            return src;
+        }
+
+        iconv_t cd = iconv_open(to_charset.c_str(), from_charset.c_str());
+        if (cd == reinterpret_cast<iconv_t>(static_cast<size_t>(-1)))
+        {
+            throw exc(str::asprintf(_("Cannot convert %s to %s."), from_charset.c_str(), to_charset.c_str()), errno);
+        }
+        try
+        {
+            std::string dst = convert(cd, src, from_charset, to_charset);
+            iconv_close(cd);
+            return dst;
+        }
+        catch (...)
+        {
+            iconv_close(cd);
+            throw;
+        }
+    }
+
+    converter::converter() : _cd(NULL)
+    {
+    }
+
+    converter::~converter()
+    {
+        if (_cd)
+        {
+            iconv_close(static_cast<iconv_t>(_cd));
+        }
+    }
+
+    std::string converter::convert(const std::string &src, const std::string &from_charset, const std::string &to_charset)
+    {
+        if (from_charset.compare(to_charset) == 0)
+        {
+            return src;
+        }
+
+        if (_cd && (from_charset != _from_charset || to_charset != _to_charset))
+        {
+            iconv_close(static_cast<iconv_t>(_cd));
+            _cd = NULL;
+        }
+        if (!_cd)
+        {
+            iconv_t cd = iconv_open(to_charset.c_str(), from_charset.c_str());
+            if (cd == reinterpret_cast<iconv_t>(static_cast<size_t>(-1)))
+            {
+                throw exc(str::asprintf(_("Cannot convert %s to %s."), from_charset.c_str(), to_charset.c_str()), errno);
+            }
+            _cd = cd;
+            _from_charset = from_charset;
+            _to_charset = to_charset;
+        }
+        else
+        {
+            // Reset the conversion state
+            iconv(static_cast<iconv_t>(_cd), NULL, NULL, NULL, NULL);
+        }
+        return str::convert(static_cast<iconv_t>(_cd), src, from_charset, to_charset);
+    }
 }
@@ -99,6 +99,25 @@ namespace str
 
     /* Convert a string from one character set to another */
     std::string convert(const std::string &src, const std::string &from_charset, const std::string &to_charset);
+
+    /* Convert many strings from one character set to another. The conversion
+     * descriptor is kept open as long as the character sets stay the same. */
+    class converter
+    {
+    private:
+        std::string _from_charset;
+        std::string _to_charset;
+        void *_cd;
+
+        converter(const converter &);
+        converter &operator=(const converter &);
+
+    public:
+        converter();
+        ~converter();
+
+        std::string convert(const std::string &src, const std::string &from_charset, const std::string &to_charset);
+    };
 }
 
 #endif
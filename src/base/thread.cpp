@@ -81,6 +81,61 @@ void mutex::unlock()
 }
 
 
+const pthread_cond_t condition::_cond_initializer = PTHREAD_COND_INITIALIZER;
+
+condition::condition() : _cond(_cond_initializer)
+{
+    int e = pthread_cond_init(&_cond, NULL);
+    if (e != 0)
+    {
+        throw exc(str::asprintf(_("Cannot initialize condition: %s"), std::strerror(e)), e);
+    }
+}
+
+condition::condition(const condition &) : _cond(_cond_initializer)
+{
+    // You cannot have multiple copies of the same condition.
+    // Instead, we create a new one. This allows easier use of conditions in STL containers.
+    int e = pthread_cond_init(&_cond, NULL);
+    if (e != 0)
+    {
+        throw exc(str::asprintf(_("Cannot initialize condition: %s"), std::strerror(e)), e);
+    }
+}
+
+condition::~condition()
+{
+    (void)pthread_cond_destroy(&_cond);
+}
+
+void condition::wait(mutex &m)
+{
+    int e = pthread_cond_wait(&_cond, &m._mutex);
+    if (e != 0)
+    {
+        throw exc(str::asprintf(_("Cannot wait for condition: %s"), std::strerror(e)), e);
+    }
+}
+
+void condition::wake_one()
+{
+    int e = pthread_cond_signal(&_cond);
+    if (e != 0)
+    {
+        throw exc(str::asprintf(_("Cannot signal condition: %s"), std::strerror(e)), e);
+    }
+}
+
+void condition::wake_all()
+{
+    int e = pthread_cond_broadcast(&_cond);
+    if (e != 0)
+    {
+        throw exc(str::asprintf(_("Cannot broadcast condition: %s"), std::strerror(e)), e);
+    }
+}
+
+
 thread::thread() :
     __thread_id(pthread_self()),
     __joinable(false),
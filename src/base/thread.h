@@ -85,6 +85,8 @@ private:
     static const pthread_mutex_t _mutex_initializer;
     pthread_mutex_t _mutex;
 
+    friend class condition;
+
 public:
     // Constructor / Destructor
     mutex();
@@ -100,6 +102,31 @@ public:
 };
 
 
+/*
+ * Condition
+ */
+
+class condition
+{
+private:
+    static const pthread_cond_t _cond_initializer;
+    pthread_cond_t _cond;
+
+public:
+    // Constructor / Destructor
+    condition();
+    condition(const condition &c);
+    ~condition();
+
+    // Wait for the condition. The calling thread must have the mutex locked.
+    void wait(mutex &m);
+    // Wake one thread that waits on the condition.
+    void wake_one();
+    // Wake all threads that wait on the condition.
+    void wake_all();
+};
+
+
 /*
  * Thread
  *
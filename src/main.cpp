@@ -241,6 +241,36 @@ int main(int argc, char *argv[])
     options.push_back(&audio);
     opt::val<int> subtitle("subtitle", 's', opt::optional, 0, 999, 0);
     options.push_back(&subtitle);
+    opt::val<int> decode_ahead("decode-ahead", '\0', opt::optional, 1, 64, player_init_data().decode_ahead);
+    options.push_back(&decode_ahead);
+    opt::val<int> idle_release("idle-release", '\0', opt::optional, 0, 999999, player_init_data().idle_release);
+    options.push_back(&idle_release);
+    opt::val<int> exact_seek("exact-seek", '\0', opt::optional, 0, 999999, player_init_data().exact_seek);
+    options.push_back(&exact_seek);
+    opt::val<int> probe_size("probe-size", '\0', opt::optional, 0, 999999999, player_init_data().probe_size);
+    options.push_back(&probe_size);
+    opt::val<int> probe_duration("probe-duration", '\0', opt::optional, 0, 999999, player_init_data().probe_duration);
+    options.push_back(&probe_duration);
+    opt::flag cache_stream_info("cache-stream-info", '\0', opt::optional);
+    options.push_back(&cache_stream_info);
+    opt::flag index_keyframes("index-keyframes", '\0', opt::optional);
+    options.push_back(&index_keyframes);
+    std::vector<std::string> threading_types;
+    threading_types.push_back("auto");
+    threading_types.push_back("frame");
+    threading_types.push_back("slice");
+    opt::val<std::string> threading("threading", '\0', opt::optional, threading_types, "auto");
+    options.push_back(&threading);
+    opt::val<int> threads("threads", '\0', opt::optional, 0, 64, player_init_data().threading.threads);
+    options.push_back(&threads);
+    opt::val<int> thread_budget("thread-budget", '\0', opt::optional, 0, 1024, player_init_data().threading.budget);
+    options.push_back(&thread_budget);
+    opt::val<int> queue_duration("queue-duration", '\0', opt::optional, 0, 999999, player_init_data().queue_duration);
+    options.push_back(&queue_duration);
+    opt::val<int> queue_memory("queue-memory", '\0', opt::optional, 0, 4095, player_init_data().queue_memory);
+    options.push_back(&queue_memory);
+    opt::val<int> read_ahead("read-ahead", '\0', opt::optional, 0, 1024, player_init_data().read_ahead);
+    options.push_back(&read_ahead);
     std::vector<std::string> video_output_modes;
     video_output_modes.push_back("mono-left");
     video_output_modes.push_back("mono-right");
@@ -388,6 +418,30 @@ int main(int argc, char *argv[])
                     "  -v|--video=STREAM        Select video stream (1-n, depending on input).\n"
                     "  -a|--audio=STREAM        Select audio stream (1-n, depending on input).\n"
                     "  -s|--subtitle=STREAM     Select subtitle stream (0-n, dep. on input).\n"
+                    "  --decode-ahead=N         Decode up to N video frames ahead (default 4).\n"
+                    "  --idle-release=N         Release buffers after N seconds of pause\n"
+                    "                           (default 0: never).\n"
+                    "  --exact-seek=MS          Seek exactly, using up to MS milliseconds of\n"
+                    "                           decoding (default 0: seek to keyframes).\n"
+                    "  --probe-size=N           Read at most N bytes to detect the streams\n"
+                    "                           (default 0: FFmpeg default).\n"
+                    "  --probe-duration=MS      Read at most MS milliseconds to detect the\n"
+                    "                           streams (default 0: FFmpeg default).\n"
+                    "  --cache-stream-info      Cache detected streams of input files.\n"
+                    "  --index-keyframes        Index keyframes of MPEG-PS/TS files in the\n"
+                    "                           background for fast, accurate seeking.\n"
+                    "  --threading=TYPE         Video decoding threading type: auto (default),\n"
+                    "                           frame, or slice.\n"
+                    "  --threads=N              Use N threads per video stream (default 0:\n"
+                    "                           share of the thread budget).\n"
+                    "  --thread-budget=N        Share N threads among the video streams that\n"
+                    "                           are decoded (default 0: one per processor).\n"
+                    "  --queue-duration=MS      Read ahead MS milliseconds per stream\n"
+                    "                           (default 2000).\n"
+                    "  --queue-memory=MB        Use at most MB MiB for reading ahead\n"
+                    "                           (default 256, 0: unlimited).\n"
+                    "  --read-ahead=MB          Read MB MiB of input files ahead in a separate\n"
+                    "                           thread (default 16, 0: off).\n"
                     "  -i|--input=TYPE          Select input type (default autodetect):\n"
                     "    mono                     Single view.\n"
                     "    separate-left-right      Left/right separate streams, left first.\n"
@@ -548,6 +602,21 @@ int main(int argc, char *argv[])
     init_data.video_stream = video.value() - 1;
     init_data.audio_stream = audio.value() - 1;
     init_data.subtitle_stream = subtitle.value() - 1;
+    init_data.decode_ahead = decode_ahead.value();
+    init_data.idle_release = idle_release.value();
+    init_data.exact_seek = exact_seek.value();
+    init_data.probe_size = probe_size.value();
+    init_data.probe_duration = probe_duration.value();
+    init_data.cache_stream_info = cache_stream_info.value();
+    init_data.index_keyframes = index_keyframes.value();
+    init_data.threading.type = (threading.value() == "frame" ? decoder_threading::frame
+            : threading.value() == "slice" ? decoder_threading::slice
+            : decoder_threading::automatic);
+    init_data.threading.threads = threads.value();
+    init_data.threading.budget = thread_budget.value();
+    init_data.queue_duration = queue_duration.value();
+    init_data.queue_memory = queue_memory.value();
+    init_data.read_ahead = read_ahead.value();
     if (input_mode.value() == "")
     {
         init_data.stereo_layout_override = false;
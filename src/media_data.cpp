@@ -22,8 +22,11 @@
 #include "config.h"
 
 #include <limits>
+#include <cstdlib>
 #include <cstring>
+#include <cerrno>
 #include <cmath>
+#include <vector>
 
 #include "gettext.h"
 #define _(string) gettext(string)
@@ -33,6 +36,8 @@
 #include "str.h"
 #include "msg.h"
 #include "dbg.h"
+#include "exc.h"
+#include "thread.h"
 
 
 device_request::device_request() :
@@ -65,6 +70,246 @@ void device_request::load(std::istream &is)
 }
 
 
+decoder_threading::decoder_threading() :
+    type(automatic),
+    threads(0),
+    budget(0)
+{
+}
+
+void decoder_threading::save(std::ostream &os) const
+{
+    s11n::save(os, static_cast<int>(type));
+    s11n::save(os, threads);
+    s11n::save(os, budget);
+}
+
+void decoder_threading::load(std::istream &is)
+{
+    int x;
+    s11n::load(is, x);
+    type = static_cast<type_t>(x);
+    s11n::load(is, threads);
+    s11n::load(is, budget);
+}
+
+
+/* The state of a frame buffer pool. It is shared by the pool and all buffers
+ * that were taken from it, so that it stays valid until the last of them is gone. */
+struct frame_buffer_pool_data
+{
+    mutex lock;
+    int refcount;                       // The pool itself plus all buffers taken from it
+    bool alive;                         // Whether the pool itself still exists
+    size_t size;                        // Size of the pooled memory blocks
+    std::vector<void *> free_mem;       // Unused memory blocks
+};
+
+static void *frame_buffer_alloc(size_t size)
+{
+    void *mem = std::malloc(size + frame_buffer::alignment - 1);
+    if (!mem)
+    {
+        throw exc(HERE + ": " + std::strerror(ENOMEM));
+    }
+    return mem;
+}
+
+static void *frame_buffer_align(void *mem)
+{
+    uintptr_t p = reinterpret_cast<uintptr_t>(mem);
+    p = (p + frame_buffer::alignment - 1) & ~static_cast<uintptr_t>(frame_buffer::alignment - 1);
+    return reinterpret_cast<void *>(p);
+}
+
+static void frame_buffer_pool_data_unref(struct frame_buffer_pool_data *data)
+{
+    data->lock.lock();
+    bool last = (--data->refcount == 0);
+    data->lock.unlock();
+    if (last)
+    {
+        for (size_t i = 0; i < data->free_mem.size(); i++)
+        {
+            std::free(data->free_mem[i]);
+        }
+        delete data;
+    }
+}
+
+frame_buffer::frame_buffer() : _rep(NULL)
+{
+}
+
+frame_buffer::frame_buffer(size_t size) : _rep(NULL)
+{
+    void *mem = frame_buffer_alloc(size);
+    _rep = new struct rep;
+    _rep->refcount = 1;
+    _rep->size = size;
+    _rep->ptr = frame_buffer_align(mem);
+    _rep->mem = mem;
+    _rep->pool = NULL;
+}
+
+frame_buffer::frame_buffer(const frame_buffer &fb) : _rep(fb._rep)
+{
+    if (_rep)
+    {
+        atomic::increment(&(_rep->refcount));
+    }
+}
+
+frame_buffer::~frame_buffer()
+{
+    unref();
+}
+
+void frame_buffer::unref()
+{
+    if (_rep && atomic::decrement(&(_rep->refcount)) == 0)
+    {
+        struct frame_buffer_pool_data *pool = _rep->pool;
+        bool keep = false;
+        if (pool)
+        {
+            pool->lock.lock();
+            keep = (pool->alive && pool->size == _rep->size);
+            if (keep)
+            {
+                pool->free_mem.push_back(_rep->mem);
+            }
+            pool->lock.unlock();
+        }
+        if (!keep)
+        {
+            std::free(_rep->mem);
+        }
+        if (pool)
+        {
+            frame_buffer_pool_data_unref(pool);
+        }
+        delete _rep;
+    }
+    _rep = NULL;
+}
+
+const frame_buffer &frame_buffer::operator=(const frame_buffer &fb)
+{
+    if (fb._rep != _rep)
+    {
+        if (fb._rep)
+        {
+            atomic::increment(&(fb._rep->refcount));
+        }
+        unref();
+        _rep = fb._rep;
+    }
+    return *this;
+}
+
+
+frame_buffer_pool::frame_buffer_pool() : _data(new struct frame_buffer_pool_data)
+{
+    _data->refcount = 1;
+    _data->alive = true;
+    _data->size = 0;
+}
+
+frame_buffer_pool::frame_buffer_pool(const frame_buffer_pool &) : _data(new struct frame_buffer_pool_data)
+{
+    _data->refcount = 1;
+    _data->alive = true;
+    _data->size = 0;
+}
+
+frame_buffer_pool::~frame_buffer_pool()
+{
+    unref();
+}
+
+void frame_buffer_pool::unref()
+{
+    clear();
+    _data->lock.lock();
+    _data->alive = false;
+    _data->lock.unlock();
+    frame_buffer_pool_data_unref(_data);
+    _data = NULL;
+}
+
+const frame_buffer_pool &frame_buffer_pool::operator=(const frame_buffer_pool &pool)
+{
+    if (&pool != this)
+    {
+        struct frame_buffer_pool_data *data = new struct frame_buffer_pool_data;
+        data->refcount = 1;
+        data->alive = true;
+        data->size = 0;
+        unref();
+        _data = data;
+    }
+    return *this;
+}
+
+frame_buffer frame_buffer_pool::get(size_t size)
+{
+    void *mem = NULL;
+    std::vector<void *> stale_mem;
+    _data->lock.lock();
+    if (size != _data->size)
+    {
+        stale_mem.swap(_data->free_mem);
+        _data->size = size;
+    }
+    else if (!_data->free_mem.empty())
+    {
+        mem = _data->free_mem.back();
+        _data->free_mem.pop_back();
+    }
+    _data->refcount++;
+    _data->lock.unlock();
+    for (size_t i = 0; i < stale_mem.size(); i++)
+    {
+        std::free(stale_mem[i]);
+    }
+
+    frame_buffer fb;
+    try
+    {
+        if (!mem)
+        {
+            mem = frame_buffer_alloc(size);
+        }
+        fb._rep = new struct frame_buffer::rep;
+    }
+    catch (...)
+    {
+        std::free(mem);
+        frame_buffer_pool_data_unref(_data);
+        throw;
+    }
+    fb._rep->refcount = 1;
+    fb._rep->size = size;
+    fb._rep->ptr = frame_buffer_align(mem);
+    fb._rep->mem = mem;
+    fb._rep->pool = _data;
+    return fb;
+}
+
+void frame_buffer_pool::clear()
+{
+    std::vector<void *> unused_mem;
+    _data->lock.lock();
+    unused_mem.swap(_data->free_mem);
+    _data->lock.unlock();
+    for (size_t i = 0; i < unused_mem.size(); i++)
+    {
+        std::free(unused_mem[i]);
+    }
+}
+
+
 video_frame::video_frame() :
     raw_width(-1),
     raw_height(-1),
@@ -476,6 +721,7 @@ int audio_blob::sample_bits() const
 
 subtitle_box::subtitle_box() :
     language(),
+    stream_id(),
     format(text),
     style(),
     str(),
@@ -539,6 +785,7 @@ void subtitle_box::image_t::load(std::istream &is)
 void subtitle_box::save(std::ostream &os) const
 {
     s11n::save(os, language);
+    s11n::save(os, stream_id);
     s11n::save(os, static_cast<int>(format));
     s11n::save(os, style);
     s11n::save(os, str);
@@ -550,6 +797,7 @@ void subtitle_box::save(std::ostream &os) const
 void subtitle_box::load(std::istream &is)
 {
     s11n::load(is, language);
+    s11n::load(is, stream_id);
     int x;
     s11n::load(is, x);
     format = static_cast<format_t>(x);
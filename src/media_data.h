@@ -59,6 +59,103 @@ public:
     void load(std::istream &is);
 };
 
+class decoder_threading : public s11n
+{
+public:
+    typedef enum
+    {
+        automatic,      // Frame threading if the codec supports it (except for devices), else slice threading.
+        frame,          // Decode multiple frames in parallel. This adds one frame of latency per thread.
+        slice,          // Decode the slices of a frame in parallel.
+    } type_t;
+
+    type_t type;        // The threading type.
+    int threads;        // Threads per video stream (0 means a share of the budget).
+    int budget;         // Threads for all video streams that are decoded at the same time
+                        // (0 means one per processor).
+
+    // Constructor
+    decoder_threading();
+
+    // Serialization
+    void save(std::ostream &os) const;
+    void load(std::istream &is);
+};
+
+struct frame_buffer_pool_data;
+
+// A reference-counted buffer for video frame data.
+// Copies of a frame buffer share the same memory, which is freed (or returned
+// to its pool) when the last copy is destroyed. This allows a video frame to own
+// its data. The memory is aligned for SIMD access.
+class frame_buffer
+{
+private:
+    struct rep
+    {
+        int refcount;
+        size_t size;
+        void *ptr;                              // Aligned memory
+        void *mem;                              // Allocated memory
+        struct frame_buffer_pool_data *pool;    // The pool that gets the memory back, or NULL
+    };
+    struct rep *_rep;
+
+    void unref();
+
+    friend class frame_buffer_pool;
+
+public:
+    // Memory alignment, in bytes
+    static const size_t alignment = 32;
+
+    // Constructor / Destructor
+    frame_buffer();
+    frame_buffer(size_t size);
+    frame_buffer(const frame_buffer &fb);
+    ~frame_buffer();
+
+    const frame_buffer &operator=(const frame_buffer &fb);
+
+    // The memory. NULL and 0 if the buffer is unused.
+    void *ptr() const
+    {
+        return (_rep ? _rep->ptr : NULL);
+    }
+    size_t size() const
+    {
+        return (_rep ? _rep->size : 0);
+    }
+};
+
+// A pool of memory for frame buffers.
+// The memory of a frame buffer that was taken from a pool goes back to the pool
+// when the last copy of the buffer is destroyed, and is reused for the next
+// buffer of the same size. This is meant for frames of constant geometry; when
+// the requested size changes, the unused memory is freed.
+class frame_buffer_pool
+{
+private:
+    struct frame_buffer_pool_data *_data;
+
+    void unref();
+
+public:
+    // Constructor / Destructor
+    frame_buffer_pool();
+    frame_buffer_pool(const frame_buffer_pool &pool);
+    ~frame_buffer_pool();
+
+    // You cannot have multiple copies of the same pool.
+    // Instead, a copy is a new, empty pool.
+    const frame_buffer_pool &operator=(const frame_buffer_pool &pool);
+
+    // Get a buffer of the given size.
+    frame_buffer get(size_t size);
+    // Free all memory that is currently unused.
+    void clear();
+};
+
 class video_frame
 {
 public:
@@ -120,10 +217,12 @@ public:
     chroma_location_t chroma_location;  // Chroma sample location
     stereo_layout_t stereo_layout;      // Stereo layout
     bool stereo_layout_swap;            // Whether the stereo layout needs to swap left and right view
-    // The data. Note that a frame does not own the data stored in these pointers,
-    // so it does not free them on destruction.
+    // The data. If the buffer of a view is used, the frame shares ownership of the
+    // data of that view. Otherwise, the frame does not own the data stored in these
+    // pointers, and the data is only valid as long as its owner keeps it.
     void *data[2][3];                   // Data pointer for 1-3 planes in 1-2 views. NULL if unused.
     size_t line_size[2][3];             // Line size for 1-3 planes in 1-2 views. 0 if unused.
+    frame_buffer buffer[2];             // Buffer holding the data of each view. Unused if not owned.
 
     int64_t presentation_time;          // Presentation timestamp
 
@@ -221,6 +320,7 @@ public:
 
     // Description of the content
     std::string language;               // Language information (empty if unknown)
+    std::string stream_id;              // Identifies the subtitle stream that the box belongs to
 
     // Data
     format_t format;                    // Subtitle data format
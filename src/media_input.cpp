@@ -23,6 +23,7 @@
 #include "config.h"
 
 #include <limits>
+#include <algorithm>
 
 #include "gettext.h"
 #define _(string) gettext(string)
@@ -31,10 +32,50 @@
 #include "exc.h"
 #include "msg.h"
 #include "str.h"
+#include "thread.h"
+#include "timer.h"
 
 #include "media_input.h"
 
 
+// The open thread.
+// media_input::open() opens each of its media objects in a thread of its own,
+// so that the latency of opening files and detecting their streams is only
+// paid once for inputs that consist of multiple files.
+class media_object_open_thread : public thread
+{
+private:
+    media_object *_media_object;
+    std::string _url;
+    device_request _dev_request;
+    int _decode_ahead;
+    int64_t _probe_size;
+    int64_t _probe_duration;
+    bool _cache_stream_info;
+    bool _index_keyframes;
+    decoder_threading _threading;
+    int64_t _queue_duration;
+    size_t _read_ahead;
+
+public:
+    media_object_open_thread(media_object *media_object, const std::string &url,
+            const device_request &dev_request, int decode_ahead,
+            int64_t probe_size, int64_t probe_duration, bool cache_stream_info, bool index_keyframes,
+            const decoder_threading &threading, int64_t queue_duration, size_t read_ahead) :
+        _media_object(media_object), _url(url), _dev_request(dev_request),
+        _decode_ahead(decode_ahead), _probe_size(probe_size), _probe_duration(probe_duration),
+        _cache_stream_info(cache_stream_info), _index_keyframes(index_keyframes), _threading(threading), _queue_duration(queue_duration),
+        _read_ahead(read_ahead)
+    {
+    }
+
+    void run()
+    {
+        _media_object->open(_url, _dev_request, _decode_ahead, _probe_size, _probe_duration,
+                _cache_stream_info, _index_keyframes, _threading, _queue_duration, _read_ahead);
+    }
+};
+
 media_input::media_input() :
     _active_video_stream(-1), _active_audio_stream(-1), _active_subtitle_stream(-1),
     _have_active_video_read(false), _have_active_audio_read(false), _have_active_subtitle_read(false),
@@ -108,17 +149,58 @@ static std::string basename(const std::string &url)
     }
 }
 
-void media_input::open(const std::vector<std::string> &urls, const device_request &dev_request)
+void media_input::open(const std::vector<std::string> &urls, const device_request &dev_request,
+        int decode_ahead, int64_t probe_size, int64_t probe_duration, bool cache_stream_info,
+        bool index_keyframes, const decoder_threading &threading, int64_t queue_duration, size_t queue_memory,
+        size_t read_ahead)
 {
     assert(urls.size() > 0);
     assert(!dev_request.is_device() || urls.size() == 1);
 
-    // Open media objects
+    media_object::set_queue_memory(queue_memory);
+
+    // Open media objects. Multiple media objects are opened in parallel; if
+    // some of them fail, all errors are reported together.
     _is_device = dev_request.is_device();
     _media_objects.resize(urls.size());
-    for (size_t i = 0; i < urls.size(); i++)
+    if (urls.size() == 1)
+    {
+        _media_objects[0].open(urls[0], dev_request, decode_ahead, probe_size, probe_duration,
+                cache_stream_info, index_keyframes, threading, queue_duration, read_ahead);
+    }
+    else
     {
-        _media_objects[i].open(urls[i], dev_request);
+        int64_t open_time = timer::get_microseconds(timer::monotonic);
+        std::vector<media_object_open_thread> open_threads;
+        for (size_t i = 0; i < urls.size(); i++)
+        {
+            open_threads.push_back(media_object_open_thread(&(_media_objects[i]), urls[i],
+                        dev_request, decode_ahead, probe_size, probe_duration, cache_stream_info,
+                        index_keyframes, threading, queue_duration, read_ahead));
+        }
+        for (size_t i = 0; i < open_threads.size(); i++)
+        {
+            open_threads[i].start();
+        }
+        std::string errors;
+        for (size_t i = 0; i < open_threads.size(); i++)
+        {
+            open_threads[i].wait();
+            if (!open_threads[i].exception().empty())
+            {
+                if (!errors.empty())
+                {
+                    errors += '\n';
+                }
+                errors += open_threads[i].exception().what();
+            }
+        }
+        if (!errors.empty())
+        {
+            throw exc(errors);
+        }
+        msg::inf(_("Opened %d inputs in parallel in %g ms."), static_cast<int>(urls.size()),
+                (timer::get_microseconds(timer::monotonic) - open_time) / 1e3f);
     }
 
     // Construct id for this input
@@ -505,6 +587,12 @@ void media_input::select_video_stream(int video_stream)
             }
         }
     }
+    // The decoders of the active video streams share the decoding threads.
+    for (size_t i = 0; i < _media_objects.size(); i++)
+    {
+        _media_objects[i].set_concurrent_video_streams(
+                _video_frame.stereo_layout == video_frame::separate ? 2 : 1);
+    }
 }
 
 void media_input::select_audio_stream(int audio_stream)
@@ -615,6 +703,8 @@ video_frame media_input::finish_video_frame_read()
                 frame.line_size[0][p] = f0.line_size[0][p];
                 frame.line_size[1][p] = f1.line_size[0][p];
             }
+            frame.buffer[0] = f0.buffer[0];
+            frame.buffer[1] = f1.buffer[0];
             frame.presentation_time = f0.presentation_time;
         }
     }
@@ -631,13 +721,79 @@ video_frame media_input::finish_video_frame_read()
                 frame.data[0][p] = f.data[0][p];
                 frame.line_size[0][p] = f.line_size[0][p];
             }
+            frame.buffer[0] = f.buffer[0];
             frame.presentation_time = f.presentation_time;
+            // The frame may have a reduced size; see media_object::set_video_lowres().
+            frame.raw_width = f.raw_width;
+            frame.raw_height = f.raw_height;
+            frame.set_view_dimensions();
         }
     }
     _have_active_video_read = false;
     return frame;
 }
 
+int media_input::video_frames_ahead()
+{
+    assert(_active_video_stream >= 0);
+    int frames;
+    if (_video_frame.stereo_layout == video_frame::separate)
+    {
+        int o0, s0, o1, s1;
+        get_video_stream(0, o0, s0);
+        get_video_stream(1, o1, s1);
+        frames = std::min(_media_objects[o0].video_frames_ahead(s0),
+                _media_objects[o1].video_frames_ahead(s1));
+    }
+    else
+    {
+        int o, s;
+        get_video_stream(_active_video_stream, o, s);
+        frames = _media_objects[o].video_frames_ahead(s);
+    }
+    return frames;
+}
+
+void media_input::report_video_lateness(int64_t lateness)
+{
+    assert(_active_video_stream >= 0);
+    if (_video_frame.stereo_layout == video_frame::separate)
+    {
+        int o0, s0, o1, s1;
+        get_video_stream(0, o0, s0);
+        get_video_stream(1, o1, s1);
+        _media_objects[o0].report_video_lateness(s0, lateness);
+        _media_objects[o1].report_video_lateness(s1, lateness);
+    }
+    else
+    {
+        int o, s;
+        get_video_stream(_active_video_stream, o, s);
+        _media_objects[o].report_video_lateness(s, lateness);
+    }
+}
+
+void media_input::set_video_lowres(int lowres)
+{
+    assert(_active_video_stream >= 0);
+    if (_video_frame.stereo_layout == video_frame::separate)
+    {
+        // The two views cannot switch their size at the same frame, so they are
+        // always decoded at full size.
+        int o0, s0, o1, s1;
+        get_video_stream(0, o0, s0);
+        get_video_stream(1, o1, s1);
+        _media_objects[o0].set_video_lowres(s0, 0);
+        _media_objects[o1].set_video_lowres(s1, 0);
+    }
+    else
+    {
+        int o, s;
+        get_video_stream(_active_video_stream, o, s);
+        _media_objects[o].set_video_lowres(s, lowres);
+    }
+}
+
 void media_input::start_audio_blob_read(size_t size)
 {
     assert(_active_audio_stream >= 0);
@@ -665,7 +821,7 @@ audio_blob media_input::finish_audio_blob_read()
     return _media_objects[o].finish_audio_blob_read(s);
 }
 
-void media_input::start_subtitle_box_read()
+void media_input::start_subtitle_box_read(int64_t min_stop_time)
 {
     assert(_active_subtitle_stream >= 0);
     if (_have_active_subtitle_read)
@@ -674,7 +830,7 @@ void media_input::start_subtitle_box_read()
     }
     int o, s;
     get_subtitle_stream(_active_subtitle_stream, o, s);
-    _media_objects[o].start_subtitle_box_read(s);
+    _media_objects[o].start_subtitle_box_read(s, min_stop_time);
     _have_active_subtitle_read = true;
 }
 
@@ -708,7 +864,27 @@ int64_t media_input::tell()
     return pos;
 }
 
-void media_input::seek(int64_t pos)
+void media_input::seek(int64_t pos, int64_t exact_budget)
+{
+    if (_have_active_video_read)
+    {
+        (void)finish_video_frame_read();
+    }
+    if (_have_active_audio_read)
+    {
+        (void)finish_audio_blob_read();
+    }
+    if (_have_active_subtitle_read)
+    {
+        (void)finish_subtitle_box_read();
+    }
+    for (size_t i = 0; i < _media_objects.size(); i++)
+    {
+        _media_objects[i].seek(pos, exact_budget);
+    }
+}
+
+void media_input::release_buffers()
 {
     if (_have_active_video_read)
     {
@@ -724,7 +900,7 @@ void media_input::seek(int64_t pos)
     }
     for (size_t i = 0; i < _media_objects.size(); i++)
     {
-        _media_objects[i].seek(pos);
+        _media_objects[i].release_buffers();
     }
 }
 
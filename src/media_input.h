@@ -70,9 +70,17 @@ public:
     ~media_input();
 
     /* Open this input by combining the media objects at the given URLS.
-     * A device can only have a single URL. */
-
-    void open(const std::vector<std::string> &urls, const device_request &dev_request = device_request());
+     * A device can only have a single URL.
+     * Up to decode_ahead video frames are decoded ahead of time.
+     * The probe_size, probe_duration, cache_stream_info, index_keyframes, threading,
+     * queue_duration and read_ahead settings are passed to media_object::open(), and queue_memory is passed to
+     * media_object::set_queue_memory(). The media objects are opened in parallel. */
+
+    void open(const std::vector<std::string> &urls, const device_request &dev_request = device_request(),
+            int decode_ahead = 4, int64_t probe_size = 0, int64_t probe_duration = 0,
+            bool cache_stream_info = false, bool index_keyframes = false,
+            const decoder_threading &threading = decoder_threading(),
+            int64_t queue_duration = 2000000, size_t queue_memory = 0, size_t read_ahead = 0);
 
     /* Get information */
 
@@ -189,6 +197,14 @@ public:
     /* Wait for the video frame reading to finish, and return the frame.
      * An invalid frame means that EOF was reached. */
     video_frame finish_video_frame_read();
+    /* Return the number of video frames that are already decoded and ready. */
+    int video_frames_ahead();
+    /* Report how late (in microseconds) a video frame was shown; see
+     * media_object::report_video_lateness(). */
+    void report_video_lateness(int64_t lateness);
+    /* Request video frames reduced to 1/2^lowres of their size; see
+     * media_object::set_video_lowres(). */
+    void set_video_lowres(int lowres);
 
     /* Start to read the given amount of audio data from the active stream asynchronously
      * (in a separate thread). */
@@ -198,8 +214,8 @@ public:
     audio_blob finish_audio_blob_read();
 
     /* Start to read a subtitle box from the active stream asynchronously
-     * (in a separate thread). */
-    void start_subtitle_box_read();
+     * (in a separate thread). Boxes that stop before min_stop_time are skipped. */
+    void start_subtitle_box_read(int64_t min_stop_time = std::numeric_limits<int64_t>::min());
     /* Wait for the subtitle data reading to finish, and return the box.
      * An invalid box means that EOF was reached. */
     subtitle_box finish_subtitle_box_read();
@@ -213,8 +229,16 @@ public:
      * The real position after seeking is only revealed after reading the next video frame
      * or audio blob. This position may differ from the requested position for various
      * reasons (seeking is only possible to keyframes, seeking is not supported by the
-     * stream, ...) */
-    void seek(int64_t pos);
+     * stream, ...)
+     * If exact_budget is positive, the seek is exact within that time budget in
+     * microseconds; see media_object::seek().
+     * The media objects of the input seek concurrently. */
+    void seek(int64_t pos, int64_t exact_budget = 0);
+
+    /* Stop all reading and free all buffered data and all unused buffer memory,
+     * e.g. during a long pause. Frames that were already read stay valid.
+     * The next seek() restarts everything. */
+    void release_buffers();
 
     /*
      * Cleanup
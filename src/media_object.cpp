@@ -29,19 +29,33 @@ extern "C"
 #include <libavdevice/avdevice.h>
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
+#include <libavutil/pixdesc.h>
 }
 
 #include <deque>
 #include <limits>
+#include <fstream>
+#include <algorithm>
 #include <cerrno>
+#include <cstdio>
 #include <cstring>
+#include <cstdlib>
 #include <cctype>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#if (defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__
+#  include <direct.h>
+#endif
+
 #if HAVE_SYSCONF
 #  include <unistd.h>
 #else
 #  include <windows.h>
 #endif
+#if HAVE_POSIX_FADVISE
+#  include <fcntl.h>
+#endif
 
 #include "gettext.h"
 #define _(string) gettext(string)
@@ -51,34 +65,457 @@ extern "C"
 #include "exc.h"
 #include "msg.h"
 #include "str.h"
+#include "s11n.h"
 #include "thread.h"
+#include "timer.h"
 
 #include "media_object.h"
+#include "audio_convert.h"
+#include "video_convert.h"
+
+
+// The packet queues.
+// The read thread is the only producer; each decode thread consumes the packets
+// of its own stream. All queues of a media object share one mutex and one
+// condition, so that the read thread can sleep while the queues are full, but is
+// woken up as soon as one of the decode threads runs out of packets.
+// Seeking does not stop any threads. Instead, each seek starts a new generation:
+// the read thread seeks the input before it reads the next packet, and packets and
+// video frames are stamped with the generation they belong to. Packets and frames
+// of older generations are stale and are dropped by the queues.
+struct packet_queue_sync
+{
+    mutex lock;
+    condition cond;
+    int starving;           // Number of audio and video decode threads that wait for packets
+    bool eof;               // The read thread reached the end of the input
+    bool aborted;           // All waiting threads must give up
+    int generation;         // The current generation; only changed by request_seek()
+    bool seek_pending;      // The read thread has not yet handled the last seek request
+    int64_t seek_pos;       // Position of the last seek request
+    bool seek_backward;     // Whether to seek to a keyframe before seek_pos
+    int64_t seek_target;    // Target of exact seeking, or the minimum value
+    int64_t seek_deadline;  // Time at which exact seeking gives up
+    exc read_error;         // The error that ended reading in the current generation
+    bool overfull;          // A queue exceeded its limits because a decoder starved
+
+    packet_queue_sync() : starving(0), eof(false), aborted(false), generation(0),
+        seek_pending(false), seek_pos(0), seek_backward(false),
+        seek_target(std::numeric_limits<int64_t>::min()), seek_deadline(0),
+        overfull(false)
+    {
+    }
+
+    // Signal the end of the input, or a read error, for the given generation.
+    // Nothing happens if the generation is stale.
+    void set_eof(int gen, const exc &e = exc());
+    // Make all threads that wait for a packet queue return
+    void abort();
+    // Reset the eof and aborted states
+    void reset();
+    // Start a new generation and ask the read thread to seek.
+    void request_seek(int64_t pos, bool backward, int64_t target, int64_t deadline);
+    // Get the exact seeking target and deadline of the given generation.
+    void get_seek_target(int gen, int64_t *target, int64_t *deadline);
+    // Wait until the generation differs from the given one. Returns false if the
+    // queues were aborted.
+    bool wait_for_seek(int gen);
+    // Throw the read error of the current generation, if any.
+    void throw_read_error();
+};
+
+// The packet memory budget.
+// The packets in all queues of all media objects count against one memory budget.
+// When it is used up, the read threads wait until the decode threads of any media
+// object consumed packets. Each media object registers its queue synchronization,
+// so that its read thread can be woken up when packets of other media objects
+// are consumed.
+class packet_memory_budget
+{
+private:
+    mutex _mutex;
+    size_t _budget;     // 0 means unlimited
+    size_t _used;
+    int _waiting;       // Number of read threads that wait for memory
+    mutex _syncs_mutex;
+    std::vector<struct packet_queue_sync *> _syncs;
+
+public:
+    packet_memory_budget() : _budget(0), _used(0), _waiting(0)
+    {
+    }
+
+    void set(size_t budget);
+    void register_sync(struct packet_queue_sync *sync);
+    void unregister_sync(struct packet_queue_sync *sync);
+    // Account for queued and removed packet memory.
+    void add(size_t bytes);
+    void remove(size_t bytes);
+    // Return whether the budget is used up. If a decoder starves, the budget may
+    // be exceeded up to a hard ceiling. If the budget (or the ceiling) is used up,
+    // the caller is counted as waiting until it calls stop_waiting().
+    bool start_waiting(bool starving);
+    void stop_waiting();
+    // Wake up the waiting read threads if memory is available again. This must
+    // not be called while holding the lock of a queue synchronization.
+    void wake_waiting();
+};
+
+static packet_memory_budget packet_memory;
+
+class packet_queue
+{
+private:
+    // While a decoder starves, a queue may exceed its limits, but never this amount of data.
+    static const size_t _hard_max_bytes = 256 << 20;
+    struct packet_queue_sync *_sync;
+    bool _essential;            // Whether a starving decoder of this queue lets the others exceed their limits
+    size_t _min_packets;        // The queue is never full with fewer packets
+    size_t _max_bytes;          // The queue is full with this amount of packet data...
+    int64_t _max_duration;      // ... or if its packets span this presentation time (0 = ignore)
+    // The packets are stored in a ring that is preallocated for the minimum
+    // number of packets, and grows as needed.
+    std::vector<AVPacket> _ring;
+    std::vector<int> _generations;
+    std::vector<int64_t> _timestamps;
+    size_t _head;
+    size_t _size;
+    size_t _bytes;
+
+    void remove_front(bool free_packet);
+    void drop_stale();
+    int64_t duration();
+    bool full();
+    bool overfull();
+
+public:
+    // The decoders of essential queues (audio and video) must not starve: while
+    // one of them waits for packets, the other queues of the media object may
+    // exceed their limits, up to a hard ceiling. The decoders of other queues
+    // (subtitles) may wait for a long time, e.g. between two subtitles.
+    packet_queue(struct packet_queue_sync *sync = NULL, bool essential = true,
+            size_t min_packets = 1, size_t max_bytes = 0, int64_t max_duration = 0);
+
+    // Append a packet of the given generation with the given timestamp (in
+    // microseconds, or the minimum value if unknown). This blocks while the queue
+    // is full or the packet memory budget is used up. While an essential decode
+    // thread of the same media object waits for packets, it only blocks at the
+    // hard ceilings of the queue and the budget. Stale packets are freed instead of
+    // queued. Returns false if the queues were aborted; the caller keeps ownership
+    // of the packet in this case.
+    bool push(const AVPacket &packet, int generation, int64_t timestamp);
+    // Remove the oldest packet. This blocks while the queue is empty. Returns
+    // false at the end of the input or if the queues were aborted. Stale packets
+    // are never returned. If generation is not NULL, the current generation is
+    // stored in it.
+    bool pop(AVPacket &packet, int *generation = NULL);
+    // Return the number of queued packets that are not stale.
+    size_t size();
+    bool empty()
+    {
+        return size() == 0;
+    }
+    // Free all queued packets.
+    void flush();
+};
+
+// The packet arena.
+// Packets that do not own their data (for example packets that come from a
+// parser) must be duplicated before they can be queued. The arena provides the
+// memory for these duplicates and recycles it, so that reading packets does not
+// allocate memory in the steady state. Memory blocks have power-of-two sizes.
+class packet_arena
+{
+private:
+    static const int _min_class = 10;           // 1 KiB
+    static const int _max_class = 22;           // 4 MiB
+    mutex _mutex;
+    std::vector<void *> _free[_max_class - _min_class + 1];
+    size_t _allocations;
+
+    static int size_class(size_t size);
+    static void destruct(AVPacket *packet);
+
+public:
+    packet_arena();
+    ~packet_arena();
+
+    // Make sure the packet owns its data, like av_dup_packet() does.
+    // Returns false if this fails.
+    bool dup(AVPacket *packet);
+    // Return the number of memory allocations done so far.
+    size_t allocations();
+};
+
+// The video frame queues.
+// The video decode thread of a stream decodes frames ahead of time and stores
+// them in the queue; finish_video_frame_read() only takes the next frame from it.
+// Each frame owns its data, so that frames stay valid after they left the queue.
+class video_frame_queue
+{
+private:
+    mutex _mutex;
+    condition _cond;
+    size_t _capacity;
+    std::deque<video_frame> _frames;
+    bool _closed;       // The decode thread will not add more frames
+    bool _aborted;      // All waiting threads must give up
+    int _generation;    // Generation of the queued frames
+
+public:
+    video_frame_queue(size_t capacity = 1);
+
+    // Append a frame of the given generation. This blocks while the queue is full.
+    // Stale frames are dropped. Returns false if the queue was aborted.
+    bool push(const video_frame &frame, int generation);
+    // Remove the oldest frame. This blocks while the queue is empty, unless it
+    // is closed. Returns false if no frame is available.
+    bool pop(video_frame &frame);
+    // Return the number of queued frames.
+    size_t size();
+    // Mark the queue as closed / open. The decode thread closes the queue when
+    // it stops.
+    void close();
+    void reopen();
+    // Make all threads that wait for the queue return, or stop doing so.
+    void abort();
+    void resume();
+    // Remove all queued frames.
+    void flush();
+    // Remove all queued frames and only accept frames of the given generation from now on.
+    void flush(int generation);
+};
+
+// The decoded audio buffers.
+// This is a ring buffer with fixed capacity. The audio decoder writes directly
+// into the free space at write_ptr(): the buffer has an overhang after its end,
+// so that there are always write_space() contiguous bytes. Data that is written
+// into the overhang is wrapped around to the start when it is committed.
+// The memory is allocated with av_malloc() to guarantee correct alignment for the
+// decoder; not doing this results in hard to debug crashes on some systems.
+// A ring buffer is only accessed by the audio decode thread of its stream.
+class audio_ring_buffer
+{
+private:
+    unsigned char *_buf;
+    size_t _capacity;
+    size_t _overhang;
+    size_t _start;
+    size_t _size;
+
+public:
+    audio_ring_buffer() : _buf(NULL), _capacity(0), _overhang(0), _start(0), _size(0)
+    {
+    }
+
+    // Allocate / free the memory.
+    void init(size_t capacity, size_t overhang);
+    void deinit();
+
+    // Return the number of buffered bytes, and the capacity.
+    size_t size() const
+    {
+        return _size;
+    }
+    size_t capacity() const
+    {
+        return _capacity;
+    }
+    // Return the pointer to the free space, and its contiguous size.
+    unsigned char *write_ptr()
+    {
+        return _buf + (_start + _size) % _capacity;
+    }
+    size_t write_space() const
+    {
+        return std::min(_capacity - _size, _overhang);
+    }
+    // Append the given number of bytes that were written to write_ptr().
+    void commit(size_t n);
+    // Remove up to n bytes from the buffer and copy them to dst.
+    // Returns the number of bytes copied.
+    size_t read(void *dst, size_t n);
+    // Remove up to n bytes from the buffer without copying them.
+    void skip(size_t n);
+    // Remove all data.
+    void clear()
+    {
+        _start = 0;
+        _size = 0;
+    }
+};
+
+// The keyframe index.
+// For each video stream, this stores the time stamp and byte position of each
+// keyframe, sorted by time stamp. It is only used for formats that have no usable
+// index of their own (MPEG-PS and MPEG-TS). The index thread builds it in the background,
+// and it is cached in a file in the cache directory (see cache_filename()) so that
+// the input does not need to be scanned again when it is reopened. The cache file is only valid for
+// the file size and modification time that it was built for.
+// seek() uses the index only once it is complete.
+class keyframe_index
+{
+private:
+    mutex _mutex;
+    bool _complete;
+    std::vector<std::vector<int64_t> > _timestamps;
+    std::vector<std::vector<int64_t> > _positions;
+
+public:
+    keyframe_index() : _complete(false)
+    {
+    }
+
+    // Set the complete index.
+    void set(const std::vector<std::vector<int64_t> > &timestamps,
+            const std::vector<std::vector<int64_t> > &positions);
+    // Return the byte position of the last keyframe at or before the given time stamp
+    // in the given video stream, or -1 if the index does not know it.
+    int64_t find(int video_stream, int64_t timestamp);
+    // Load or save the cache file. The key identifies the input file.
+    bool load(const std::string &filename, const std::string &key, size_t video_streams);
+    bool save(const std::string &filename, const std::string &key);
+};
+
+// The stream information cache.
+// av_find_stream_info() reads and decodes the beginning of the input to find the
+// stream parameters that the container headers do not provide, which can take a
+// long time. For files in formats that have headers, the parameters are cached in
+// a file in the cache directory (see cache_filename()), so that opening the file
+// again does not need to analyze it. Like the keyframe index cache, the cache file
+// is only valid for the file name, size and modification time that it was written for. Additionally, the
+// streams that the headers describe must match the cached streams.
+class stream_info : public s11n
+{
+private:
+    // Stream parameters that the headers provide; used to check the cache
+    int _codec_type, _codec_id;
+    unsigned int _codec_tag;
+    int _time_base_num, _time_base_den;
+    // Stream parameters that av_find_stream_info() determines
+    int _r_frame_rate_num, _r_frame_rate_den;
+    int _avg_frame_rate_num, _avg_frame_rate_den;
+    int _sample_aspect_ratio_num, _sample_aspect_ratio_den;
+    int64_t _start_time, _duration, _nb_frames;
+    // Codec parameters that av_find_stream_info() determines
+    int _width, _height, _pix_fmt, _has_b_frames;
+    int _codec_sample_aspect_ratio_num, _codec_sample_aspect_ratio_den;
+    int _colorspace, _color_range, _chroma_sample_location;
+    int _sample_rate, _channels, _sample_fmt, _frame_size;
+    int64_t _channel_layout;
+    int _bit_rate;
+    int _codec_time_base_num, _codec_time_base_den, _ticks_per_frame;
 
+public:
+    stream_info();
+
+    // Get the parameters from the stream.
+    void get(const AVStream *stream);
+    // Check whether the parameters belong to the stream.
+    bool matches(const AVStream *stream) const;
+    // Set the parameters of the stream.
+    void set(AVStream *stream) const;
+
+    void save(std::ostream &os) const;
+    void load(std::istream &is);
+
+    // Load or save the cache file for the given input. The key identifies the input
+    // file. Loading changes nothing unless the cache file is valid.
+    static bool load(const std::string &filename, const std::string &key, AVFormatContext *format_ctx);
+    static bool save(const std::string &filename, const std::string &key, const AVFormatContext *format_ctx);
+};
 
 // The read thread.
 // This thread reads packets from the AVFormatContext and stores them in the
-// appropriate packet queues.
+// appropriate packet queues. It also performs the seek requests. At the end of
+// the input, or after a read error, it waits for the next seek request. It runs
+// until the packet queues are aborted.
 class read_thread : public thread
 {
 private:
     const std::string _url;
     const bool _is_device;
     struct ffmpeg_stuff *_ffmpeg;
-    bool _eof;
+
+    void seek(int64_t pos, bool backward);
+    void collect_subtitle_packet(int subtitle_stream, const AVPacket &packet);
+    // Stop collecting subtitle packets. If the collection is complete, the packets
+    // are handed over to the subtitle indexes; otherwise, they are freed.
+    void stop_collecting_subtitle_packets(bool complete);
 
 public:
     read_thread(const std::string &url, bool is_device, struct ffmpeg_stuff *ffmpeg);
     void run();
     void reset();
-    bool eof() const
-    {
-        return _eof;
-    }
+};
+
+// The index thread.
+// This thread reads all packets of the input with its own AVFormatContext to build
+// the keyframe index, and then saves the index to its cache file.
+class index_thread : public thread
+{
+private:
+    const std::string _url;
+    struct ffmpeg_stuff *_ffmpeg;
+    const std::string _cache_filename;
+    const std::string _cache_key;
+    mutex _abort_mutex;
+    bool _abort;
+
+public:
+    index_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg,
+            const std::string &cache_filename, const std::string &cache_key);
+    void run();
+    // Make the thread give up as soon as possible.
+    void abort();
+};
+
+// The read ahead thread.
+// For files, the demuxer does not read from the file directly, but through a
+// custom I/O context that takes its data from a large ring buffer. This thread
+// keeps the ring filled with the data that follows the current read position,
+// so that the read thread does not wait for slow storage (e.g. a network file
+// system) as long as the demuxer reads sequentially. A seek to a position that
+// is not in the ring restarts the ring at that position. A part of the ring is
+// kept behind the read position for the short backward seeks of some demuxers.
+class read_ahead_thread : public thread
+{
+private:
+    const std::string _url;
+    AVIOContext *_input;                // The I/O context of the file itself
+    AVIOContext *_avio;                 // The I/O context for the demuxer
+    int _fd;                            // File descriptor for read ahead hints, or -1
+    int64_t _file_size;                 // Size of the file, or a negative error
+    mutex _mutex;
+    condition _cond;
+    blob _ring;
+    int64_t _start;                     // File position of the first byte in the ring
+    size_t _head;                       // Index of the first byte in the ring
+    size_t _size;                       // Number of bytes in the ring
+    int64_t _pos;                       // File position of the demuxer
+    int64_t _restart;                   // Position at which to restart the ring, or -1
+    int _error;                         // Error from reading the file, or 0
+    bool _eof;
+    bool _stop;
+
+    static int read_packet(void *opaque, uint8_t *buf, int buf_size);
+    static int64_t seek(void *opaque, int64_t offset, int whence);
+
+public:
+    read_ahead_thread(const std::string &url, size_t size);
+    ~read_ahead_thread();
+    // Open the file and return the I/O context for the demuxer, or NULL if the
+    // file cannot be opened. The caller must start the thread afterwards.
+    AVIOContext *open();
+    void run();
+    // Make the thread stop. Call wait() afterwards.
+    void stop();
 };
 
 // The video decode thread.
-// This thread reads packets from its packet queue and decodes them to video frames.
+// This thread reads packets from its packet queue, decodes them to video frames,
+// and stores these in its frame queue until the queues are aborted. When packets
+// of a new generation arrive, it flushes the decoder and starts over.
 class video_decode_thread : public thread
 {
 private:
@@ -86,16 +523,54 @@ private:
     struct ffmpeg_stuff *_ffmpeg;
     int _video_stream;
     video_frame _frame;
+    int _generation;            // Generation of the packets that are decoded
+    int64_t _seek_target;       // Target of exact seeking, or the minimum value
+    int64_t _seek_deadline;     // Time at which exact seeking gives up
+    int _lowres;                // log2 of the current frame size reduction
+    int _threads;               // Current number of decoding threads
+    bool _draining;             // Whether the decoder is drained before it is reopened
+    AVPacket _held_packet;      // The keyframe packet that waits for the reopened decoder
 
     int64_t handle_timestamp(int64_t timestamp);
+    int64_t packet_timestamp(const AVPacket &packet);
+    int codec_lowres(int lowres);
+    void reconfigure(int lowres, int threads);
+    void decode();
 
 public:
     video_decode_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg, int video_stream);
     void run();
-    const video_frame &frame()
+};
+
+// The video conversion threads.
+// Conversion to BGRA32 splits each frame into horizontal bands, so that the bands
+// can be converted in parallel. YUV formats that the video output could handle
+// itself are converted with a video_yuv_converter; all other formats use a
+// SwsContext per band. The video decode thread converts the first band itself,
+// and one of these threads per band converts each of the remaining bands.
+class video_convert_thread : public thread
+{
+private:
+    struct SwsContext *_ctx;    // NULL if the YUV converter is used
+    video_yuv_converter _yuv_converter;
+    int _y;                     // First row of the band
+    int _h;                     // Number of rows in the band
+    int _chroma_shift;          // log2 of the vertical chroma subsampling of the source
+    const uint8_t *_src[4];
+    int _src_linesize[4];
+    uint8_t *_dst[4];
+    int _dst_linesize[4];
+
+public:
+    video_convert_thread(struct SwsContext *ctx = NULL, int y = 0, int h = 0, int chroma_shift = 0);
+    video_convert_thread(const video_yuv_converter &yuv_converter, int y, int h);
+    struct SwsContext *ctx()
     {
-        return _frame;
+        return _ctx;
     }
+    // Set the source and destination frames.
+    void set_frame(const AVFrame *src, const AVPicture *dst);
+    void run();
 };
 
 // The audio decode thread.
@@ -109,6 +584,9 @@ private:
     audio_blob _blob;
 
     int64_t handle_timestamp(int64_t timestamp);
+    int64_t packet_timestamp(const AVPacket &packet);
+    void decode_pending_packet();
+    int64_t skip_to_seek_target();
 
 public:
     audio_decode_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg, int audio_stream);
@@ -121,18 +599,29 @@ public:
 
 // The subtitle decode thread.
 // This thread reads packets from its packet queue and decodes them to subtitle boxes.
+// Once the subtitle index of its stream is available, it takes the boxes from
+// there instead.
 class subtitle_decode_thread : public thread
 {
 private:
     std::string _url;
     struct ffmpeg_stuff *_ffmpeg;
     int _subtitle_stream;
+    int64_t _min_stop_time;
     subtitle_box _box;
 
     int64_t handle_timestamp(int64_t timestamp);
+    void decode_box();
+    void index_box();
+    void decode_collected_packets(std::vector<AVPacket> &packets);
 
 public:
     subtitle_decode_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg, int subtitle_stream);
+    // Skip boxes that stop before the given time in the next run.
+    void set_min_stop_time(int64_t min_stop_time)
+    {
+        _min_stop_time = min_stop_time;
+    }
     void run();
     const subtitle_box &box()
     {
@@ -140,11 +629,79 @@ public:
     }
 };
 
+// The subtitle index.
+// Text and ASS subtitle streams are small, so they are kept in memory completely
+// and served from there. For subtitle files and small files, they are read in
+// the background (see subtitle_preload_thread). For other files, the read thread
+// collects their packets while it reads the input from its beginning; when it
+// reaches the end without seeking, it hands them over to the index, and the
+// subtitle decode thread decodes them into boxes. The boxes
+// are sorted by start time, and for each box the index stores the maximum stop
+// time of all boxes up to it. Since this maximum never decreases, the first box
+// that is still visible at a given time is found with a binary search, even if
+// boxes overlap.
+class subtitle_index
+{
+private:
+    mutex _mutex;
+    bool _ready;
+    std::vector<subtitle_box> _boxes;
+    std::vector<int64_t> _max_stop_times;
+    std::vector<AVPacket> _packets;     // All packets of the stream, not yet decoded
+
+public:
+    subtitle_index() : _ready(false)
+    {
+    }
+
+    // Set the boxes of the complete stream, in any order. This makes the index ready.
+    void set(const std::deque<subtitle_box> &boxes);
+    // Hand over all packets of the stream, or take them for decoding. The packets
+    // are swapped with the given vector. The taker must free them.
+    void put_packets(std::vector<AVPacket> &packets);
+    bool take_packets(std::vector<AVPacket> &packets);
+    // Return whether the index is ready. Once it is, the following functions can
+    // be used without further synchronization.
+    bool ready();
+    // Return the first box that stops at or after the given time, or size() if there is none.
+    size_t find(int64_t time) const;
+    size_t size() const
+    {
+        return _boxes.size();
+    }
+    const subtitle_box &box(size_t i) const
+    {
+        return _boxes[i];
+    }
+};
+
+// The subtitle preload thread.
+// This thread reads all packets of the text and ASS subtitle streams of a file
+// with its own AVFormatContext, decodes them, and stores the boxes in the subtitle
+// indexes. Since this reads the file a second time, it is only used for files that
+// contain nothing but subtitles and for small files. It is started when the first
+// of these streams is activated.
+class subtitle_preload_thread : public thread
+{
+private:
+    const std::string _url;
+    struct ffmpeg_stuff *_ffmpeg;
+    mutex _abort_mutex;
+    bool _abort;
+
+public:
+    subtitle_preload_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg);
+    void run();
+    // Make the thread give up as soon as possible.
+    void abort();
+};
+
 
 // Hide the FFmpeg stuff so that their messy header files cannot cause problems
 // in other source files.
 
 static const size_t audio_tmpbuf_size = (AVCODEC_MAX_AUDIO_FRAME_SIZE * 3) / 2;
+static const size_t audio_buffer_capacity = 2 * audio_tmpbuf_size;
 
 struct ffmpeg_stuff
 {
@@ -152,48 +709,192 @@ struct ffmpeg_stuff
 
     bool have_active_audio_stream;
     int64_t pos;
+    int64_t seek_deadline;
+    int64_t open_time;                  // When open() started, for the startup timing
+    int video_decode_ahead;             // Number of video frames decoded ahead of time
+    bool have_read_video_frame;         // Whether a video frame was read since opening
+    decoder_threading threading;        // Threading policy for the video decoders
 
     read_thread *reader;
+    index_thread *indexer;
+    read_ahead_thread *read_ahead;      // For files, if enabled
+    subtitle_preload_thread *subtitle_preloader;
+    bool preload_subtitles;             // Whether text subtitles are preloaded by subtitle_preloader
+    bool collect_subtitles;             // Whether the read thread collects the packets of text subtitles
+    keyframe_index keyframes;
+    struct packet_queue_sync queue_sync;
+    bool registered_queue_sync;         // Whether queue_sync is registered with the packet memory budget
+    packet_arena arena;
 
     std::vector<int> video_streams;
     std::vector<AVCodecContext *> video_codec_ctxs;
     std::vector<video_frame> video_frame_templates;
-    std::vector<struct SwsContext *> video_img_conv_ctxs;
+    std::vector<std::vector<video_convert_thread> > video_convert_threads;
     std::vector<AVCodec *> video_codecs;
-    std::vector<std::deque<AVPacket> > video_packet_queues;
-    std::vector<mutex> video_packet_queue_mutexes;
+    std::vector<packet_queue> video_packet_queues;
     std::vector<AVPacket> video_packets;
     std::vector<video_decode_thread> video_decode_threads;
+    std::vector<video_frame_queue> video_frame_queues;
+    std::vector<frame_buffer_pool> video_buffer_pools;
+    std::vector<frame_buffer_pool> video_out_buffer_pools;
     std::vector<AVFrame *> video_frames;
-    std::vector<AVFrame *> video_out_frames;
-    std::vector<uint8_t *> video_buffers;
     std::vector<int64_t> video_last_timestamps;
+    std::vector<int64_t> video_lateness;            // Smoothed lateness reported by the player
+    std::vector<int> video_lateness_reports;        // Reports since the last skip level change
+    mutex video_decode_mutex;                       // Guards the following requests to the decoders
+    std::vector<int> video_skip_levels;             // How much work the video decoder skips
+    std::vector<int> video_lowres_requests;         // log2 of the requested frame size reduction
+    std::vector<int> video_thread_requests;         // Requested number of decoding threads
 
     std::vector<int> audio_streams;
     std::vector<AVCodecContext *> audio_codec_ctxs;
     std::vector<audio_blob> audio_blob_templates;
     std::vector<AVCodec *> audio_codecs;
-    std::vector<std::deque<AVPacket> > audio_packet_queues;
-    std::vector<mutex> audio_packet_queue_mutexes;
+    std::vector<packet_queue> audio_packet_queues;
     std::vector<audio_decode_thread> audio_decode_threads;
-    std::vector<unsigned char *> audio_tmpbufs;
+    std::vector<AVPacket> audio_packets;
+    std::vector<AVPacket> audio_tmppackets;
     std::vector<blob> audio_blobs;
-    std::vector<std::vector<unsigned char> > audio_buffers;
+    std::vector<audio_ring_buffer> audio_buffers;
     std::vector<int64_t> audio_last_timestamps;
+    std::vector<int64_t> audio_seek_targets;
 
     std::vector<int> subtitle_streams;
     std::vector<AVCodecContext *> subtitle_codec_ctxs;
     std::vector<subtitle_box> subtitle_box_templates;
     std::vector<AVCodec *> subtitle_codecs;
-    std::vector<std::deque<AVPacket> > subtitle_packet_queues;
-    std::vector<mutex> subtitle_packet_queue_mutexes;
+    std::vector<packet_queue> subtitle_packet_queues;
     std::vector<subtitle_decode_thread> subtitle_decode_threads;
     std::vector<std::deque<subtitle_box> > subtitle_box_buffers;
     std::vector<int64_t> subtitle_last_timestamps;
+    std::vector<subtitle_index> subtitle_indexes;
+    std::vector<size_t> subtitle_index_cursors;     // Next box from the index, or SIZE_MAX to look it up
+    std::vector<int64_t> subtitle_resume_times;     // Where to look up the next box in the index
+    std::vector<bool> subtitle_streams_active;      // Text subtitle streams may be read without being active
+    std::vector<std::vector<AVPacket> > subtitle_collected_packets;     // Only used by the read thread
 };
 
-// Use one decoding thread per processor for video decoding.
-static int video_decoding_threads()
+// Get the duration of one video frame of the stream in microseconds.
+static int64_t video_frame_duration(const AVStream *stream)
+{
+    AVRational frame_rate = stream->r_frame_rate;
+    return (frame_rate.num > 0 && frame_rate.den > 0
+            ? static_cast<int64_t>(1000000) * frame_rate.den / frame_rate.num : 40000);
+}
+
+// Whether subtitles of the given codec are text or ASS, which can be kept in memory.
+static bool is_text_subtitle(enum CodecID codec_id)
+{
+    return (codec_id == CODEC_ID_TEXT
+            || codec_id == CODEC_ID_SSA
+            || codec_id == CODEC_ID_SRT
+            || codec_id == CODEC_ID_MOV_TEXT);
+}
+
+// Whether the read thread collects the packets of the given subtitle stream.
+static bool collects_subtitle_packets(const struct ffmpeg_stuff *ffmpeg, size_t subtitle_stream)
+{
+    return (ffmpeg->collect_subtitles
+            && is_text_subtitle(ffmpeg->subtitle_codec_ctxs[subtitle_stream]->codec_id));
+}
+
+// Whether inputs of the given format benefit from a keyframe index. This is the case
+// for formats that have no index of their own, so that the demuxer can only seek
+// by guessing byte positions, but that support seeking to exact byte positions.
+// Formats with an index (e.g. MP4, Matroska) seek well on their own, and some of
+// them ignore byte positions.
+static bool needs_keyframe_index(const AVInputFormat *iformat)
+{
+    bool byte_seekable = false;
+#ifdef AVFMT_NO_BYTE_SEEK
+    byte_seekable = !(iformat->flags & AVFMT_NO_BYTE_SEEK);
+#endif
+    return (byte_seekable
+            && (std::strcmp(iformat->name, "mpeg") == 0             // MPEG-PS
+                || std::strcmp(iformat->name, "mpegts") == 0));     // MPEG-TS
+}
+
+// Return the absolute name of the given file, or an empty string on failure.
+static std::string absolute_filename(const std::string &filename)
+{
+    std::string abs_filename;
+#if (defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__
+    char buf[MAX_PATH];
+    if (_fullpath(buf, filename.c_str(), MAX_PATH))
+    {
+        abs_filename = buf;
+    }
+#else
+    char *buf = realpath(filename.c_str(), NULL);
+    if (buf)
+    {
+        abs_filename = buf;
+        std::free(buf);
+    }
+#endif
+    return abs_filename;
+}
+
+// Return the name of the cache file with the given extension for the given
+// absolute file name, or an empty string if there is no cache directory.
+// The cache files of all inputs are kept in a per-user cache directory
+// ($XDG_CACHE_HOME/bino, ~/.cache/bino, or %LOCALAPPDATA%\bino on Windows),
+// since the directories of the inputs are often not writable or not local.
+// Cache files are named by a hash of the absolute file name.
+static std::string cache_filename(const std::string &abs_filename, const std::string &extension)
+{
+    std::string dir;
+#if (defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__
+    const char *local_app_data = std::getenv("LOCALAPPDATA");
+    if (!local_app_data || !local_app_data[0])
+    {
+        return "";
+    }
+    dir = std::string(local_app_data) + "\\bino";
+    if (_mkdir(dir.c_str()) != 0 && errno != EEXIST)
+    {
+        return "";
+    }
+    dir += '\\';
+#else
+    const char *xdg_cache_home = std::getenv("XDG_CACHE_HOME");
+    const char *home = std::getenv("HOME");
+    if (xdg_cache_home && xdg_cache_home[0] == '/')
+    {
+        dir = xdg_cache_home;
+    }
+    else if (home && home[0] == '/')
+    {
+        dir = std::string(home) + "/.cache";
+        if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+        {
+            return "";
+        }
+    }
+    else
+    {
+        return "";
+    }
+    dir += "/bino";
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+        return "";
+    }
+    dir += '/';
+#endif
+    // 64 bit FNV-1a hash
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < abs_filename.length(); i++)
+    {
+        hash ^= static_cast<unsigned char>(abs_filename[i]);
+        hash *= UINT64_C(1099511628211);
+    }
+    return dir + str::asprintf("%08x%08x", static_cast<unsigned int>(hash >> 32),
+            static_cast<unsigned int>(hash & 0xffffffffU)) + extension;
+}
+
+// Get the number of processors.
+static int processors()
 {
     static long n = -1;
     if (n < 0)
@@ -209,12 +910,187 @@ static int video_decoding_threads()
         {
             n = 1;
         }
-        else if (n > 16)
+    }
+    return n;
+}
+
+// Get the number of threads for decoding a video stream while the given number
+// of video streams is decoded at the same time. By default, the processors are
+// shared by the streams, but each stream uses at most 16 threads, because more
+// do not help most codecs. An explicit budget is shared without this limit.
+static int video_decoding_threads(const decoder_threading &threading, int streams)
+{
+    if (threading.threads > 0)
+    {
+        return threading.threads;
+    }
+    int threads = (threading.budget > 0 ? threading.budget : processors()) / std::max(streams, 1);
+    if (threading.budget <= 0)
+    {
+        threads = std::min(threads, 16);
+    }
+    return std::max(threads, 1);
+}
+
+// Describe the threading that a video codec actually uses.
+static std::string video_threading_info(const AVCodecContext *ctx)
+{
+    return (ctx->active_thread_type & FF_THREAD_FRAME
+            ? str::asprintf(_("%d threads with frame threading"), ctx->thread_count)
+            : ctx->active_thread_type & FF_THREAD_SLICE
+            ? str::asprintf(_("%d threads with slice threading"), ctx->thread_count)
+            : std::string(_("a single thread")));
+}
+
+// Get the plane layout of the planar YUV formats that we can decode directly
+// into our own frame buffers. Returns false for all other formats.
+static bool planar_yuv_layout(enum PixelFormat pix_fmt, int *hshift, int *vshift, int *sample_size)
+{
+    switch (pix_fmt)
+    {
+    case PIX_FMT_YUV420P:
+    case PIX_FMT_YUVJ420P:
+        *hshift = 1, *vshift = 1, *sample_size = 1;
+        return true;
+    case PIX_FMT_YUV422P:
+    case PIX_FMT_YUVJ422P:
+        *hshift = 1, *vshift = 0, *sample_size = 1;
+        return true;
+    case PIX_FMT_YUV444P:
+    case PIX_FMT_YUVJ444P:
+        *hshift = 0, *vshift = 0, *sample_size = 1;
+        return true;
+    case PIX_FMT_YUV420P10:
+        *hshift = 1, *vshift = 1, *sample_size = 2;
+        return true;
+    case PIX_FMT_YUV422P10:
+        *hshift = 1, *vshift = 0, *sample_size = 2;
+        return true;
+    case PIX_FMT_YUV444P10:
+        *hshift = 0, *vshift = 0, *sample_size = 2;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Let decoders decode directly into frame buffers from the pool of the video stream
+// (stored in the opaque field of the codec context). The frame buffer is stored in
+// the opaque field of the AVFrame, so that the decoded frame can share it instead
+// of copying the data. Formats that we do not know are left to the default functions.
+static int video_get_buffer(AVCodecContext *ctx, AVFrame *pic)
+{
+    int hshift, vshift, sample_size;
+    if (!planar_yuv_layout(ctx->pix_fmt, &hshift, &vshift, &sample_size))
+    {
+        return avcodec_default_get_buffer(ctx, pic);
+    }
+    int w = ctx->width;
+    int h = ctx->height;
+    int linesize_align[4];
+    avcodec_align_dimensions2(ctx, &w, &h, linesize_align);
+    size_t offset[3];
+    size_t linesize[3];
+    size_t size = 0;
+    for (int p = 0; p < 3; p++)
+    {
+        int pw = (p == 0 ? w : -((-w) >> hshift));
+        int ph = (p == 0 ? h : -((-h) >> vshift));
+        linesize[p] = (pw * sample_size + frame_buffer::alignment - 1) / frame_buffer::alignment * frame_buffer::alignment;
+        offset[p] = size;
+        size += linesize[p] * ph;
+    }
+    frame_buffer *fb;
+    try
+    {
+        fb = new frame_buffer(static_cast<frame_buffer_pool *>(ctx->opaque)->get(size));
+    }
+    catch (...)
+    {
+        return -1;
+    }
+    for (int p = 0; p < 3; p++)
+    {
+        pic->base[p] = pic->data[p] = static_cast<uint8_t *>(fb->ptr()) + offset[p];
+        pic->linesize[p] = linesize[p];
+    }
+    pic->base[3] = pic->data[3] = NULL;
+    pic->linesize[3] = 0;
+    pic->opaque = fb;
+    pic->type = FF_BUFFER_TYPE_USER;
+    pic->age = std::numeric_limits<int>::max();
+    return 0;
+}
+
+static void video_release_buffer(AVCodecContext *ctx, AVFrame *pic)
+{
+    if (pic->type != FF_BUFFER_TYPE_USER)
+    {
+        avcodec_default_release_buffer(ctx, pic);
+        return;
+    }
+    delete static_cast<frame_buffer *>(pic->opaque);
+    pic->opaque = NULL;
+    for (int p = 0; p < 4; p++)
+    {
+        pic->data[p] = NULL;
+    }
+}
+
+static int video_reget_buffer(AVCodecContext *ctx, AVFrame *pic)
+{
+    if (!pic->data[0])
+    {
+        return ctx->get_buffer(ctx, pic);
+    }
+    if (pic->type != FF_BUFFER_TYPE_USER)
+    {
+        return avcodec_default_reget_buffer(ctx, pic);
+    }
+    // The decoder wants to update the old picture, but decoded frames may still
+    // share its buffer. Give it a copy in a new buffer instead.
+    AVFrame old_pic = *pic;
+    if (video_get_buffer(ctx, pic) != 0)
+    {
+        return -1;
+    }
+    av_picture_copy(reinterpret_cast<AVPicture *>(pic), reinterpret_cast<AVPicture *>(&old_pic),
+            ctx->pix_fmt, ctx->width, ctx->height);
+    video_release_buffer(ctx, &old_pic);
+    return 0;
+}
+
+// Reduce a plane of w x h samples to 1/2^shift of its size in both directions by
+// averaging blocks of samples. This is used when the codec cannot decode at a
+// reduced size itself.
+template<typename T>
+static void decimate_plane(const uint8_t *src, int src_linesize, int w, int h,
+        uint8_t *dst, int dst_linesize, int shift)
+{
+    int dst_w = -((-w) >> shift);
+    int dst_h = -((-h) >> shift);
+    for (int y = 0; y < dst_h; y++)
+    {
+        int y0 = y << shift;
+        int y1 = std::min(y0 + (1 << shift), h);
+        T *d = reinterpret_cast<T *>(dst + y * dst_linesize);
+        for (int x = 0; x < dst_w; x++)
         {
-            n = 16;
+            int x0 = x << shift;
+            int x1 = std::min(x0 + (1 << shift), w);
+            unsigned int sum = 0;
+            for (int sy = y0; sy < y1; sy++)
+            {
+                const T *s = reinterpret_cast<const T *>(src + sy * src_linesize);
+                for (int sx = x0; sx < x1; sx++)
+                {
+                    sum += s[sx];
+                }
+            }
+            unsigned int n = (y1 - y0) * (x1 - x0);
+            d[x] = (sum + n / 2) / n;
         }
     }
-    return n;
 }
 
 // Return FFmpeg error as std::string.
@@ -225,6 +1101,43 @@ static std::string my_av_strerror(int err)
     return std::string(b.ptr<const char>());
 }
 
+// Keep the information about a media object together when several objects are
+// opened in parallel.
+static mutex info_mutex;
+
+// Let FFmpeg use our mutexes. This is required because media objects may be
+// opened in parallel, and avcodec_open() is not thread-safe otherwise.
+static mutex lockmgr_mutex;
+static bool lockmgr_registered = false;
+static int my_av_lockmgr(void **m, enum AVLockOp op)
+{
+    mutex **mtx = reinterpret_cast<mutex **>(m);
+    try
+    {
+        switch (op)
+        {
+        case AV_LOCK_CREATE:
+            *mtx = new mutex;
+            break;
+        case AV_LOCK_OBTAIN:
+            (*mtx)->lock();
+            break;
+        case AV_LOCK_RELEASE:
+            (*mtx)->unlock();
+            break;
+        case AV_LOCK_DESTROY:
+            delete *mtx;
+            *mtx = NULL;
+            break;
+        }
+    }
+    catch (...)
+    {
+        return 1;
+    }
+    return 0;
+}
+
 // Convert FFmpeg log messages to our log messages.
 static void my_av_log(void *ptr, int level, const char *fmt, va_list vl)
 {
@@ -340,6 +1253,20 @@ media_object::media_object(bool always_convert_to_bgra32) :
         break;
     }
     av_log_set_callback(my_av_log);
+    // Register the lock manager only once: registering it again makes FFmpeg
+    // destroy and recreate its mutexes, which may currently be in use by the
+    // open or index threads of other media objects.
+    lockmgr_mutex.lock();
+    if (!lockmgr_registered)
+    {
+        if (av_lockmgr_register(my_av_lockmgr) != 0)
+        {
+            lockmgr_mutex.unlock();
+            throw exc(_("Cannot register the FFmpeg lock manager."));
+        }
+        lockmgr_registered = true;
+    }
+    lockmgr_mutex.unlock();
 }
 
 media_object::~media_object()
@@ -399,13 +1326,12 @@ void media_object::set_video_frame_template(int index, int width_before_avcodec_
     video_frame_template.color_space = video_frame::srgb;
     video_frame_template.value_range = video_frame::u8_full;
     video_frame_template.chroma_location = video_frame::center;
-    if (!_always_convert_to_bgra32
-            && (video_codec_ctx->pix_fmt == PIX_FMT_YUV444P
-                || video_codec_ctx->pix_fmt == PIX_FMT_YUV444P10
-                || video_codec_ctx->pix_fmt == PIX_FMT_YUV422P
-                || video_codec_ctx->pix_fmt == PIX_FMT_YUV422P10
-                || video_codec_ctx->pix_fmt == PIX_FMT_YUV420P
-                || video_codec_ctx->pix_fmt == PIX_FMT_YUV420P10))
+    if (video_codec_ctx->pix_fmt == PIX_FMT_YUV444P
+            || video_codec_ctx->pix_fmt == PIX_FMT_YUV444P10
+            || video_codec_ctx->pix_fmt == PIX_FMT_YUV422P
+            || video_codec_ctx->pix_fmt == PIX_FMT_YUV422P10
+            || video_codec_ctx->pix_fmt == PIX_FMT_YUV420P
+            || video_codec_ctx->pix_fmt == PIX_FMT_YUV420P10)
     {
         if (video_codec_ctx->pix_fmt == PIX_FMT_YUV444P
                 || video_codec_ctx->pix_fmt == PIX_FMT_YUV444P10)
@@ -454,10 +1380,9 @@ void media_object::set_video_frame_template(int index, int width_before_avcodec_
             video_frame_template.chroma_location = video_frame::topleft;
         }
     }
-    else if (!_always_convert_to_bgra32
-            && (video_codec_ctx->pix_fmt == PIX_FMT_YUVJ444P
-                || video_codec_ctx->pix_fmt == PIX_FMT_YUVJ422P
-                || video_codec_ctx->pix_fmt == PIX_FMT_YUVJ420P))
+    else if (video_codec_ctx->pix_fmt == PIX_FMT_YUVJ444P
+            || video_codec_ctx->pix_fmt == PIX_FMT_YUVJ422P
+            || video_codec_ctx->pix_fmt == PIX_FMT_YUVJ420P)
     {
         if (video_codec_ctx->pix_fmt == PIX_FMT_YUVJ444P)
         {
@@ -717,6 +1642,7 @@ void media_object::set_subtitle_box_template(int index)
     //AVCodecContext *subtitle_codec_ctx = _ffmpeg->subtitle_codec_ctxs[index];
     subtitle_box &subtitle_box_template = _ffmpeg->subtitle_box_templates[index];
 
+    subtitle_box_template.stream_id = _url + '#' + str::from(index);
     AVDictionaryEntry *tag = av_dict_get(subtitle_stream->metadata, "language", NULL, AV_DICT_IGNORE_SUFFIX);
     if (tag)
     {
@@ -724,14 +1650,29 @@ void media_object::set_subtitle_box_template(int index)
     }
 }
 
-void media_object::open(const std::string &url, const device_request &dev_request)
+void media_object::open(const std::string &url, const device_request &dev_request, int decode_ahead,
+        int64_t probe_size, int64_t probe_duration, bool cache_stream_info,
+        bool index_keyframes, const decoder_threading &threading, int64_t queue_duration, size_t read_ahead)
 {
     assert(!_ffmpeg);
+    assert(decode_ahead >= 1);
+    assert(probe_size >= 0);
+    assert(probe_duration >= 0);
+    assert(queue_duration >= 0);
 
     _url = url;
     _is_device = dev_request.is_device();
     _ffmpeg = new struct ffmpeg_stuff;
     _ffmpeg->reader = new read_thread(_url, _is_device, _ffmpeg);
+    _ffmpeg->indexer = NULL;
+    _ffmpeg->read_ahead = NULL;
+    _ffmpeg->subtitle_preloader = NULL;
+    _ffmpeg->preload_subtitles = false;
+    _ffmpeg->collect_subtitles = false;
+    _ffmpeg->registered_queue_sync = false;
+    _ffmpeg->open_time = timer::get_microseconds(timer::monotonic);
+    _ffmpeg->have_read_video_frame = false;
+    _ffmpeg->threading = threading;
     int e;
 
     /* Set format and parameters for device input */
@@ -774,9 +1715,34 @@ void media_object::open(const std::string &url, const device_request &dev_reques
         av_dict_set(&iparams, "framerate", str::asprintf("%d/%d",
                     dev_request.frame_rate_num, dev_request.frame_rate_den).c_str(), 0);
     }
+    /* Limit the amount of data that is read to detect the format and the streams */
+    if (probe_size > 0)
+    {
+        av_dict_set(&iparams, "probesize", str::from(probe_size).c_str(), 0);
+    }
+    if (probe_duration > 0 && !_is_device)
+    {
+        av_dict_set(&iparams, "analyzeduration", str::from(probe_duration).c_str(), 0);
+    }
 
     /* Open the input */
+    struct stat file_stat;
+    bool is_file = (!_is_device && stat(_url.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode));
     _ffmpeg->format_ctx = NULL;
+    if (is_file && read_ahead > 0)
+    {
+        // Let the demuxer read from a buffer that a separate thread keeps filled.
+        _ffmpeg->read_ahead = new read_ahead_thread(_url, read_ahead);
+        AVIOContext *avio = _ffmpeg->read_ahead->open();
+        if (avio)
+        {
+            _ffmpeg->format_ctx = avformat_alloc_context();
+            _ffmpeg->format_ctx->pb = avio;
+            _ffmpeg->read_ahead->start();
+            msg::dbg(_url + ": reading ahead " + str::human_readable_memsize(read_ahead)
+                    + " in a separate thread");
+        }
+    }
     if ((e = avformat_open_input(&_ffmpeg->format_ctx, _url.c_str(), iformat, &iparams)) != 0)
     {
         av_dict_free(&iparams);
@@ -784,17 +1750,53 @@ void media_object::open(const std::string &url, const device_request &dev_reques
                     _url.c_str(), my_av_strerror(e).c_str()));
     }
     av_dict_free(&iparams);
+    int64_t input_time = timer::get_microseconds(timer::monotonic);
     if (_is_device)
     {
         // For a camera device, do not read ahead multiple packets, to avoid a startup delay.
         _ffmpeg->format_ctx->max_analyze_duration = 0;
     }
-    if ((e = av_find_stream_info(_ffmpeg->format_ctx)) < 0)
+    // The cache files that belong to a file are named after its absolute name, and
+    // are only valid for this name and its size and modification time.
+    std::string abs_filename;
+    std::string file_id;
+    if (is_file)
     {
-        throw exc(str::asprintf(_("%s: Cannot read stream info: %s"),
-                    _url.c_str(), my_av_strerror(e).c_str()));
+        abs_filename = absolute_filename(_url);
+        file_id = str::from(static_cast<int64_t>(file_stat.st_size)) + " "
+            + str::from(static_cast<int64_t>(file_stat.st_mtime)) + " " + abs_filename;
+    }
+    // Use the cached stream information, or analyze the input. Without headers,
+    // the streams are only known after analyzing the input, so there is nothing to cache.
+    std::string stream_info_filename;
+    if (cache_stream_info && is_file && !abs_filename.empty()
+            && !(_ffmpeg->format_ctx->ctx_flags & AVFMTCTX_NOHEADER))
+    {
+        stream_info_filename = cache_filename(abs_filename, ".info");
     }
+    bool use_stream_info_cache = !stream_info_filename.empty();
+    std::string stream_info_key = "bino stream info 1 " + file_id;
+    if (use_stream_info_cache && stream_info::load(stream_info_filename, stream_info_key, _ffmpeg->format_ctx))
+    {
+        msg::dbg(_url + ": using stream information from " + stream_info_filename);
+    }
+    else
+    {
+        if ((e = av_find_stream_info(_ffmpeg->format_ctx)) < 0)
+        {
+            throw exc(str::asprintf(_("%s: Cannot read stream info: %s"),
+                        _url.c_str(), my_av_strerror(e).c_str()));
+        }
+        if (use_stream_info_cache && !stream_info::save(stream_info_filename, stream_info_key, _ffmpeg->format_ctx))
+        {
+            msg::dbg(_url + ": Cannot write stream information to " + stream_info_filename + ".");
+            std::remove(stream_info_filename.c_str());
+        }
+    }
+    int64_t probe_time = timer::get_microseconds(timer::monotonic);
+    info_mutex.lock();
     av_dump_format(_ffmpeg->format_ctx, 0, _url.c_str(), 0);
+    info_mutex.unlock();
 
     /* Metadata */
     AVDictionaryEntry *tag = NULL;
@@ -806,6 +1808,7 @@ void media_object::open(const std::string &url, const device_request &dev_reques
 
     _ffmpeg->have_active_audio_stream = false;
     _ffmpeg->pos = std::numeric_limits<int64_t>::min();
+    _ffmpeg->seek_deadline = 0;
 
     for (unsigned int i = 0; i < _ffmpeg->format_ctx->nb_streams
             && i < static_cast<unsigned int>(std::numeric_limits<int>::max()); i++)
@@ -824,7 +1827,20 @@ void media_object::open(const std::string &url, const device_request &dev_reques
         {
             // Activate multithreaded decoding. This must be done before opening the codec; see
             // http://lists.gnu.org/archive/html/bino-list/2011-08/msg00019.html
-            codec_ctx->thread_count = video_decoding_threads();
+            // Until we know better, assume that only this stream is decoded; see
+            // set_concurrent_video_streams(). Frame threading adds latency, so it
+            // is not used for devices unless requested.
+            codec_ctx->thread_count = video_decoding_threads(threading, 1);
+            codec_ctx->thread_type = (threading.type == decoder_threading::frame ? FF_THREAD_FRAME
+                    : threading.type == decoder_threading::slice || _is_device ? FF_THREAD_SLICE
+                    : FF_THREAD_FRAME | FF_THREAD_SLICE);
+            // Let the decoder decode directly into our frame buffers, if it supports this;
+            // see video_get_buffer(). Our buffers have no edges.
+            AVCodec *c = avcodec_find_decoder(codec_ctx->codec_id);
+            if (c && (c->capabilities & CODEC_CAP_DR1))
+            {
+                codec_ctx->flags |= CODEC_FLAG_EMU_EDGE;
+            }
         }
         // Find and open the codec. CODEC_ID_TEXT is a special case: it has no decoder since it is unencoded raw data.
         if (_ffmpeg->format_ctx->streams[i]->codec->codec_id != CODEC_ID_TEXT
@@ -856,43 +1872,77 @@ void media_object::open(const std::string &url, const device_request &dev_reques
             // Allocate things required for decoding
             _ffmpeg->video_packets.push_back(AVPacket());
             av_init_packet(&(_ffmpeg->video_packets[j]));
+            _ffmpeg->video_thread_requests.push_back(codec_ctx->thread_count);
             _ffmpeg->video_decode_threads.push_back(video_decode_thread(_url, _ffmpeg, j));
+            _ffmpeg->video_buffer_pools.push_back(frame_buffer_pool());
+            _ffmpeg->video_out_buffer_pools.push_back(frame_buffer_pool());
             _ffmpeg->video_frames.push_back(avcodec_alloc_frame());
             if (!_ffmpeg->video_frames[j])
             {
                 throw exc(HERE + ": " + strerror(ENOMEM));
             }
+            _ffmpeg->video_convert_threads.push_back(std::vector<video_convert_thread>());
+            // If YUV data should be converted to BGRA32, remember its format for
+            // the YUV converter.
+            video_frame yuv_format;
+            if (_always_convert_to_bgra32 && _ffmpeg->video_frame_templates[j].layout != video_frame::bgra32)
+            {
+                yuv_format = _ffmpeg->video_frame_templates[j];
+                _ffmpeg->video_frame_templates[j].layout = video_frame::bgra32;
+                _ffmpeg->video_frame_templates[j].color_space = video_frame::srgb;
+                _ffmpeg->video_frame_templates[j].value_range = video_frame::u8_full;
+                _ffmpeg->video_frame_templates[j].chroma_location = video_frame::center;
+            }
             if (_ffmpeg->video_frame_templates[j].layout == video_frame::bgra32)
             {
-                // Initialize things needed for software pixel format conversion
-                int bufsize = avpicture_get_size(PIX_FMT_BGRA,
-                        _ffmpeg->video_codec_ctxs[j]->width, _ffmpeg->video_codec_ctxs[j]->height);
-                _ffmpeg->video_out_frames.push_back(avcodec_alloc_frame());
-                _ffmpeg->video_buffers.push_back(static_cast<uint8_t *>(av_malloc(bufsize)));
-                if (!_ffmpeg->video_out_frames[j] || !_ffmpeg->video_buffers[j])
+                // Initialize things needed for software pixel format conversion.
+                // Convert in horizontal bands in parallel, unless the source format
+                // has a palette (which must not be offset) or there are too few rows.
+                // The band height is a multiple of 16 so that each band starts at
+                // a chroma row.
+                int w = _ffmpeg->video_codec_ctxs[j]->width;
+                int h = _ffmpeg->video_codec_ctxs[j]->height;
+                enum PixelFormat pix_fmt = _ffmpeg->video_codec_ctxs[j]->pix_fmt;
+                const AVPixFmtDescriptor *pix_desc = &(av_pix_fmt_descriptors[pix_fmt]);
+                int bands = std::max(std::min(std::min(processors(), 16), h / 64), 1);
+                if (pix_desc->flags & (PIX_FMT_PAL | PIX_FMT_HWACCEL))
                 {
-                    throw exc(HERE + ": " + strerror(ENOMEM));
+                    bands = 1;
                 }
-                avpicture_fill(reinterpret_cast<AVPicture *>(_ffmpeg->video_out_frames[j]), _ffmpeg->video_buffers[j],
-                        PIX_FMT_BGRA, _ffmpeg->video_codec_ctxs[j]->width, _ffmpeg->video_codec_ctxs[j]->height);
-                // Call sws_getCachedContext(NULL, ...) instead of sws_getContext(...) just to avoid a deprecation warning.
-                _ffmpeg->video_img_conv_ctxs.push_back(sws_getCachedContext(NULL,
-                            _ffmpeg->video_codec_ctxs[j]->width, _ffmpeg->video_codec_ctxs[j]->height, _ffmpeg->video_codec_ctxs[j]->pix_fmt,
-                            _ffmpeg->video_codec_ctxs[j]->width, _ffmpeg->video_codec_ctxs[j]->height, PIX_FMT_BGRA,
-                            SWS_POINT, NULL, NULL, NULL));
-                if (!_ffmpeg->video_img_conv_ctxs[j])
+                int band_height = ((h + bands - 1) / bands + 15) / 16 * 16;
+                // The YUV converter works on the full decoded frame.
+                yuv_format.raw_width = w;
+                yuv_format.raw_height = h;
+                for (int y = 0; y < h; y += band_height)
                 {
-                    throw exc(str::asprintf(_("%s video stream %d: Cannot initialize conversion context."),
-                                _url.c_str(), j + 1));
+                    int bh = std::min(band_height, h - y);
+                    if (video_yuv_converter::supports(yuv_format))
+                    {
+                        _ffmpeg->video_convert_threads[j].push_back(
+                                video_convert_thread(video_yuv_converter(yuv_format), y, bh));
+                        continue;
+                    }
+                    // Call sws_getCachedContext(NULL, ...) instead of sws_getContext(...) just to avoid a deprecation warning.
+                    struct SwsContext *ctx = sws_getCachedContext(NULL,
+                            w, bh, pix_fmt, w, bh, PIX_FMT_BGRA,
+                            SWS_POINT, NULL, NULL, NULL);
+                    if (!ctx)
+                    {
+                        throw exc(str::asprintf(_("%s video stream %d: Cannot initialize conversion context."),
+                                    _url.c_str(), j + 1));
+                    }
+                    _ffmpeg->video_convert_threads[j].push_back(
+                            video_convert_thread(ctx, y, bh, pix_desc->log2_chroma_h));
                 }
-            }
-            else
-            {
-                _ffmpeg->video_out_frames.push_back(NULL);
-                _ffmpeg->video_buffers.push_back(NULL);
-                _ffmpeg->video_img_conv_ctxs.push_back(NULL);
+                msg::dbg(_url + ": video stream " + str::from(j) + ": converting to BGRA32 in "
+                        + str::from(_ffmpeg->video_convert_threads[j].size()) + " bands"
+                        + (video_yuv_converter::supports(yuv_format) ? "" : " with libswscale"));
             }
             _ffmpeg->video_last_timestamps.push_back(std::numeric_limits<int64_t>::min());
+            _ffmpeg->video_lateness.push_back(0);
+            _ffmpeg->video_lateness_reports.push_back(0);
+            _ffmpeg->video_skip_levels.push_back(0);
+            _ffmpeg->video_lowres_requests.push_back(0);
         }
         else if (_ffmpeg->format_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
         {
@@ -904,16 +1954,14 @@ void media_object::open(const std::string &url, const device_request &dev_reques
             _ffmpeg->audio_blob_templates.push_back(audio_blob());
             set_audio_blob_template(j);
             _ffmpeg->audio_decode_threads.push_back(audio_decode_thread(_url, _ffmpeg, j));
-            // Manage audio_tmpbufs with av_malloc/av_free, to guarantee correct alignment.
-            // Not doing this results in hard to debug crashes on some systems.
-            _ffmpeg->audio_tmpbufs.push_back(static_cast<unsigned char*>(av_malloc(audio_tmpbuf_size)));
-            if (!_ffmpeg->audio_tmpbufs[j])
-            {
-                throw exc(HERE + ": " + strerror(ENOMEM));
-            }
+            _ffmpeg->audio_packets.push_back(AVPacket());
+            av_init_packet(&(_ffmpeg->audio_packets[j]));
+            _ffmpeg->audio_tmppackets.push_back(_ffmpeg->audio_packets[j]);
+            _ffmpeg->audio_tmppackets[j].size = 0;
             _ffmpeg->audio_blobs.push_back(blob());
-            _ffmpeg->audio_buffers.push_back(std::vector<unsigned char>());
+            _ffmpeg->audio_buffers.push_back(audio_ring_buffer());
             _ffmpeg->audio_last_timestamps.push_back(std::numeric_limits<int64_t>::min());
+            _ffmpeg->audio_seek_targets.push_back(std::numeric_limits<int64_t>::min());
         }
         else if (_ffmpeg->format_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_SUBTITLE)
         {
@@ -929,28 +1977,122 @@ void media_object::open(const std::string &url, const device_request &dev_reques
             _ffmpeg->subtitle_decode_threads.push_back(subtitle_decode_thread(_url, _ffmpeg, j));
             _ffmpeg->subtitle_box_buffers.push_back(std::deque<subtitle_box>());
             _ffmpeg->subtitle_last_timestamps.push_back(std::numeric_limits<int64_t>::min());
+            _ffmpeg->subtitle_indexes.push_back(subtitle_index());
+            _ffmpeg->subtitle_index_cursors.push_back(SIZE_MAX);
+            _ffmpeg->subtitle_resume_times.push_back(std::numeric_limits<int64_t>::min());
+            _ffmpeg->subtitle_streams_active.push_back(false);
+            _ffmpeg->subtitle_collected_packets.push_back(std::vector<AVPacket>());
         }
         else
         {
             msg::dbg(_url + " stream " + str::from(i) + " contains neither video nor audio nor subtitles.");
         }
     }
-    _ffmpeg->video_packet_queues.resize(video_streams());
-    _ffmpeg->audio_packet_queues.resize(audio_streams());
-    _ffmpeg->subtitle_packet_queues.resize(subtitle_streams());
-    _ffmpeg->video_packet_queue_mutexes.resize(video_streams());
-    _ffmpeg->audio_packet_queue_mutexes.resize(audio_streams());
-    _ffmpeg->subtitle_packet_queue_mutexes.resize(subtitle_streams());
+    int64_t codec_time = timer::get_microseconds(timer::monotonic);
+    // Install the buffer functions now that the pools do not move anymore.
+    for (int i = 0; i < video_streams(); i++)
+    {
+        if (_ffmpeg->video_codecs[i]->capabilities & CODEC_CAP_DR1)
+        {
+            _ffmpeg->video_codec_ctxs[i]->opaque = &(_ffmpeg->video_buffer_pools[i]);
+            _ffmpeg->video_codec_ctxs[i]->get_buffer = video_get_buffer;
+            _ffmpeg->video_codec_ctxs[i]->release_buffer = video_release_buffer;
+            _ffmpeg->video_codec_ctxs[i]->reget_buffer = video_reget_buffer;
+        }
+    }
+    // Text subtitles are kept in memory (see subtitle_index). For files that contain
+    // nothing else (e.g. external subtitle files) and for small files, they are
+    // preloaded with a separate AVFormatContext. For other files, reading them a
+    // second time would be expensive, so the read thread collects their packets
+    // instead; it reads them even if their streams are not active.
+    const int64_t subtitle_preload_max_file_size = 16 << 20;
+    bool have_text_subtitles = false;
+    for (int i = 0; i < subtitle_streams(); i++)
+    {
+        if (is_text_subtitle(_ffmpeg->subtitle_codec_ctxs[i]->codec_id))
+        {
+            have_text_subtitles = true;
+        }
+    }
+    if (is_file && have_text_subtitles)
+    {
+        _ffmpeg->preload_subtitles = ((video_streams() == 0 && audio_streams() == 0)
+                || file_stat.st_size <= subtitle_preload_max_file_size);
+        _ffmpeg->collect_subtitles = !_ffmpeg->preload_subtitles;
+        for (int i = 0; i < subtitle_streams(); i++)
+        {
+            if (collects_subtitle_packets(_ffmpeg, i))
+            {
+                _ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[i]]->discard = AVDISCARD_DEFAULT;
+            }
+        }
+    }
+    // For files, we want to read ahead to avoid i/o waits: each queue holds packets
+    // for the given presentation time, or at least a few packets, unless its
+    // amount of data or the packet memory budget forbids this. For devices, we do
+    // not want to read ahead to avoid latency.
+    const size_t video_packet_queue_min = (_is_device ? 1 : 8);         // Often, 1 packet results in one video frame
+    const size_t audio_packet_queue_min = (_is_device ? 1 : 32);        // Often, 3-4 packets are needed for one buffer fill
+    const size_t subtitle_packet_queue_min = (_is_device ? 1 : 4);      // Just a guess
+    const size_t video_packet_queue_bytes = (_is_device ? 0 : std::numeric_limits<size_t>::max());
+    const size_t audio_packet_queue_bytes = (_is_device ? 0 : 8 << 20); // Enough for seconds of lossless audio
+    const size_t subtitle_packet_queue_bytes = (_is_device ? 0 : 1 << 20);
+    const int64_t packet_queue_duration = (_is_device ? 0 : queue_duration);
+    _ffmpeg->video_packet_queues.resize(video_streams(),
+            packet_queue(&_ffmpeg->queue_sync, true, video_packet_queue_min,
+                video_packet_queue_bytes, packet_queue_duration));
+    _ffmpeg->audio_packet_queues.resize(audio_streams(),
+            packet_queue(&_ffmpeg->queue_sync, true, audio_packet_queue_min,
+                audio_packet_queue_bytes, packet_queue_duration));
+    _ffmpeg->subtitle_packet_queues.resize(subtitle_streams(),
+            packet_queue(&_ffmpeg->queue_sync, false, subtitle_packet_queue_min,
+                subtitle_packet_queue_bytes, packet_queue_duration));
+    packet_memory.register_sync(&_ffmpeg->queue_sync);
+    _ffmpeg->registered_queue_sync = true;
+    // Decode video frames ahead of time, but not for devices, to avoid latency.
+    _ffmpeg->video_decode_ahead = (_is_device ? 1 : decode_ahead);
+    _ffmpeg->video_frame_queues.resize(video_streams(),
+            video_frame_queue(_ffmpeg->video_decode_ahead));
+    // Use the cached keyframe index, or build it in the background. This is only
+    // useful for files in formats that have no usable index of their own.
+    if (index_keyframes && is_file && video_streams() > 0
+            && needs_keyframe_index(_ffmpeg->format_ctx->iformat))
+    {
+        // Without a cache file, the index is only kept in memory.
+        std::string index_filename = (abs_filename.empty() ? "" : cache_filename(abs_filename, ".index"));
+        std::string index_key = "bino keyframe index 1 " + file_id;
+        for (int i = 0; i < video_streams(); i++)
+        {
+            index_key += " " + str::from(_ffmpeg->video_streams[i]);
+        }
+        if (!index_filename.empty() && _ffmpeg->keyframes.load(index_filename, index_key, video_streams()))
+        {
+            msg::dbg(_url + ": using keyframe index from " + index_filename);
+        }
+        else
+        {
+            _ffmpeg->indexer = new index_thread(_url, _ffmpeg, index_filename, index_key);
+            _ffmpeg->indexer->start();
+        }
+    }
 
+    info_mutex.lock();
     msg::inf(_url + ":");
+    msg::inf(4, _("Opening took %g ms: input %g ms, probing %g ms, codecs %g ms."),
+            (codec_time - _ffmpeg->open_time) / 1e3f,
+            (input_time - _ffmpeg->open_time) / 1e3f,
+            (probe_time - input_time) / 1e3f,
+            (codec_time - probe_time) / 1e3f);
     for (int i = 0; i < video_streams(); i++)
     {
         msg::inf(4, _("Video stream %d: %s / %s, %g seconds"), i,
                 video_frame_template(i).format_info().c_str(),
                 video_frame_template(i).format_name().c_str(),
                 video_duration(i) / 1e6f);
-        msg::inf(8, _("Using up to %d threads for decoding."),
-                _ffmpeg->video_codec_ctxs.at(i)->thread_count);
+        msg::inf(8, _("Decoding with %s."),
+                video_threading_info(_ffmpeg->video_codec_ctxs.at(i)).c_str());
+        msg::inf(8, _("Decoding up to %d frames ahead."),
+                _ffmpeg->video_decode_ahead);
     }
     for (int i = 0; i < audio_streams(); i++)
     {
@@ -970,6 +2112,7 @@ void media_object::open(const std::string &url, const device_request &dev_reques
     {
         msg::inf(4, _("No usable streams."));
     }
+    info_mutex.unlock();
 }
 
 const std::string &media_object::url() const
@@ -1027,10 +2170,6 @@ void media_object::video_stream_set_active(int index, bool active)
     assert(index >= 0);
     assert(index < video_streams());
     // Stop decoder threads
-    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
-    {
-        _ffmpeg->video_decode_threads[i].finish();
-    }
     for (size_t i = 0; i < _ffmpeg->audio_streams.size(); i++)
     {
         _ffmpeg->audio_decode_threads[i].finish();
@@ -1039,8 +2178,17 @@ void media_object::video_stream_set_active(int index, bool active)
     {
         _ffmpeg->subtitle_decode_threads[i].finish();
     }
-    // Stop reading packets
+    // Stop the video decoder threads that run ahead, and stop reading packets.
+    // Frames that were already decoded are kept.
+    _ffmpeg->queue_sync.abort();
+    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
+    {
+        _ffmpeg->video_frame_queues[i].abort();
+        _ffmpeg->video_decode_threads[i].finish();
+        _ffmpeg->video_frame_queues[i].resume();
+    }
     _ffmpeg->reader->finish();
+    _ffmpeg->queue_sync.reset();
     // Set status
     _ffmpeg->format_ctx->streams[_ffmpeg->video_streams.at(index)]->discard =
         (active ? AVDISCARD_DEFAULT : AVDISCARD_ALL);
@@ -1053,10 +2201,6 @@ void media_object::audio_stream_set_active(int index, bool active)
     assert(index >= 0);
     assert(index < audio_streams());
     // Stop decoder threads
-    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
-    {
-        _ffmpeg->video_decode_threads[i].finish();
-    }
     for (size_t i = 0; i < _ffmpeg->audio_streams.size(); i++)
     {
         _ffmpeg->audio_decode_threads[i].finish();
@@ -1065,8 +2209,17 @@ void media_object::audio_stream_set_active(int index, bool active)
     {
         _ffmpeg->subtitle_decode_threads[i].finish();
     }
-    // Stop reading packets
+    // Stop the video decoder threads that run ahead, and stop reading packets.
+    // Frames that were already decoded are kept.
+    _ffmpeg->queue_sync.abort();
+    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
+    {
+        _ffmpeg->video_frame_queues[i].abort();
+        _ffmpeg->video_decode_threads[i].finish();
+        _ffmpeg->video_frame_queues[i].resume();
+    }
     _ffmpeg->reader->finish();
+    _ffmpeg->queue_sync.reset();
     // Set status
     _ffmpeg->format_ctx->streams[_ffmpeg->audio_streams.at(index)]->discard =
         (active ? AVDISCARD_DEFAULT : AVDISCARD_ALL);
@@ -1088,10 +2241,6 @@ void media_object::subtitle_stream_set_active(int index, bool active)
     assert(index >= 0);
     assert(index < subtitle_streams());
     // Stop decoder threads
-    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
-    {
-        _ffmpeg->video_decode_threads[i].finish();
-    }
     for (size_t i = 0; i < _ffmpeg->audio_streams.size(); i++)
     {
         _ffmpeg->audio_decode_threads[i].finish();
@@ -1100,13 +2249,30 @@ void media_object::subtitle_stream_set_active(int index, bool active)
     {
         _ffmpeg->subtitle_decode_threads[i].finish();
     }
-    // Stop reading packets
+    // Stop the video decoder threads that run ahead, and stop reading packets.
+    // Frames that were already decoded are kept.
+    _ffmpeg->queue_sync.abort();
+    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
+    {
+        _ffmpeg->video_frame_queues[i].abort();
+        _ffmpeg->video_decode_threads[i].finish();
+        _ffmpeg->video_frame_queues[i].resume();
+    }
     _ffmpeg->reader->finish();
+    _ffmpeg->queue_sync.reset();
     // Set status
+    _ffmpeg->subtitle_streams_active[index] = active;
     _ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams.at(index)]->discard =
-        (active ? AVDISCARD_DEFAULT : AVDISCARD_ALL);
+        (active || collects_subtitle_packets(_ffmpeg, index) ? AVDISCARD_DEFAULT : AVDISCARD_ALL);
     // Restart reader
     _ffmpeg->reader->start();
+    // Start reading text subtitles into memory
+    if (active && _ffmpeg->preload_subtitles && !_ffmpeg->subtitle_preloader
+            && is_text_subtitle(_ffmpeg->subtitle_codec_ctxs[index]->codec_id))
+    {
+        _ffmpeg->subtitle_preloader = new subtitle_preload_thread(_url, _ffmpeg);
+        _ffmpeg->subtitle_preloader->start();
+    }
 }
 
 const video_frame &media_object::video_frame_template(int video_stream) const
@@ -1171,386 +2337,2183 @@ int64_t media_object::subtitle_duration(int index) const
             _ffmpeg->format_ctx);
 }
 
-read_thread::read_thread(const std::string &url, bool is_device, struct ffmpeg_stuff *ffmpeg) :
-    _url(url), _is_device(is_device), _ffmpeg(ffmpeg), _eof(false)
+void packet_queue_sync::set_eof(int gen, const exc &e)
 {
+    lock.lock();
+    if (gen == generation)
+    {
+        eof = true;
+        read_error = e;
+        cond.wake_all();
+    }
+    lock.unlock();
 }
 
-void read_thread::run()
+void packet_queue_sync::abort()
 {
-    while (!_eof)
-    {
-        // We need another packet if the number of queued packets for an active stream is below a threshold.
-        // For files, we often want to read ahead to avoid i/o waits. For devices, we do not want to read
-        // ahead to avoid latency.
-        const size_t video_stream_low_threshold = (_is_device ? 1 : 2);         // Often, 1 packet results in one video frame
-        const size_t audio_stream_low_threshold = (_is_device ? 1 : 5);         // Often, 3-4 packets are needed for one buffer fill
-        const size_t subtitle_stream_low_threshold = (_is_device ? 1 : 1);      // Just a guess
-        bool need_another_packet = false;
-        for (size_t i = 0; !need_another_packet && i < _ffmpeg->video_streams.size(); i++)
-        {
-            if (_ffmpeg->format_ctx->streams[_ffmpeg->video_streams[i]]->discard == AVDISCARD_DEFAULT)
-            {
-                _ffmpeg->video_packet_queue_mutexes[i].lock();
-                need_another_packet = _ffmpeg->video_packet_queues[i].size() < video_stream_low_threshold;
-                _ffmpeg->video_packet_queue_mutexes[i].unlock();
-            }
-        }
-        for (size_t i = 0; !need_another_packet && i < _ffmpeg->audio_streams.size(); i++)
-        {
-            if (_ffmpeg->format_ctx->streams[_ffmpeg->audio_streams[i]]->discard == AVDISCARD_DEFAULT)
-            {
-                _ffmpeg->audio_packet_queue_mutexes[i].lock();
-                    need_another_packet = _ffmpeg->audio_packet_queues[i].size() < audio_stream_low_threshold;
-                    _ffmpeg->audio_packet_queue_mutexes[i].unlock();
-            }
-        }
-        for (size_t i = 0; !need_another_packet && i < _ffmpeg->subtitle_streams.size(); i++)
-        {
-            if (_ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[i]]->discard == AVDISCARD_DEFAULT)
-            {
-                _ffmpeg->subtitle_packet_queue_mutexes[i].lock();
-                need_another_packet = _ffmpeg->subtitle_packet_queues[i].size() < subtitle_stream_low_threshold;
-                _ffmpeg->subtitle_packet_queue_mutexes[i].unlock();
-            }
-        }
-        if (!need_another_packet)
-        {
-            msg::dbg(_url + ": No need to read more packets.");
-            break;
-        }
-        // Read a packet.
-        msg::dbg(_url + ": Reading a packet.");
-        AVPacket packet;
-        int e = av_read_frame(_ffmpeg->format_ctx, &packet);
-        if (e < 0)
-        {
-            if (e == AVERROR_EOF)
-            {
-                msg::dbg(_url + ": EOF.");
-                _eof = true;
-                return;
-            }
-            else
-            {
-                throw exc(str::asprintf(_("%s: %s"), _url.c_str(), my_av_strerror(e).c_str()));
-            }
-        }
-        // Put the packet in the right queue.
-        bool packet_queued = false;
-        for (size_t i = 0; i < _ffmpeg->video_streams.size() && !packet_queued; i++)
-        {
-            if (packet.stream_index == _ffmpeg->video_streams[i])
-            {
-                // We do not check for missing timestamps here, as we do with audio
-                // packets, for the following reasons:
-                // 1. The video decoder might fill in a timestamp for us
-                // 2. We cannot drop video packets anyway, because of their
-                //    interdependencies. We would mess up decoding.
-                if (av_dup_packet(&packet) < 0)
-                {
-                    throw exc(str::asprintf(_("%s: Cannot duplicate packet."), _url.c_str()));
-                }
-                _ffmpeg->video_packet_queue_mutexes[i].lock();
-                _ffmpeg->video_packet_queues[i].push_back(packet);
-                _ffmpeg->video_packet_queue_mutexes[i].unlock();
-                packet_queued = true;
-                msg::dbg(_url + ": "
-                        + str::from(_ffmpeg->video_packet_queues[i].size())
-                        + " packets queued in video stream " + str::from(i) + ".");
-            }
-        }
-        for (size_t i = 0; i < _ffmpeg->audio_streams.size() && !packet_queued; i++)
-        {
-            if (packet.stream_index == _ffmpeg->audio_streams[i])
-            {
-                _ffmpeg->audio_packet_queue_mutexes[i].lock();
-                if (_ffmpeg->audio_packet_queues[i].empty()
-                        && _ffmpeg->audio_last_timestamps[i] == std::numeric_limits<int64_t>::min()
-                        && packet.dts == static_cast<int64_t>(AV_NOPTS_VALUE))
-                {
-                    // We have no packet in the queue and no last timestamp, probably
-                    // because we just seeked. We *need* a packet with a timestamp.
-                    msg::dbg(_url + ": audio stream " + str::from(i)
-                            + ": dropping packet because it has no timestamp");
-                }
-                else
-                {
-                    if (av_dup_packet(&packet) < 0)
-                    {
-                        _ffmpeg->audio_packet_queue_mutexes[i].unlock();
-                        throw exc(str::asprintf(_("%s: Cannot duplicate packet."), _url.c_str()));
-                    }
-                    _ffmpeg->audio_packet_queues[i].push_back(packet);
-                    packet_queued = true;
-                    msg::dbg(_url + ": "
-                            + str::from(_ffmpeg->audio_packet_queues[i].size())
-                            + " packets queued in audio stream " + str::from(i) + ".");
-                }
-                _ffmpeg->audio_packet_queue_mutexes[i].unlock();
-            }
-        }
-        for (size_t i = 0; i < _ffmpeg->subtitle_streams.size() && !packet_queued; i++)
-        {
-            if (packet.stream_index == _ffmpeg->subtitle_streams[i])
-            {
-                _ffmpeg->subtitle_packet_queue_mutexes[i].lock();
-                if (_ffmpeg->subtitle_packet_queues[i].empty()
-                        && _ffmpeg->subtitle_last_timestamps[i] == std::numeric_limits<int64_t>::min()
-                        && packet.dts == static_cast<int64_t>(AV_NOPTS_VALUE))
-                {
-                    // We have no packet in the queue and no last timestamp, probably
-                    // because we just seeked. We want a packet with a timestamp.
-                    msg::dbg(_url + ": subtitle stream " + str::from(i)
-                            + ": dropping packet because it has no timestamp");
-                }
-                else
-                {
-                    if (av_dup_packet(&packet) < 0)
-                    {
-                        _ffmpeg->subtitle_packet_queue_mutexes[i].unlock();
-                        throw exc(str::asprintf(_("%s: Cannot duplicate packet."), _url.c_str()));
-                    }
-                    _ffmpeg->subtitle_packet_queues[i].push_back(packet);
-                    packet_queued = true;
-                    msg::dbg(_url + ": "
-                            + str::from(_ffmpeg->subtitle_packet_queues[i].size())
-                            + " packets queued in subtitle stream " + str::from(i) + ".");
-                }
-                _ffmpeg->subtitle_packet_queue_mutexes[i].unlock();
-            }
-        }
-        if (!packet_queued)
-        {
-            av_free_packet(&packet);
-        }
-    }
+    lock.lock();
+    aborted = true;
+    cond.wake_all();
+    lock.unlock();
 }
 
-void read_thread::reset()
+void packet_queue_sync::reset()
 {
-    exception() = exc();
-    _eof = false;
+    lock.lock();
+    eof = false;
+    aborted = false;
+    read_error = exc();
+    lock.unlock();
 }
 
-video_decode_thread::video_decode_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg, int video_stream) :
-    _url(url), _ffmpeg(ffmpeg), _video_stream(video_stream), _frame()
+void packet_queue_sync::request_seek(int64_t pos, bool backward, int64_t target, int64_t deadline)
 {
+    lock.lock();
+    generation++;
+    seek_pending = true;
+    seek_pos = pos;
+    seek_backward = backward;
+    seek_target = target;
+    seek_deadline = deadline;
+    eof = false;
+    read_error = exc();
+    cond.wake_all();
+    lock.unlock();
 }
 
-int64_t video_decode_thread::handle_timestamp(int64_t timestamp)
+void packet_queue_sync::get_seek_target(int gen, int64_t *target, int64_t *deadline)
 {
-    int64_t ts = timestamp_helper(_ffmpeg->video_last_timestamps[_video_stream], timestamp);
-    if (!_ffmpeg->have_active_audio_stream || _ffmpeg->pos == std::numeric_limits<int64_t>::min())
+    lock.lock();
+    if (gen == generation)
     {
-        _ffmpeg->pos = ts;
+        *target = seek_target;
+        *deadline = seek_deadline;
     }
-    return ts;
+    else
+    {
+        // A newer seek request will be handled soon; do not waste time on this one.
+        *target = std::numeric_limits<int64_t>::min();
+        *deadline = 0;
+    }
+    lock.unlock();
 }
 
-void video_decode_thread::run()
+bool packet_queue_sync::wait_for_seek(int gen)
 {
-    int frame_finished = 0;
-    do
+    lock.lock();
+    while (!aborted && gen == generation)
     {
-        bool empty;
-        do
-        {
-            _ffmpeg->video_packet_queue_mutexes[_video_stream].lock();
-            empty = _ffmpeg->video_packet_queues[_video_stream].empty();
-            _ffmpeg->video_packet_queue_mutexes[_video_stream].unlock();
-            if (empty)
-            {
-                if (_ffmpeg->reader->eof())
-                {
-                    _frame = video_frame();
-                    return;
-                }
-                msg::dbg(_url + ": video stream " + str::from(_video_stream) + ": need to wait for packets...");
-                _ffmpeg->reader->start();
-                _ffmpeg->reader->finish();
-            }
-        }
-        while (empty);
-        av_free_packet(&(_ffmpeg->video_packets[_video_stream]));
-        _ffmpeg->video_packet_queue_mutexes[_video_stream].lock();
-        _ffmpeg->video_packets[_video_stream] = _ffmpeg->video_packet_queues[_video_stream].front();
-        _ffmpeg->video_packet_queues[_video_stream].pop_front();
-        _ffmpeg->video_packet_queue_mutexes[_video_stream].unlock();
-        _ffmpeg->reader->start();       // Refill the packet queue
-        avcodec_decode_video2(_ffmpeg->video_codec_ctxs[_video_stream],
-                _ffmpeg->video_frames[_video_stream], &frame_finished,
-                &(_ffmpeg->video_packets[_video_stream]));
+        cond.wait(lock);
     }
-    while (!frame_finished);
+    bool seeked = !aborted;
+    lock.unlock();
+    return seeked;
+}
 
-    _frame = _ffmpeg->video_frame_templates[_video_stream];
-    if (_frame.layout == video_frame::bgra32)
-    {
-        sws_scale(_ffmpeg->video_img_conv_ctxs[_video_stream],
-                _ffmpeg->video_frames[_video_stream]->data,
-                _ffmpeg->video_frames[_video_stream]->linesize,
-                0, _frame.raw_height,
-                _ffmpeg->video_out_frames[_video_stream]->data,
-                _ffmpeg->video_out_frames[_video_stream]->linesize);
-        // TODO: Handle sws_scale errors. How?
-        _frame.data[0][0] = _ffmpeg->video_out_frames[_video_stream]->data[0];
-        _frame.line_size[0][0] = _ffmpeg->video_out_frames[_video_stream]->linesize[0];
-    }
-    else
+void packet_queue_sync::throw_read_error()
+{
+    lock.lock();
+    exc e = read_error;
+    lock.unlock();
+    if (!e.empty())
     {
-        _frame.data[0][0] = _ffmpeg->video_frames[_video_stream]->data[0];
-        _frame.data[0][1] = _ffmpeg->video_frames[_video_stream]->data[1];
-        _frame.data[0][2] = _ffmpeg->video_frames[_video_stream]->data[2];
-        _frame.line_size[0][0] = _ffmpeg->video_frames[_video_stream]->linesize[0];
-        _frame.line_size[0][1] = _ffmpeg->video_frames[_video_stream]->linesize[1];
-        _frame.line_size[0][2] = _ffmpeg->video_frames[_video_stream]->linesize[2];
+        throw e;
     }
+}
+
+void packet_memory_budget::set(size_t budget)
+{
+    _mutex.lock();
+    _budget = budget;
+    _mutex.unlock();
+    wake_waiting();
+}
+
+void packet_memory_budget::register_sync(struct packet_queue_sync *sync)
+{
+    _syncs_mutex.lock();
+    _syncs.push_back(sync);
+    _syncs_mutex.unlock();
+}
+
+void packet_memory_budget::unregister_sync(struct packet_queue_sync *sync)
+{
+    _syncs_mutex.lock();
+    _syncs.erase(std::find(_syncs.begin(), _syncs.end(), sync));
+    _syncs_mutex.unlock();
+}
+
+void packet_memory_budget::add(size_t bytes)
+{
+    _mutex.lock();
+    _used += bytes;
+    _mutex.unlock();
+}
+
+void packet_memory_budget::remove(size_t bytes)
+{
+    _mutex.lock();
+    _used -= bytes;
+    _mutex.unlock();
+}
 
-    if (_ffmpeg->video_packets[_video_stream].dts != static_cast<int64_t>(AV_NOPTS_VALUE))
+bool packet_memory_budget::start_waiting(bool starving)
+{
+    _mutex.lock();
+    // The hard ceiling is a quarter above the budget.
+    bool used_up = (_budget > 0 && _used >= (starving ? _budget + _budget / 4 : _budget));
+    if (used_up)
     {
-        _frame.presentation_time = handle_timestamp(_ffmpeg->video_packets[_video_stream].dts * 1000000
-                * _ffmpeg->format_ctx->streams[_ffmpeg->video_streams[_video_stream]]->time_base.num
-                / _ffmpeg->format_ctx->streams[_ffmpeg->video_streams[_video_stream]]->time_base.den);
+        _waiting++;
     }
-    else if (_ffmpeg->video_last_timestamps[_video_stream] != std::numeric_limits<int64_t>::min())
+    _mutex.unlock();
+    return used_up;
+}
+
+void packet_memory_budget::stop_waiting()
+{
+    _mutex.lock();
+    _waiting--;
+    _mutex.unlock();
+}
+
+void packet_memory_budget::wake_waiting()
+{
+    _mutex.lock();
+    bool wake = (_waiting > 0 && (_budget == 0 || _used < _budget));
+    _mutex.unlock();
+    if (wake)
     {
-        msg::dbg(_url + ": video stream " + str::from(_video_stream)
-                + ": no timestamp available, using a questionable guess");
-        _frame.presentation_time = _ffmpeg->video_last_timestamps[_video_stream];
+        // A waiting read thread holds the lock of its queue synchronization until
+        // it waits, so it cannot miss this.
+        _syncs_mutex.lock();
+        for (size_t i = 0; i < _syncs.size(); i++)
+        {
+            _syncs[i]->lock.lock();
+            _syncs[i]->cond.wake_all();
+            _syncs[i]->lock.unlock();
+        }
+        _syncs_mutex.unlock();
     }
-    else
+}
+
+packet_queue::packet_queue(struct packet_queue_sync *sync, bool essential,
+        size_t min_packets, size_t max_bytes, int64_t max_duration) :
+    _sync(sync), _essential(essential), _min_packets(min_packets), _max_bytes(max_bytes), _max_duration(max_duration),
+    _ring(std::max(min_packets, static_cast<size_t>(1))),
+    _generations(_ring.size()), _timestamps(_ring.size()),
+    _head(0), _size(0), _bytes(0)
+{
+}
+
+void packet_queue::remove_front(bool free_packet)
+{
+    size_t bytes = _ring[_head].size;
+    if (free_packet)
     {
-        msg::dbg(_url + ": video stream " + str::from(_video_stream)
-                + ": no timestamp available, using a bad guess");
-        _frame.presentation_time = _ffmpeg->pos;
+        av_free_packet(&(_ring[_head]));
     }
+    _bytes -= bytes;
+    packet_memory.remove(bytes);
+    _head = (_head + 1) % _ring.size();
+    _size--;
 }
 
-void media_object::start_video_frame_read(int video_stream)
+void packet_queue::drop_stale()
 {
-    assert(video_stream >= 0);
-    assert(video_stream < video_streams());
-    _ffmpeg->video_decode_threads[video_stream].start();
+    // Stale packets were queued before the packets of the current generation,
+    // so they are always at the front of the queue.
+    while (_size > 0 && _generations[_head] != _sync->generation)
+    {
+        remove_front(true);
+    }
 }
 
-video_frame media_object::finish_video_frame_read(int video_stream)
+int64_t packet_queue::duration()
 {
-    assert(video_stream >= 0);
-    assert(video_stream < video_streams());
-    _ffmpeg->video_decode_threads[video_stream].finish();
-    return _ffmpeg->video_decode_threads[video_stream].frame();
+    // The presentation time between the first and the last packet with a timestamp.
+    size_t first = 0;
+    while (first < _size && _timestamps[(_head + first) % _ring.size()] == std::numeric_limits<int64_t>::min())
+    {
+        first++;
+    }
+    size_t last = _size;
+    while (last > first + 1 && _timestamps[(_head + last - 1) % _ring.size()] == std::numeric_limits<int64_t>::min())
+    {
+        last--;
+    }
+    return (last > first + 1
+            ? _timestamps[(_head + last - 1) % _ring.size()] - _timestamps[(_head + first) % _ring.size()]
+            : 0);
 }
 
-audio_decode_thread::audio_decode_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg, int audio_stream) :
-    _url(url), _ffmpeg(ffmpeg), _audio_stream(audio_stream), _blob()
+bool packet_queue::full()
 {
+    return (_size >= _min_packets
+            && (_bytes >= _max_bytes || (_max_duration > 0 && duration() >= _max_duration)));
 }
 
-int64_t audio_decode_thread::handle_timestamp(int64_t timestamp)
+bool packet_queue::overfull()
 {
-    int64_t ts = timestamp_helper(_ffmpeg->audio_last_timestamps[_audio_stream], timestamp);
-    _ffmpeg->pos = ts;
-    return ts;
+    return (_size >= _min_packets && _bytes >= _hard_max_bytes);
 }
 
-void audio_decode_thread::run()
+bool packet_queue::push(const AVPacket &packet, int generation, int64_t timestamp)
 {
-    size_t size = _ffmpeg->audio_blobs[_audio_stream].size();
-    void *buffer = _ffmpeg->audio_blobs[_audio_stream].ptr();
-    int64_t timestamp = std::numeric_limits<int64_t>::min();
-    size_t i = 0;
-    while (i < size)
+    _sync->lock.lock();
+    drop_stale();
+    while (!_sync->aborted && generation == _sync->generation)
     {
-        if (_ffmpeg->audio_buffers[_audio_stream].size() > 0)
+        bool starving = (_sync->starving > 0);
+        if (starving ? overfull() : full())
         {
-            // Use available decoded audio data
-            size_t remaining = std::min(size - i, _ffmpeg->audio_buffers[_audio_stream].size());
-            memcpy(buffer, &(_ffmpeg->audio_buffers[_audio_stream][0]), remaining);
-            _ffmpeg->audio_buffers[_audio_stream].erase(
-                    _ffmpeg->audio_buffers[_audio_stream].begin(),
-                    _ffmpeg->audio_buffers[_audio_stream].begin() + remaining);
-            buffer = reinterpret_cast<unsigned char *>(buffer) + remaining;
-            i += remaining;
+            _sync->cond.wait(_sync->lock);
         }
-        if (_ffmpeg->audio_buffers[_audio_stream].size() == 0)
+        else if (_size >= _min_packets && packet_memory.start_waiting(starving))
         {
-            // Read more audio data
-            AVPacket packet, tmppacket;
-            bool empty;
-            do
+            _sync->cond.wait(_sync->lock);
+            packet_memory.stop_waiting();
+        }
+        else
+        {
+            break;
+        }
+        drop_stale();
+    }
+    bool pushed = !_sync->aborted;
+    if (pushed && generation != _sync->generation)
+    {
+        AVPacket stale_packet = packet;
+        av_free_packet(&stale_packet);
+    }
+    else if (pushed)
+    {
+        if (_size == _ring.size())
+        {
+            // Grow the ring, keeping the packets in order.
+            std::vector<AVPacket> ring(2 * _ring.size());
+            std::vector<int> generations(2 * _ring.size());
+            std::vector<int64_t> timestamps(2 * _ring.size());
+            for (size_t i = 0; i < _size; i++)
             {
-                _ffmpeg->audio_packet_queue_mutexes[_audio_stream].lock();
-                empty = _ffmpeg->audio_packet_queues[_audio_stream].empty();
-                _ffmpeg->audio_packet_queue_mutexes[_audio_stream].unlock();
-                if (empty)
-                {
-                    if (_ffmpeg->reader->eof())
-                    {
-                        _blob = audio_blob();
-                        return;
+                ring[i] = _ring[(_head + i) % _ring.size()];
+                generations[i] = _generations[(_head + i) % _ring.size()];
+                timestamps[i] = _timestamps[(_head + i) % _ring.size()];
+            }
+            _ring.swap(ring);
+            _generations.swap(generations);
+            _timestamps.swap(timestamps);
+            _head = 0;
+        }
+        _ring[(_head + _size) % _ring.size()] = packet;
+        _generations[(_head + _size) % _ring.size()] = generation;
+        _timestamps[(_head + _size) % _ring.size()] = timestamp;
+        _size++;
+        _bytes += packet.size;
+        packet_memory.add(packet.size);
+        if (_sync->starving > 0 && full() && !_sync->overfull)
+        {
+            // The queue only takes this packet because an audio or video decoder
+            // starves, which means that the input is badly interleaved. Blocking
+            // here would stop playback, so the limits are exceeded up to the
+            // hard ceilings.
+            msg::dbg("Packet queue exceeds its limits because a decoder starves.");
+            _sync->overfull = true;
+        }
+        _sync->cond.wake_all();
+    }
+    _sync->lock.unlock();
+    return pushed;
+}
+
+bool packet_queue::pop(AVPacket &packet, int *generation)
+{
+    _sync->lock.lock();
+    bool starving = false;
+    drop_stale();
+    while (!_sync->aborted && !_sync->eof && _size == 0)
+    {
+        if (!starving && _essential)
+        {
+            // The read thread might wait for space in another queue; wake it up.
+            starving = true;
+            _sync->starving++;
+            _sync->cond.wake_all();
+        }
+        _sync->cond.wait(_sync->lock);
+        drop_stale();
+    }
+    if (starving)
+    {
+        _sync->starving--;
+    }
+    bool popped = (!_sync->aborted && _size > 0);
+    if (popped)
+    {
+        packet = _ring[_head];
+        remove_front(false);
+        _sync->cond.wake_all();
+    }
+    if (generation)
+    {
+        *generation = _sync->generation;
+    }
+    _sync->lock.unlock();
+    packet_memory.wake_waiting();
+    return popped;
+}
+
+size_t packet_queue::size()
+{
+    _sync->lock.lock();
+    drop_stale();
+    size_t s = _size;
+    _sync->lock.unlock();
+    return s;
+}
+
+void packet_queue::flush()
+{
+    _sync->lock.lock();
+    while (_size > 0)
+    {
+        remove_front(true);
+    }
+    _head = 0;
+    _sync->cond.wake_all();
+    _sync->lock.unlock();
+    packet_memory.wake_waiting();
+}
+
+packet_arena::packet_arena() : _allocations(0)
+{
+}
+
+packet_arena::~packet_arena()
+{
+    for (int c = 0; c <= _max_class - _min_class; c++)
+    {
+        for (size_t i = 0; i < _free[c].size(); i++)
+        {
+            av_free(_free[c][i]);
+        }
+    }
+}
+
+int packet_arena::size_class(size_t size)
+{
+    int c = _min_class;
+    while (c <= _max_class && (static_cast<size_t>(1) << c) < size)
+    {
+        c++;
+    }
+    return c;
+}
+
+void packet_arena::destruct(AVPacket *packet)
+{
+    packet_arena *arena = static_cast<packet_arena *>(packet->priv);
+    int c = size_class(packet->size + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (c > _max_class)
+    {
+        av_free(packet->data);
+    }
+    else
+    {
+        arena->_mutex.lock();
+        arena->_free[c - _min_class].push_back(packet->data);
+        arena->_mutex.unlock();
+    }
+    packet->data = NULL;
+    packet->size = 0;
+}
+
+bool packet_arena::dup(AVPacket *packet)
+{
+    if (packet->destruct == av_destruct_packet || packet->destruct == destruct || !packet->data)
+    {
+        return true;
+    }
+    size_t size = packet->size + FF_INPUT_BUFFER_PADDING_SIZE;
+    int c = size_class(size);
+    void *data = NULL;
+    _mutex.lock();
+    if (c <= _max_class && !_free[c - _min_class].empty())
+    {
+        data = _free[c - _min_class].back();
+        _free[c - _min_class].pop_back();
+    }
+    else
+    {
+        _allocations++;
+    }
+    _mutex.unlock();
+    if (!data)
+    {
+        data = av_malloc(c <= _max_class ? (static_cast<size_t>(1) << c) : size);
+        if (!data)
+        {
+            return false;
+        }
+    }
+    std::memcpy(data, packet->data, packet->size);
+    std::memset(static_cast<uint8_t *>(data) + packet->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    packet->data = static_cast<uint8_t *>(data);
+    packet->destruct = destruct;
+    packet->priv = this;
+    return true;
+}
+
+size_t packet_arena::allocations()
+{
+    _mutex.lock();
+    size_t a = _allocations;
+    _mutex.unlock();
+    return a;
+}
+
+video_frame_queue::video_frame_queue(size_t capacity) :
+    _capacity(capacity), _frames(), _closed(false), _aborted(false), _generation(0)
+{
+}
+
+bool video_frame_queue::push(const video_frame &frame, int generation)
+{
+    _mutex.lock();
+    while (!_aborted && generation == _generation && _frames.size() >= _capacity)
+    {
+        _cond.wait(_mutex);
+    }
+    bool pushed = !_aborted;
+    if (pushed && generation == _generation)
+    {
+        _frames.push_back(frame);
+        _cond.wake_all();
+    }
+    _mutex.unlock();
+    return pushed;
+}
+
+bool video_frame_queue::pop(video_frame &frame)
+{
+    _mutex.lock();
+    while (!_aborted && !_closed && _frames.empty())
+    {
+        _cond.wait(_mutex);
+    }
+    bool popped = !_frames.empty();
+    if (popped)
+    {
+        frame = _frames.front();
+        _frames.pop_front();
+        _cond.wake_all();
+    }
+    _mutex.unlock();
+    return popped;
+}
+
+size_t video_frame_queue::size()
+{
+    _mutex.lock();
+    size_t s = _frames.size();
+    _mutex.unlock();
+    return s;
+}
+
+void video_frame_queue::close()
+{
+    _mutex.lock();
+    _closed = true;
+    _cond.wake_all();
+    _mutex.unlock();
+}
+
+void video_frame_queue::reopen()
+{
+    _mutex.lock();
+    _closed = false;
+    _mutex.unlock();
+}
+
+void video_frame_queue::abort()
+{
+    _mutex.lock();
+    _aborted = true;
+    _cond.wake_all();
+    _mutex.unlock();
+}
+
+void video_frame_queue::resume()
+{
+    _mutex.lock();
+    _aborted = false;
+    _mutex.unlock();
+}
+
+void video_frame_queue::flush()
+{
+    _mutex.lock();
+    _frames.clear();
+    _cond.wake_all();
+    _mutex.unlock();
+}
+
+void video_frame_queue::flush(int generation)
+{
+    _mutex.lock();
+    _frames.clear();
+    _generation = generation;
+    _cond.wake_all();
+    _mutex.unlock();
+}
+
+void audio_ring_buffer::init(size_t capacity, size_t overhang)
+{
+    assert(!_buf);
+    _buf = static_cast<unsigned char *>(av_malloc(capacity + overhang));
+    if (!_buf)
+    {
+        throw exc(HERE + ": " + strerror(ENOMEM));
+    }
+    _capacity = capacity;
+    _overhang = overhang;
+    clear();
+}
+
+void audio_ring_buffer::deinit()
+{
+    av_free(_buf);
+    _buf = NULL;
+    _capacity = 0;
+    _overhang = 0;
+    clear();
+}
+
+void audio_ring_buffer::commit(size_t n)
+{
+    assert(n <= write_space());
+    size_t pos = (_start + _size) % _capacity;
+    if (pos + n > _capacity)
+    {
+        std::memcpy(_buf, _buf + _capacity, pos + n - _capacity);
+    }
+    _size += n;
+}
+
+size_t audio_ring_buffer::read(void *dst, size_t n)
+{
+    n = std::min(n, _size);
+    size_t n0 = std::min(n, _capacity - _start);
+    std::memcpy(dst, _buf + _start, n0);
+    std::memcpy(static_cast<unsigned char *>(dst) + n0, _buf, n - n0);
+    _start = (_start + n) % _capacity;
+    _size -= n;
+    if (_size == 0)
+    {
+        // Start again at the beginning, where the memory is aligned.
+        _start = 0;
+    }
+    return n;
+}
+
+void audio_ring_buffer::skip(size_t n)
+{
+    n = std::min(n, _size);
+    _start = (_start + n) % _capacity;
+    _size -= n;
+    if (_size == 0)
+    {
+        _start = 0;
+    }
+}
+
+read_thread::read_thread(const std::string &url, bool is_device, struct ffmpeg_stuff *ffmpeg) :
+    _url(url), _is_device(is_device), _ffmpeg(ffmpeg)
+{
+}
+
+void read_thread::run()
+{
+    // There is nothing to do if no stream is active. Subtitle streams that are
+    // only read to collect their packets do not count.
+    bool have_active_stream = false;
+    for (size_t i = 0; !have_active_stream && i < _ffmpeg->video_streams.size(); i++)
+    {
+        have_active_stream = (_ffmpeg->format_ctx->streams[_ffmpeg->video_streams[i]]->discard == AVDISCARD_DEFAULT);
+    }
+    for (size_t i = 0; !have_active_stream && i < _ffmpeg->audio_streams.size(); i++)
+    {
+        have_active_stream = (_ffmpeg->format_ctx->streams[_ffmpeg->audio_streams[i]]->discard == AVDISCARD_DEFAULT);
+    }
+    for (size_t i = 0; !have_active_stream && i < _ffmpeg->subtitle_streams.size(); i++)
+    {
+        have_active_stream = _ffmpeg->subtitle_streams_active[i];
+    }
+    if (!have_active_stream)
+    {
+        msg::dbg(_url + ": No active streams; no need to read packets.");
+        return;
+    }
+    struct packet_queue_sync &sync = _ffmpeg->queue_sync;
+    int generation = -1;
+    try
+    {
+        for (;;)
+        {
+            // Perform a pending seek request. At the end of the input, wait for one.
+            sync.lock.lock();
+            while (!sync.aborted && !sync.seek_pending && sync.eof)
+            {
+                sync.cond.wait(sync.lock);
+            }
+            bool aborted = sync.aborted;
+            bool seek_pending = sync.seek_pending;
+            int64_t seek_pos = sync.seek_pos;
+            bool seek_backward = sync.seek_backward;
+            sync.seek_pending = false;
+            generation = sync.generation;
+            sync.lock.unlock();
+            if (aborted)
+            {
+                return;
+            }
+            if (seek_pending)
+            {
+                seek(seek_pos, seek_backward);
+            }
+            // Read a packet.
+            msg::dbg(_url + ": Reading a packet.");
+            AVPacket packet;
+            int e = av_read_frame(_ffmpeg->format_ctx, &packet);
+            if (e < 0)
+            {
+                if (e == AVERROR_EOF)
+                {
+                    msg::dbg(_url + ": EOF.");
+                    if (_ffmpeg->collect_subtitles)
+                    {
+                        stop_collecting_subtitle_packets(true);
+                    }
+                    sync.set_eof(generation);
+                }
+                else
+                {
+                    // Let the decode threads report the error. A seek may recover from it.
+                    sync.set_eof(generation, exc(str::asprintf(_("%s: %s"),
+                                    _url.c_str(), my_av_strerror(e).c_str())));
+                }
+                continue;
+            }
+            // Put the packet in the right queue. This blocks while the queue is full.
+            packet_queue *queue = NULL;
+            for (size_t i = 0; i < _ffmpeg->video_streams.size() && !queue; i++)
+            {
+                if (packet.stream_index == _ffmpeg->video_streams[i])
+                {
+                    // We do not check for missing timestamps here, as we do with audio
+                    // packets, for the following reasons:
+                    // 1. The video decoder might fill in a timestamp for us
+                    // 2. We cannot drop video packets anyway, because of their
+                    //    interdependencies. We would mess up decoding.
+                    queue = &(_ffmpeg->video_packet_queues[i]);
+                }
+            }
+            for (size_t i = 0; i < _ffmpeg->audio_streams.size() && !queue; i++)
+            {
+                if (packet.stream_index == _ffmpeg->audio_streams[i])
+                {
+                    if (_ffmpeg->audio_packet_queues[i].empty()
+                            && _ffmpeg->audio_last_timestamps[i] == std::numeric_limits<int64_t>::min()
+                            && packet.dts == static_cast<int64_t>(AV_NOPTS_VALUE))
+                    {
+                        // We have no packet in the queue and no last timestamp, probably
+                        // because we just seeked. We *need* a packet with a timestamp.
+                        msg::dbg(_url + ": audio stream " + str::from(i)
+                                + ": dropping packet because it has no timestamp");
+                        break;
+                    }
+                    queue = &(_ffmpeg->audio_packet_queues[i]);
+                }
+            }
+            for (size_t i = 0; i < _ffmpeg->subtitle_streams.size() && !queue; i++)
+            {
+                if (packet.stream_index == _ffmpeg->subtitle_streams[i])
+                {
+                    if (collects_subtitle_packets(_ffmpeg, i))
+                    {
+                        collect_subtitle_packet(i, packet);
+                    }
+                    if (!_ffmpeg->subtitle_streams_active[i] || _ffmpeg->subtitle_indexes[i].ready())
+                    {
+                        // The packet was only read to collect it, or the subtitle
+                        // decode thread does not need packets anymore.
+                        break;
+                    }
+                    if (_ffmpeg->subtitle_packet_queues[i].empty()
+                            && _ffmpeg->subtitle_last_timestamps[i] == std::numeric_limits<int64_t>::min()
+                            && packet.dts == static_cast<int64_t>(AV_NOPTS_VALUE))
+                    {
+                        // We have no packet in the queue and no last timestamp, probably
+                        // because we just seeked. We want a packet with a timestamp.
+                        msg::dbg(_url + ": subtitle stream " + str::from(i)
+                                + ": dropping packet because it has no timestamp");
+                        break;
+                    }
+                    queue = &(_ffmpeg->subtitle_packet_queues[i]);
+                }
+            }
+            if (!queue)
+            {
+                av_free_packet(&packet);
+                continue;
+            }
+            if (!_ffmpeg->arena.dup(&packet))
+            {
+                av_free_packet(&packet);
+                sync.set_eof(generation, exc(str::asprintf(_("%s: Cannot duplicate packet."), _url.c_str())));
+                continue;
+            }
+            int64_t timestamp = std::numeric_limits<int64_t>::min();
+            int64_t ts = (packet.dts != static_cast<int64_t>(AV_NOPTS_VALUE) ? packet.dts : packet.pts);
+            if (ts != static_cast<int64_t>(AV_NOPTS_VALUE))
+            {
+                AVRational time_base = _ffmpeg->format_ctx->streams[packet.stream_index]->time_base;
+                timestamp = ts * 1000000 * time_base.num / time_base.den;
+            }
+            if (!queue->push(packet, generation, timestamp))
+            {
+                // The packet queues were aborted.
+                av_free_packet(&packet);
+                return;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Do not let the decode threads wait for packets that will never arrive.
+        sync.set_eof(generation);
+        throw;
+    }
+}
+
+void read_thread::seek(int64_t pos, bool backward)
+{
+    // The collected subtitle packets must cover the complete input.
+    if (_ffmpeg->collect_subtitles)
+    {
+        msg::dbg(_url + ": Seeking; not collecting subtitle packets anymore.");
+        stop_collecting_subtitle_packets(false);
+    }
+    // If the keyframe index is complete, seek directly to the byte position of the
+    // last keyframe before the destination of the first active video stream.
+    // This is fast and accurate even if the input has no usable index of its own.
+    int e = -1;
+    int64_t keyframe_pos = -1;
+    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
+    {
+        if (_ffmpeg->format_ctx->streams[_ffmpeg->video_streams[i]]->discard == AVDISCARD_DEFAULT)
+        {
+            keyframe_pos = _ffmpeg->keyframes.find(i, pos);
+            break;
+        }
+    }
+    if (keyframe_pos >= 0)
+    {
+        e = av_seek_frame(_ffmpeg->format_ctx, -1, keyframe_pos, AVSEEK_FLAG_BYTE);
+        if (e < 0)
+        {
+            msg::dbg(_url + ": Seeking to byte position " + str::from(keyframe_pos) + " failed.");
+        }
+    }
+    if (e < 0)
+    {
+        e = av_seek_frame(_ffmpeg->format_ctx, -1, pos * AV_TIME_BASE / 1000000,
+                backward ? AVSEEK_FLAG_BACKWARD : 0);
+    }
+    if (e < 0)
+    {
+        msg::err(_("%s: Seeking failed."), _url.c_str());
+    }
+}
+
+void read_thread::collect_subtitle_packet(int subtitle_stream, const AVPacket &packet)
+{
+    if (packet.pts == static_cast<int64_t>(AV_NOPTS_VALUE))
+    {
+        return;
+    }
+    // The packet data may not belong to the packet, so it is copied. The padding
+    // that av_new_packet() adds is zeroed, which terminates text subtitles.
+    AVPacket copy;
+    if (av_new_packet(&copy, packet.size) != 0)
+    {
+        msg::dbg(_url + ": Cannot collect subtitle packet.");
+        stop_collecting_subtitle_packets(false);
+        return;
+    }
+    std::memcpy(copy.data, packet.data, packet.size);
+    copy.pts = packet.pts;
+    copy.dts = packet.dts;
+    copy.stream_index = packet.stream_index;
+    copy.flags = packet.flags;
+    copy.duration = packet.duration;
+    copy.pos = packet.pos;
+    copy.convergence_duration = packet.convergence_duration;
+    _ffmpeg->subtitle_collected_packets[subtitle_stream].push_back(copy);
+}
+
+void read_thread::stop_collecting_subtitle_packets(bool complete)
+{
+    for (size_t i = 0; i < _ffmpeg->subtitle_streams.size(); i++)
+    {
+        std::vector<AVPacket> &packets = _ffmpeg->subtitle_collected_packets[i];
+        if (complete && collects_subtitle_packets(_ffmpeg, i))
+        {
+            msg::dbg(_url + ": subtitle stream " + str::from(i) + ": "
+                    + str::from(packets.size()) + " packets collected.");
+            _ffmpeg->subtitle_indexes[i].put_packets(packets);
+        }
+        for (size_t j = 0; j < packets.size(); j++)
+        {
+            av_free_packet(&(packets[j]));
+        }
+        packets.clear();
+        if (!_ffmpeg->subtitle_streams_active[i])
+        {
+            _ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[i]]->discard = AVDISCARD_ALL;
+        }
+    }
+    _ffmpeg->collect_subtitles = false;
+}
+
+void read_thread::reset()
+{
+    exception() = exc();
+}
+
+void keyframe_index::set(const std::vector<std::vector<int64_t> > &timestamps,
+        const std::vector<std::vector<int64_t> > &positions)
+{
+    _mutex.lock();
+    _timestamps = timestamps;
+    _positions = positions;
+    _complete = true;
+    _mutex.unlock();
+}
+
+int64_t keyframe_index::find(int video_stream, int64_t timestamp)
+{
+    int64_t pos = -1;
+    _mutex.lock();
+    if (_complete && !_timestamps[video_stream].empty())
+    {
+        const std::vector<int64_t> &ts = _timestamps[video_stream];
+        size_t i = std::upper_bound(ts.begin(), ts.end(), timestamp) - ts.begin();
+        pos = _positions[video_stream][i > 0 ? i - 1 : 0];
+    }
+    _mutex.unlock();
+    return pos;
+}
+
+bool keyframe_index::load(const std::string &filename, const std::string &key, size_t video_streams)
+{
+    std::vector<std::vector<int64_t> > timestamps;
+    std::vector<std::vector<int64_t> > positions;
+    try
+    {
+        std::ifstream ifs(filename.c_str(), std::ios::in | std::ios::binary);
+        if (!ifs.good())
+        {
+            return false;
+        }
+        std::string file_key;
+        s11n::load(ifs, file_key);
+        if (!ifs.good() || file_key != key)
+        {
+            return false;
+        }
+        timestamps.resize(video_streams);
+        positions.resize(video_streams);
+        for (size_t i = 0; i < video_streams; i++)
+        {
+            s11n::load(ifs, timestamps[i]);
+            s11n::load(ifs, positions[i]);
+            if (!ifs.good() || timestamps[i].size() != positions[i].size())
+            {
+                return false;
+            }
+        }
+    }
+    catch (...)
+    {
+        // A damaged cache file can make s11n try to allocate insane amounts of memory.
+        return false;
+    }
+    set(timestamps, positions);
+    return true;
+}
+
+bool keyframe_index::save(const std::string &filename, const std::string &key)
+{
+    std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    _mutex.lock();
+    s11n::save(ofs, key);
+    for (size_t i = 0; i < _timestamps.size(); i++)
+    {
+        s11n::save(ofs, _timestamps[i]);
+        s11n::save(ofs, _positions[i]);
+    }
+    _mutex.unlock();
+    ofs.flush();
+    return ofs.good();
+}
+
+stream_info::stream_info() :
+    _codec_type(0), _codec_id(0), _codec_tag(0), _time_base_num(0), _time_base_den(0),
+    _r_frame_rate_num(0), _r_frame_rate_den(0), _avg_frame_rate_num(0), _avg_frame_rate_den(0),
+    _sample_aspect_ratio_num(0), _sample_aspect_ratio_den(0), _start_time(0), _duration(0), _nb_frames(0),
+    _width(0), _height(0), _pix_fmt(0), _has_b_frames(0),
+    _codec_sample_aspect_ratio_num(0), _codec_sample_aspect_ratio_den(0),
+    _colorspace(0), _color_range(0), _chroma_sample_location(0),
+    _sample_rate(0), _channels(0), _sample_fmt(0), _frame_size(0), _channel_layout(0), _bit_rate(0),
+    _codec_time_base_num(0), _codec_time_base_den(0), _ticks_per_frame(0)
+{
+}
+
+void stream_info::get(const AVStream *stream)
+{
+    const AVCodecContext *codec_ctx = stream->codec;
+    _codec_type = codec_ctx->codec_type;
+    _codec_id = codec_ctx->codec_id;
+    _codec_tag = codec_ctx->codec_tag;
+    _time_base_num = stream->time_base.num;
+    _time_base_den = stream->time_base.den;
+    _r_frame_rate_num = stream->r_frame_rate.num;
+    _r_frame_rate_den = stream->r_frame_rate.den;
+    _avg_frame_rate_num = stream->avg_frame_rate.num;
+    _avg_frame_rate_den = stream->avg_frame_rate.den;
+    _sample_aspect_ratio_num = stream->sample_aspect_ratio.num;
+    _sample_aspect_ratio_den = stream->sample_aspect_ratio.den;
+    _start_time = stream->start_time;
+    _duration = stream->duration;
+    _nb_frames = stream->nb_frames;
+    _width = codec_ctx->width;
+    _height = codec_ctx->height;
+    _pix_fmt = codec_ctx->pix_fmt;
+    _has_b_frames = codec_ctx->has_b_frames;
+    _codec_sample_aspect_ratio_num = codec_ctx->sample_aspect_ratio.num;
+    _codec_sample_aspect_ratio_den = codec_ctx->sample_aspect_ratio.den;
+    _colorspace = codec_ctx->colorspace;
+    _color_range = codec_ctx->color_range;
+    _chroma_sample_location = codec_ctx->chroma_sample_location;
+    _sample_rate = codec_ctx->sample_rate;
+    _channels = codec_ctx->channels;
+    _sample_fmt = codec_ctx->sample_fmt;
+    _frame_size = codec_ctx->frame_size;
+    _channel_layout = codec_ctx->channel_layout;
+    _bit_rate = codec_ctx->bit_rate;
+    _codec_time_base_num = codec_ctx->time_base.num;
+    _codec_time_base_den = codec_ctx->time_base.den;
+    _ticks_per_frame = codec_ctx->ticks_per_frame;
+}
+
+bool stream_info::matches(const AVStream *stream) const
+{
+    return (_codec_type == stream->codec->codec_type
+            && _codec_id == stream->codec->codec_id
+            && _codec_tag == stream->codec->codec_tag
+            && _time_base_num == stream->time_base.num
+            && _time_base_den == stream->time_base.den);
+}
+
+void stream_info::set(AVStream *stream) const
+{
+    AVCodecContext *codec_ctx = stream->codec;
+    stream->r_frame_rate.num = _r_frame_rate_num;
+    stream->r_frame_rate.den = _r_frame_rate_den;
+    stream->avg_frame_rate.num = _avg_frame_rate_num;
+    stream->avg_frame_rate.den = _avg_frame_rate_den;
+    stream->sample_aspect_ratio.num = _sample_aspect_ratio_num;
+    stream->sample_aspect_ratio.den = _sample_aspect_ratio_den;
+    stream->start_time = _start_time;
+    stream->duration = _duration;
+    stream->nb_frames = _nb_frames;
+    codec_ctx->width = _width;
+    codec_ctx->height = _height;
+    codec_ctx->pix_fmt = static_cast<enum PixelFormat>(_pix_fmt);
+    codec_ctx->has_b_frames = _has_b_frames;
+    codec_ctx->sample_aspect_ratio.num = _codec_sample_aspect_ratio_num;
+    codec_ctx->sample_aspect_ratio.den = _codec_sample_aspect_ratio_den;
+    codec_ctx->colorspace = static_cast<enum AVColorSpace>(_colorspace);
+    codec_ctx->color_range = static_cast<enum AVColorRange>(_color_range);
+    codec_ctx->chroma_sample_location = static_cast<enum AVChromaLocation>(_chroma_sample_location);
+    codec_ctx->sample_rate = _sample_rate;
+    codec_ctx->channels = _channels;
+    codec_ctx->sample_fmt = static_cast<enum AVSampleFormat>(_sample_fmt);
+    codec_ctx->frame_size = _frame_size;
+    codec_ctx->channel_layout = _channel_layout;
+    codec_ctx->bit_rate = _bit_rate;
+    codec_ctx->time_base.num = _codec_time_base_num;
+    codec_ctx->time_base.den = _codec_time_base_den;
+    codec_ctx->ticks_per_frame = _ticks_per_frame;
+}
+
+void stream_info::save(std::ostream &os) const
+{
+    s11n::save(os, _codec_type);
+    s11n::save(os, _codec_id);
+    s11n::save(os, _codec_tag);
+    s11n::save(os, _time_base_num);
+    s11n::save(os, _time_base_den);
+    s11n::save(os, _r_frame_rate_num);
+    s11n::save(os, _r_frame_rate_den);
+    s11n::save(os, _avg_frame_rate_num);
+    s11n::save(os, _avg_frame_rate_den);
+    s11n::save(os, _sample_aspect_ratio_num);
+    s11n::save(os, _sample_aspect_ratio_den);
+    s11n::save(os, _start_time);
+    s11n::save(os, _duration);
+    s11n::save(os, _nb_frames);
+    s11n::save(os, _width);
+    s11n::save(os, _height);
+    s11n::save(os, _pix_fmt);
+    s11n::save(os, _has_b_frames);
+    s11n::save(os, _codec_sample_aspect_ratio_num);
+    s11n::save(os, _codec_sample_aspect_ratio_den);
+    s11n::save(os, _colorspace);
+    s11n::save(os, _color_range);
+    s11n::save(os, _chroma_sample_location);
+    s11n::save(os, _sample_rate);
+    s11n::save(os, _channels);
+    s11n::save(os, _sample_fmt);
+    s11n::save(os, _frame_size);
+    s11n::save(os, _channel_layout);
+    s11n::save(os, _bit_rate);
+    s11n::save(os, _codec_time_base_num);
+    s11n::save(os, _codec_time_base_den);
+    s11n::save(os, _ticks_per_frame);
+}
+
+void stream_info::load(std::istream &is)
+{
+    s11n::load(is, _codec_type);
+    s11n::load(is, _codec_id);
+    s11n::load(is, _codec_tag);
+    s11n::load(is, _time_base_num);
+    s11n::load(is, _time_base_den);
+    s11n::load(is, _r_frame_rate_num);
+    s11n::load(is, _r_frame_rate_den);
+    s11n::load(is, _avg_frame_rate_num);
+    s11n::load(is, _avg_frame_rate_den);
+    s11n::load(is, _sample_aspect_ratio_num);
+    s11n::load(is, _sample_aspect_ratio_den);
+    s11n::load(is, _start_time);
+    s11n::load(is, _duration);
+    s11n::load(is, _nb_frames);
+    s11n::load(is, _width);
+    s11n::load(is, _height);
+    s11n::load(is, _pix_fmt);
+    s11n::load(is, _has_b_frames);
+    s11n::load(is, _codec_sample_aspect_ratio_num);
+    s11n::load(is, _codec_sample_aspect_ratio_den);
+    s11n::load(is, _colorspace);
+    s11n::load(is, _color_range);
+    s11n::load(is, _chroma_sample_location);
+    s11n::load(is, _sample_rate);
+    s11n::load(is, _channels);
+    s11n::load(is, _sample_fmt);
+    s11n::load(is, _frame_size);
+    s11n::load(is, _channel_layout);
+    s11n::load(is, _bit_rate);
+    s11n::load(is, _codec_time_base_num);
+    s11n::load(is, _codec_time_base_den);
+    s11n::load(is, _ticks_per_frame);
+}
+
+bool stream_info::load(const std::string &filename, const std::string &key, AVFormatContext *format_ctx)
+{
+    std::vector<stream_info> infos;
+    int64_t duration, start_time;
+    int bit_rate;
+    try
+    {
+        std::ifstream ifs(filename.c_str(), std::ios::in | std::ios::binary);
+        if (!ifs.good())
+        {
+            return false;
+        }
+        std::string file_key;
+        s11n::load(ifs, file_key);
+        if (!ifs.good() || file_key != key)
+        {
+            return false;
+        }
+        s11n::load(ifs, infos);
+        s11n::load(ifs, duration);
+        s11n::load(ifs, start_time);
+        s11n::load(ifs, bit_rate);
+        if (!ifs.good())
+        {
+            return false;
+        }
+    }
+    catch (...)
+    {
+        // A damaged cache file can make s11n try to allocate insane amounts of memory.
+        return false;
+    }
+    if (infos.size() != format_ctx->nb_streams)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < infos.size(); i++)
+    {
+        if (!infos[i].matches(format_ctx->streams[i]))
+        {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < infos.size(); i++)
+    {
+        infos[i].set(format_ctx->streams[i]);
+    }
+    format_ctx->duration = duration;
+    format_ctx->start_time = start_time;
+    format_ctx->bit_rate = bit_rate;
+    return true;
+}
+
+bool stream_info::save(const std::string &filename, const std::string &key, const AVFormatContext *format_ctx)
+{
+    std::vector<stream_info> infos(format_ctx->nb_streams);
+    for (size_t i = 0; i < infos.size(); i++)
+    {
+        infos[i].get(format_ctx->streams[i]);
+    }
+    std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    s11n::save(ofs, key);
+    s11n::save(ofs, infos);
+    s11n::save(ofs, format_ctx->duration);
+    s11n::save(ofs, format_ctx->start_time);
+    s11n::save(ofs, format_ctx->bit_rate);
+    ofs.flush();
+    return ofs.good();
+}
+
+index_thread::index_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg,
+        const std::string &cache_filename, const std::string &cache_key) :
+    _url(url), _ffmpeg(ffmpeg), _cache_filename(cache_filename), _cache_key(cache_key), _abort(false)
+{
+}
+
+void index_thread::run()
+{
+    AVFormatContext *format_ctx = NULL;
+    if (avformat_open_input(&format_ctx, _url.c_str(), NULL, NULL) != 0)
+    {
+        msg::dbg(_url + ": Cannot open input for keyframe indexing.");
+        return;
+    }
+    // The streams must be the same as in the main AVFormatContext.
+    bool ok = (av_find_stream_info(format_ctx) >= 0);
+    for (unsigned int i = 0; ok && i < format_ctx->nb_streams; i++)
+    {
+        format_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+    for (size_t i = 0; ok && i < _ffmpeg->video_streams.size(); i++)
+    {
+        ok = (static_cast<unsigned int>(_ffmpeg->video_streams[i]) < format_ctx->nb_streams
+                && format_ctx->streams[_ffmpeg->video_streams[i]]->codec->codec_type == AVMEDIA_TYPE_VIDEO);
+        if (ok)
+        {
+            format_ctx->streams[_ffmpeg->video_streams[i]]->discard = AVDISCARD_DEFAULT;
+        }
+    }
+    std::vector<std::vector<int64_t> > timestamps(_ffmpeg->video_streams.size());
+    std::vector<std::vector<int64_t> > positions(_ffmpeg->video_streams.size());
+    while (ok)
+    {
+        _abort_mutex.lock();
+        bool abort = _abort;
+        _abort_mutex.unlock();
+        if (abort)
+        {
+            ok = false;
+            break;
+        }
+        AVPacket packet;
+        int e = av_read_frame(format_ctx, &packet);
+        if (e < 0)
+        {
+            ok = (e == AVERROR_EOF);
+            break;
+        }
+        for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
+        {
+            if (packet.stream_index == _ffmpeg->video_streams[i]
+                    && (packet.flags & AV_PKT_FLAG_KEY)
+                    && packet.pos >= 0
+                    && packet.dts != static_cast<int64_t>(AV_NOPTS_VALUE))
+            {
+                // Use the same time stamps as the video decode thread.
+                AVRational time_base = format_ctx->streams[packet.stream_index]->time_base;
+                int64_t timestamp = packet.dts * 1000000 * time_base.num / time_base.den;
+                // Ignore time stamps that are out of order (e.g. after a wrap around)
+                // to keep the index sorted.
+                if (timestamps[i].empty() || timestamp > timestamps[i].back())
+                {
+                    timestamps[i].push_back(timestamp);
+                    positions[i].push_back(packet.pos);
+                }
+            }
+        }
+        av_free_packet(&packet);
+    }
+    av_close_input_file(format_ctx);
+    if (!ok)
+    {
+        msg::dbg(_url + ": Keyframe indexing stopped.");
+        return;
+    }
+    _ffmpeg->keyframes.set(timestamps, positions);
+    msg::dbg(_url + ": Keyframe index complete: " + str::from(timestamps[0].size())
+            + " keyframes in video stream 0.");
+    if (!_cache_filename.empty() && !_ffmpeg->keyframes.save(_cache_filename, _cache_key))
+    {
+        msg::dbg(_url + ": Cannot write keyframe index to " + _cache_filename + ".");
+        std::remove(_cache_filename.c_str());
+    }
+}
+
+void index_thread::abort()
+{
+    _abort_mutex.lock();
+    _abort = true;
+    _abort_mutex.unlock();
+}
+
+read_ahead_thread::read_ahead_thread(const std::string &url, size_t size) :
+    _url(url), _input(NULL), _avio(NULL), _fd(-1), _file_size(-1), _ring(size),
+    _start(0), _head(0), _size(0), _pos(0), _restart(-1), _error(0), _eof(false), _stop(false)
+{
+}
+
+read_ahead_thread::~read_ahead_thread()
+{
+    if (_avio)
+    {
+        av_free(_avio->buffer);
+        av_free(_avio);
+    }
+    if (_input)
+    {
+        avio_close(_input);
+    }
+#if HAVE_POSIX_FADVISE
+    if (_fd >= 0)
+    {
+        ::close(_fd);
+    }
+#endif
+}
+
+AVIOContext *read_ahead_thread::open()
+{
+    if (avio_open(&_input, _url.c_str(), AVIO_FLAG_READ) < 0)
+    {
+        _input = NULL;
+        return NULL;
+    }
+    _file_size = avio_size(_input);
+    const int buffer_size = 32768;
+    unsigned char *buffer = static_cast<unsigned char *>(av_malloc(buffer_size));
+    if (buffer)
+    {
+        _avio = avio_alloc_context(buffer, buffer_size, 0, this, read_packet, NULL, seek);
+    }
+    if (!_avio)
+    {
+        av_free(buffer);
+        avio_close(_input);
+        _input = NULL;
+        return NULL;
+    }
+    _avio->seekable = _input->seekable;
+#if HAVE_POSIX_FADVISE
+    // The data is read through FFmpeg, but the hints concern the page cache of the file,
+    // so a descriptor of our own suffices.
+    _fd = ::open(_url.c_str(), O_RDONLY);
+#endif
+    return _avio;
+}
+
+void read_ahead_thread::run()
+{
+    const size_t capacity = _ring.size();
+    const size_t keep_behind = capacity / 8;
+    const size_t max_chunk = std::max(std::min(capacity / 8, static_cast<size_t>(1 << 20)), static_cast<size_t>(1));
+#if HAVE_POSIX_FADVISE
+    int64_t hint_end = 0;
+#endif
+    _mutex.lock();
+    for (;;)
+    {
+        // Make room by dropping the data that is too far behind the read position.
+        if (_pos - _start > static_cast<int64_t>(keep_behind))
+        {
+            size_t drop = std::min(static_cast<size_t>(_pos - _start) - keep_behind, _size);
+            _head = (_head + drop) % capacity;
+            _start += drop;
+            _size -= drop;
+        }
+        if (_stop)
+        {
+            break;
+        }
+        if (_restart < 0 && (_eof || _error != 0 || _size == capacity))
+        {
+            _cond.wait(_mutex);
+            continue;
+        }
+        int64_t restart = _restart;
+        _restart = -1;
+        if (restart >= 0)
+        {
+            // The reader has already emptied the ring.
+            _head = 0;
+        }
+        size_t tail = (_head + _size) % capacity;
+        size_t n = std::min(std::min(capacity - _size, capacity - tail), max_chunk);
+        int64_t file_pos = _start + _size;
+        // The reader only accesses the valid part of the ring, so we can fill
+        // the part behind it without holding the lock.
+        _mutex.unlock();
+        int r = 0;
+        if (restart >= 0)
+        {
+            int64_t p = avio_seek(_input, restart, SEEK_SET);
+            if (p < 0)
+            {
+                r = static_cast<int>(p);
+            }
+        }
+#if HAVE_POSIX_FADVISE
+        if (_fd >= 0 && (restart >= 0 || file_pos + static_cast<int64_t>(capacity) > hint_end))
+        {
+            // Ask the operating system to fetch the data for the next two ring fills.
+            hint_end = file_pos + 2 * static_cast<int64_t>(capacity);
+            posix_fadvise(_fd, file_pos, 2 * capacity, POSIX_FADV_WILLNEED);
+        }
+#endif
+        if (r >= 0)
+        {
+            r = avio_read(_input, _ring.ptr<unsigned char>(tail), n);
+        }
+        _mutex.lock();
+        if (_restart >= 0)
+        {
+            // The data is not needed anymore.
+            continue;
+        }
+        if (r > 0)
+        {
+            _size += r;
+        }
+        else if (r == 0 || r == AVERROR_EOF)
+        {
+            _eof = true;
+        }
+        else
+        {
+            _error = r;
+        }
+        _cond.wake_all();
+    }
+    _mutex.unlock();
+}
+
+void read_ahead_thread::stop()
+{
+    _mutex.lock();
+    _stop = true;
+    _cond.wake_all();
+    _mutex.unlock();
+}
+
+int read_ahead_thread::read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    read_ahead_thread *t = static_cast<read_ahead_thread *>(opaque);
+    const size_t capacity = t->_ring.size();
+    int r;
+    t->_mutex.lock();
+    for (;;)
+    {
+        if (t->_pos < t->_start || t->_pos - t->_start > static_cast<int64_t>(t->_size + capacity / 2))
+        {
+            // The data is too far away from the ring; restart the ring at the read position.
+            t->_restart = t->_pos;
+            t->_start = t->_pos;
+            t->_size = 0;
+            t->_eof = false;
+            t->_error = 0;
+            t->_cond.wake_all();
+        }
+        if (t->_pos < t->_start + static_cast<int64_t>(t->_size))
+        {
+            size_t offset = t->_pos - t->_start;
+            size_t index = (t->_head + offset) % capacity;
+            size_t n = std::min(std::min(t->_size - offset, capacity - index), static_cast<size_t>(buf_size));
+            std::memcpy(buf, t->_ring.ptr<uint8_t>(index), n);
+            t->_pos += n;
+            r = n;
+            // The thread might wait for room in the ring.
+            t->_cond.wake_all();
+            break;
+        }
+        else if (t->_error != 0)
+        {
+            r = t->_error;
+            break;
+        }
+        else if (t->_eof)
+        {
+            r = AVERROR_EOF;
+            break;
+        }
+        t->_cond.wait(t->_mutex);
+    }
+    t->_mutex.unlock();
+    return r;
+}
+
+int64_t read_ahead_thread::seek(void *opaque, int64_t offset, int whence)
+{
+    read_ahead_thread *t = static_cast<read_ahead_thread *>(opaque);
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE)
+    {
+        return t->_file_size;
+    }
+    // Only move the read position; the next read restarts the ring if necessary.
+    t->_mutex.lock();
+    int64_t pos = (whence == SEEK_SET ? offset
+            : whence == SEEK_CUR ? t->_pos + offset
+            : whence == SEEK_END && t->_file_size >= 0 ? t->_file_size + offset
+            : -1);
+    if (pos >= 0)
+    {
+        t->_pos = pos;
+    }
+    t->_mutex.unlock();
+    return (pos >= 0 ? pos : AVERROR(EINVAL));
+}
+
+video_decode_thread::video_decode_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg, int video_stream) :
+    _url(url), _ffmpeg(ffmpeg), _video_stream(video_stream), _frame(), _generation(0),
+    _seek_target(std::numeric_limits<int64_t>::min()), _seek_deadline(0),
+    _lowres(0), _threads(ffmpeg->video_thread_requests[video_stream]), _draining(false)
+{
+    av_init_packet(&_held_packet);
+    _held_packet.data = NULL;
+    _held_packet.size = 0;
+}
+
+int64_t video_decode_thread::handle_timestamp(int64_t timestamp)
+{
+    // The position is updated when the frame leaves the frame queue; see
+    // media_object::finish_video_frame_read().
+    return timestamp_helper(_ffmpeg->video_last_timestamps[_video_stream], timestamp);
+}
+
+video_convert_thread::video_convert_thread(struct SwsContext *ctx, int y, int h, int chroma_shift) :
+    _ctx(ctx), _y(y), _h(h), _chroma_shift(chroma_shift)
+{
+    for (int p = 0; p < 4; p++)
+    {
+        _src[p] = NULL;
+        _src_linesize[p] = 0;
+        _dst[p] = NULL;
+        _dst_linesize[p] = 0;
+    }
+}
+
+video_convert_thread::video_convert_thread(const video_yuv_converter &yuv_converter, int y, int h) :
+    _ctx(NULL), _yuv_converter(yuv_converter), _y(y), _h(h), _chroma_shift(0)
+{
+    for (int p = 0; p < 4; p++)
+    {
+        _src[p] = NULL;
+        _src_linesize[p] = 0;
+        _dst[p] = NULL;
+        _dst_linesize[p] = 0;
+    }
+}
+
+void video_convert_thread::set_frame(const AVFrame *src, const AVPicture *dst)
+{
+    for (int p = 0; p < 4; p++)
+    {
+        _src[p] = src->data[p];
+        _src_linesize[p] = src->linesize[p];
+        _dst[p] = dst->data[p];
+        _dst_linesize[p] = dst->linesize[p];
+    }
+}
+
+void video_convert_thread::run()
+{
+    if (!_ctx)
+    {
+        // The YUV converter reads the chroma rows around the band itself.
+        _yuv_converter.convert(_src, _src_linesize, _y, _h, _dst[0], _dst_linesize[0]);
+        return;
+    }
+    // Apply the band offsets. Planes 1 and 2 are the chroma planes of planar
+    // formats. Packed formats only use plane 0.
+    const uint8_t *src[4];
+    uint8_t *dst[4];
+    for (int p = 0; p < 4; p++)
+    {
+        int y = (p == 1 || p == 2 ? _y >> _chroma_shift : _y);
+        src[p] = _src[p] ? _src[p] + y * _src_linesize[p] : NULL;
+        dst[p] = _dst[p] ? _dst[p] + _y * _dst_linesize[p] : NULL;
+    }
+    sws_scale(_ctx, src, _src_linesize, 0, _h, dst, _dst_linesize);
+    // TODO: Handle sws_scale errors. How?
+}
+
+int64_t video_decode_thread::packet_timestamp(const AVPacket &packet)
+{
+    if (packet.dts == static_cast<int64_t>(AV_NOPTS_VALUE))
+    {
+        return std::numeric_limits<int64_t>::min();
+    }
+    AVRational time_base = _ffmpeg->format_ctx->streams[_ffmpeg->video_streams[_video_stream]]->time_base;
+    return packet.dts * 1000000 * time_base.num / time_base.den;
+}
+
+int video_decode_thread::codec_lowres(int lowres)
+{
+    // Let the codec do as much of the reduction as it supports; the rest is
+    // done by decimation.
+    return std::min(lowres, static_cast<int>(_ffmpeg->video_codecs[_video_stream]->max_lowres));
+}
+
+void video_decode_thread::reconfigure(int lowres, int threads)
+{
+    AVCodecContext *codec_ctx = _ffmpeg->video_codec_ctxs[_video_stream];
+    AVCodec *codec = _ffmpeg->video_codecs[_video_stream];
+    int l = codec_lowres(lowres);
+    if (l != codec_ctx->lowres || threads != _threads)
+    {
+        avcodec_close(codec_ctx);
+        codec_ctx->lowres = l;
+        codec_ctx->thread_count = threads;
+        int e = avcodec_open(codec_ctx, codec);
+        if (e < 0 && l > 0)
+        {
+            msg::wrn(_("%s video stream %d: Cannot reopen video codec with lowres %d: %s"),
+                    _url.c_str(), _video_stream + 1, l, my_av_strerror(e).c_str());
+            codec_ctx->lowres = 0;
+            e = avcodec_open(codec_ctx, codec);
+        }
+        if (e < 0)
+        {
+            throw exc(str::asprintf(_("%s video stream %d: Cannot reopen video codec: %s"),
+                        _url.c_str(), _video_stream + 1, my_av_strerror(e).c_str()));
+        }
+        if (threads != _threads)
+        {
+            msg::inf(_("%s video stream %d: Decoding with %s."), _url.c_str(), _video_stream + 1,
+                    video_threading_info(codec_ctx).c_str());
+        }
+    }
+    _lowres = lowres;
+    _threads = threads;
+    msg::dbg(_url + ": video stream " + str::from(_video_stream) + ": decoding at 1/"
+            + str::from(1 << _lowres) + " size with codec lowres " + str::from(codec_ctx->lowres));
+}
+
+void video_decode_thread::decode()
+{
+    AVCodecContext *codec_ctx = _ffmpeg->video_codec_ctxs[_video_stream];
+    AVFrame *src_frame = _ffmpeg->video_frames[_video_stream];
+    AVPacket &packet = _ffmpeg->video_packets[_video_stream];
+    int64_t frame_duration = video_frame_duration(_ffmpeg->format_ctx->streams[_ffmpeg->video_streams[_video_stream]]);
+    for (;;)
+    {
+        int frame_finished = 0;
+        do
+        {
+            av_free_packet(&packet);
+            if (_draining)
+            {
+                // Get the frames that the decoder still holds, then change the
+                // codec lowres setting and continue with the held keyframe.
+                av_init_packet(&packet);
+                packet.data = NULL;
+                packet.size = 0;
+                avcodec_decode_video2(codec_ctx, src_frame, &frame_finished, &packet);
+                if (frame_finished)
+                {
+                    continue;
+                }
+                _draining = false;
+                _ffmpeg->video_decode_mutex.lock();
+                int lowres = _ffmpeg->video_lowres_requests[_video_stream];
+                int threads = _ffmpeg->video_thread_requests[_video_stream];
+                _ffmpeg->video_decode_mutex.unlock();
+                reconfigure(lowres, threads);
+                packet = _held_packet;
+                av_init_packet(&_held_packet);
+                _held_packet.data = NULL;
+                _held_packet.size = 0;
+            }
+            else
+            {
+                int generation;
+                bool popped = _ffmpeg->video_packet_queues[_video_stream].pop(packet, &generation);
+                if (generation != _generation)
+                {
+                    // There was a seek. Forget everything about the previous generation.
+                    avcodec_flush_buffers(codec_ctx);
+                    codec_ctx->skip_frame = AVDISCARD_DEFAULT;
+                    codec_ctx->skip_loop_filter = AVDISCARD_DEFAULT;
+                    _ffmpeg->video_last_timestamps[_video_stream] = std::numeric_limits<int64_t>::min();
+                    _ffmpeg->queue_sync.get_seek_target(generation, &_seek_target, &_seek_deadline);
+                    _generation = generation;
+                }
+                if (!popped)
+                {
+                    // End of input, or the queues were aborted. Throw a read error, if any.
+                    _ffmpeg->queue_sync.throw_read_error();
+                    _frame = video_frame();
+                    return;
+                }
+                if (packet.flags & AV_PKT_FLAG_KEY)
+                {
+                    // The frame size and the threads can only change at keyframes.
+                    // If the codec has to be reopened for this, the frames that it
+                    // still holds are drained first.
+                    _ffmpeg->video_decode_mutex.lock();
+                    int lowres = _ffmpeg->video_lowres_requests[_video_stream];
+                    int threads = _ffmpeg->video_thread_requests[_video_stream];
+                    _ffmpeg->video_decode_mutex.unlock();
+                    if ((lowres != _lowres && codec_lowres(lowres) != codec_ctx->lowres)
+                            || threads != _threads)
+                    {
+                        _held_packet = packet;
+                        av_init_packet(&packet);
+                        packet.data = NULL;
+                        packet.size = 0;
+                        _draining = true;
+                        continue;
+                    }
+                    else if (lowres != _lowres)
+                    {
+                        reconfigure(lowres, threads);
                     }
-                    msg::dbg(_url + ": audio stream " + str::from(_audio_stream) + ": need to wait for packets...");
-                    _ffmpeg->reader->start();
-                    _ffmpeg->reader->finish();
                 }
             }
-            while (empty);
-            _ffmpeg->audio_packet_queue_mutexes[_audio_stream].lock();
-            packet = _ffmpeg->audio_packet_queues[_audio_stream].front();
-            _ffmpeg->audio_packet_queues[_audio_stream].pop_front();
-            _ffmpeg->audio_packet_queue_mutexes[_audio_stream].unlock();
-            _ffmpeg->reader->start();   // Refill the packet queue
-            if (timestamp == std::numeric_limits<int64_t>::min() && packet.dts != static_cast<int64_t>(AV_NOPTS_VALUE))
+            if (_seek_target != std::numeric_limits<int64_t>::min())
+            {
+                // Frames that are far enough before the seek target that they cannot
+                // be output late because of frame reordering are only decoded if other
+                // frames need them as references.
+                int64_t timestamp = packet_timestamp(packet);
+                bool far = (timestamp != std::numeric_limits<int64_t>::min()
+                        && timestamp < _seek_target - (codec_ctx->has_b_frames + 1) * frame_duration);
+                codec_ctx->skip_frame = (far ? AVDISCARD_NONREF : AVDISCARD_DEFAULT);
+                codec_ctx->skip_loop_filter = (far ? AVDISCARD_NONREF : AVDISCARD_DEFAULT);
+            }
+            else
+            {
+                // Skip work while the video output cannot keep up; see
+                // media_object::report_video_lateness().
+                _ffmpeg->video_decode_mutex.lock();
+                int skip_level = _ffmpeg->video_skip_levels[_video_stream];
+                _ffmpeg->video_decode_mutex.unlock();
+                codec_ctx->skip_loop_filter = (skip_level >= 1 ? AVDISCARD_ALL : AVDISCARD_DEFAULT);
+                codec_ctx->skip_frame = (skip_level >= 3 ? AVDISCARD_NONKEY
+                        : skip_level >= 2 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT);
+            }
+            avcodec_decode_video2(codec_ctx, src_frame, &frame_finished, &packet);
+        }
+        while (!frame_finished);
+        if (_seek_target == std::numeric_limits<int64_t>::min())
+        {
+            break;
+        }
+        // After an exact seek, discard frames until the one that is closest to the
+        // seek target, unless this takes longer than allowed.
+        int64_t timestamp = packet_timestamp(packet);
+        if (timestamp == std::numeric_limits<int64_t>::min()
+                || timestamp >= _seek_target - frame_duration / 2
+                || timer::get_microseconds(timer::monotonic) >= _seek_deadline)
+        {
+            if (timestamp != std::numeric_limits<int64_t>::min()
+                    && timestamp < _seek_target - frame_duration / 2)
+            {
+                msg::dbg(_url + ": video stream " + str::from(_video_stream)
+                        + ": exact seek gave up " + str::from((_seek_target - timestamp) / 1e6f)
+                        + " seconds before the target");
+            }
+            codec_ctx->skip_frame = AVDISCARD_DEFAULT;
+            codec_ctx->skip_loop_filter = AVDISCARD_DEFAULT;
+            _seek_target = std::numeric_limits<int64_t>::min();
+            break;
+        }
+    }
+
+    _frame = _ffmpeg->video_frame_templates[_video_stream];
+    AVPicture dst_picture;
+    // Reduce the frame size by decimation if the codec cannot do all of it.
+    int decimation = 0;
+    int hshift, vshift, sample_size;
+    if (_lowres > codec_ctx->lowres && planar_yuv_layout(codec_ctx->pix_fmt, &hshift, &vshift, &sample_size))
+    {
+        decimation = _lowres - codec_ctx->lowres;
+    }
+    if (codec_ctx->lowres + decimation > 0)
+    {
+        _frame.raw_width = -((-_frame.raw_width) >> (codec_ctx->lowres + decimation));
+        _frame.raw_height = -((-_frame.raw_height) >> (codec_ctx->lowres + decimation));
+        _frame.set_view_dimensions();
+    }
+    if (_frame.layout == video_frame::bgra32)
+    {
+        _frame.buffer[0] = _ffmpeg->video_out_buffer_pools[_video_stream].get(
+                avpicture_get_size(PIX_FMT_BGRA, codec_ctx->width, codec_ctx->height));
+        avpicture_fill(&dst_picture, static_cast<uint8_t *>(_frame.buffer[0].ptr()),
+                PIX_FMT_BGRA, codec_ctx->width, codec_ctx->height);
+        std::vector<video_convert_thread> &convert_threads = _ffmpeg->video_convert_threads[_video_stream];
+        for (size_t b = 0; b < convert_threads.size(); b++)
+        {
+            convert_threads[b].set_frame(src_frame, &dst_picture);
+        }
+        for (size_t b = 1; b < convert_threads.size(); b++)
+        {
+            convert_threads[b].start();
+        }
+        convert_threads[0].run();
+        for (size_t b = 1; b < convert_threads.size(); b++)
+        {
+            convert_threads[b].finish();
+        }
+        _frame.data[0][0] = dst_picture.data[0];
+        _frame.line_size[0][0] = dst_picture.linesize[0];
+    }
+    else if (decimation > 0)
+    {
+        int w = -((-codec_ctx->width) >> decimation);
+        int h = -((-codec_ctx->height) >> decimation);
+        size_t offset[3];
+        size_t linesize[3];
+        size_t size = 0;
+        for (int p = 0; p < 3; p++)
+        {
+            int pw = (p == 0 ? w : -((-w) >> hshift));
+            int ph = (p == 0 ? h : -((-h) >> vshift));
+            linesize[p] = (pw * sample_size + frame_buffer::alignment - 1) / frame_buffer::alignment * frame_buffer::alignment;
+            offset[p] = size;
+            size += linesize[p] * ph;
+        }
+        _frame.buffer[0] = _ffmpeg->video_out_buffer_pools[_video_stream].get(size);
+        for (int p = 0; p < 3; p++)
+        {
+            int pw = (p == 0 ? codec_ctx->width : -((-codec_ctx->width) >> hshift));
+            int ph = (p == 0 ? codec_ctx->height : -((-codec_ctx->height) >> vshift));
+            _frame.data[0][p] = static_cast<uint8_t *>(_frame.buffer[0].ptr()) + offset[p];
+            _frame.line_size[0][p] = linesize[p];
+            if (sample_size == 1)
+            {
+                decimate_plane<uint8_t>(src_frame->data[p], src_frame->linesize[p], pw, ph,
+                        static_cast<uint8_t *>(_frame.data[0][p]), linesize[p], decimation);
+            }
+            else
+            {
+                decimate_plane<uint16_t>(src_frame->data[p], src_frame->linesize[p], pw, ph,
+                        static_cast<uint8_t *>(_frame.data[0][p]), linesize[p], decimation);
+            }
+        }
+    }
+    else if (src_frame->type == FF_BUFFER_TYPE_USER)
+    {
+        // The frame was decoded directly into one of our buffers; see video_get_buffer().
+        // The decoder never writes to it again, so the frame can simply share it.
+        _frame.buffer[0] = *static_cast<frame_buffer *>(src_frame->opaque);
+        for (int p = 0; p < 3; p++)
+        {
+            _frame.data[0][p] = src_frame->data[p];
+            _frame.line_size[0][p] = src_frame->linesize[p];
+        }
+    }
+    else
+    {
+        // The decoder reuses its own buffers, so we need to copy the frame data into a
+        // buffer that is owned by the frame.
+        _frame.buffer[0] = _ffmpeg->video_out_buffer_pools[_video_stream].get(
+                avpicture_get_size(codec_ctx->pix_fmt, codec_ctx->width, codec_ctx->height));
+        avpicture_fill(&dst_picture, static_cast<uint8_t *>(_frame.buffer[0].ptr()),
+                codec_ctx->pix_fmt, codec_ctx->width, codec_ctx->height);
+        av_picture_copy(&dst_picture, reinterpret_cast<AVPicture *>(src_frame),
+                codec_ctx->pix_fmt, codec_ctx->width, codec_ctx->height);
+        for (int p = 0; p < 3; p++)
+        {
+            _frame.data[0][p] = dst_picture.data[p];
+            _frame.line_size[0][p] = dst_picture.linesize[p];
+        }
+    }
+
+    int64_t timestamp = packet_timestamp(packet);
+    if (timestamp != std::numeric_limits<int64_t>::min())
+    {
+        _frame.presentation_time = handle_timestamp(timestamp);
+    }
+    else if (_draining && _ffmpeg->video_last_timestamps[_video_stream] != std::numeric_limits<int64_t>::min())
+    {
+        // Frames drained from the decoder follow the previous frame.
+        _frame.presentation_time = handle_timestamp(_ffmpeg->video_last_timestamps[_video_stream] + frame_duration);
+    }
+    else if (_ffmpeg->video_last_timestamps[_video_stream] != std::numeric_limits<int64_t>::min())
+    {
+        msg::dbg(_url + ": video stream " + str::from(_video_stream)
+                + ": no timestamp available, using a questionable guess");
+        _frame.presentation_time = _ffmpeg->video_last_timestamps[_video_stream];
+    }
+    else
+    {
+        msg::dbg(_url + ": video stream " + str::from(_video_stream)
+                + ": no timestamp available, using a bad guess");
+        _frame.presentation_time = _ffmpeg->pos;
+    }
+}
+
+void video_decode_thread::run()
+{
+    video_frame_queue &queue = _ffmpeg->video_frame_queues[_video_stream];
+    try
+    {
+        // Decode frames until the queues are aborted. An invalid frame signals the
+        // end of input to the reader of the queue; after that, there is nothing to
+        // do until the next seek.
+        for (;;)
+        {
+            decode();
+            if (!queue.push(_frame, _generation))
+            {
+                break;
+            }
+            if (!_frame.is_valid() && !_ffmpeg->queue_sync.wait_for_seek(_generation))
+            {
+                break;
+            }
+        }
+    }
+    catch (...)
+    {
+        queue.close();
+        _frame = video_frame();
+        av_free_packet(&_held_packet);
+        _draining = false;
+        throw;
+    }
+    queue.close();
+    _frame = video_frame();
+    av_free_packet(&_held_packet);
+    _draining = false;
+}
+
+void media_object::start_video_frame_read(int video_stream)
+{
+    assert(video_stream >= 0);
+    assert(video_stream < video_streams());
+    // The decode thread keeps running ahead once it is started.
+    if (!_ffmpeg->video_decode_threads[video_stream].is_running())
+    {
+        _ffmpeg->video_frame_queues[video_stream].reopen();
+        _ffmpeg->video_decode_threads[video_stream].start();
+    }
+}
+
+video_frame media_object::finish_video_frame_read(int video_stream)
+{
+    assert(video_stream >= 0);
+    assert(video_stream < video_streams());
+    video_frame frame;
+    if (!_ffmpeg->video_frame_queues[video_stream].pop(frame))
+    {
+        // The decode thread stopped. Rethrow its error, if any.
+        _ffmpeg->video_decode_threads[video_stream].finish();
+    }
+    else if (frame.is_valid()
+            && (!_ffmpeg->have_active_audio_stream || _ffmpeg->pos == std::numeric_limits<int64_t>::min()))
+    {
+        _ffmpeg->pos = frame.presentation_time;
+    }
+    if (frame.is_valid() && !_ffmpeg->have_read_video_frame)
+    {
+        msg::inf(_("%s: First video frame after %g ms."), _url.c_str(),
+                (timer::get_microseconds(timer::monotonic) - _ffmpeg->open_time) / 1e3f);
+        _ffmpeg->have_read_video_frame = true;
+    }
+    return frame;
+}
+
+int media_object::video_frames_ahead(int video_stream)
+{
+    assert(video_stream >= 0);
+    assert(video_stream < video_streams());
+    return _ffmpeg->video_frame_queues[video_stream].size();
+}
+
+void media_object::report_video_lateness(int video_stream, int64_t lateness)
+{
+    assert(video_stream >= 0);
+    assert(video_stream < video_streams());
+    // The skip levels are:
+    // 0: decode everything
+    // 1: skip the loop filter
+    // 2: additionally skip non-reference frames
+    // 3: only decode keyframes
+    static const int max_level = 3;
+    // After a level change, wait until the frames that were decoded ahead before
+    // the change were shown, and then some more.
+    const int reports_per_change = _ffmpeg->video_decode_ahead + 8;
+    int64_t frame_duration = video_frame_duration(_ffmpeg->format_ctx->streams[_ffmpeg->video_streams[video_stream]]);
+    int64_t &smoothed_lateness = _ffmpeg->video_lateness[video_stream];
+    int &reports = _ffmpeg->video_lateness_reports[video_stream];
+
+    // Smooth the lateness, so that single late frames do not matter.
+    smoothed_lateness += (lateness - smoothed_lateness) / 8;
+    if (reports < reports_per_change)
+    {
+        reports++;
+        return;
+    }
+    _ffmpeg->video_decode_mutex.lock();
+    int &level = _ffmpeg->video_skip_levels[video_stream];
+    int old_level = level;
+    if (smoothed_lateness > frame_duration && level < max_level)
+    {
+        level++;
+    }
+    else if (smoothed_lateness < frame_duration / 4 && level > 0)
+    {
+        level--;
+    }
+    int new_level = level;
+    _ffmpeg->video_decode_mutex.unlock();
+    if (new_level != old_level)
+    {
+        switch (new_level)
+        {
+        case 0:
+            msg::inf(_("%s: video stream %d: decoding all frames again."), _url.c_str(), video_stream);
+            break;
+        case 1:
+            msg::inf(_("%s: video stream %d: skipping the loop filter to keep up."), _url.c_str(), video_stream);
+            break;
+        case 2:
+            msg::inf(_("%s: video stream %d: skipping non-reference frames to keep up."), _url.c_str(), video_stream);
+            break;
+        case 3:
+            msg::inf(_("%s: video stream %d: decoding only keyframes to keep up."), _url.c_str(), video_stream);
+            break;
+        }
+        reports = 0;
+    }
+}
+
+void media_object::set_video_lowres(int video_stream, int lowres)
+{
+    assert(video_stream >= 0);
+    assert(video_stream < video_streams());
+    assert(lowres >= 0 && lowres <= 2);
+    // Frames that are converted to BGRA32 keep their size; the conversion is set
+    // up for the full size.
+    if (_ffmpeg->video_frame_templates[video_stream].layout == video_frame::bgra32)
+    {
+        lowres = 0;
+    }
+    _ffmpeg->video_decode_mutex.lock();
+    _ffmpeg->video_lowres_requests[video_stream] = lowres;
+    _ffmpeg->video_decode_mutex.unlock();
+}
+
+void media_object::set_queue_memory(size_t bytes)
+{
+    packet_memory.set(bytes);
+}
+
+void media_object::set_concurrent_video_streams(int streams)
+{
+    assert(streams >= 1);
+    _ffmpeg->video_decode_mutex.lock();
+    for (int i = 0; i < video_streams(); i++)
+    {
+        _ffmpeg->video_thread_requests[i] = video_decoding_threads(_ffmpeg->threading, streams);
+    }
+    _ffmpeg->video_decode_mutex.unlock();
+}
+
+audio_decode_thread::audio_decode_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg, int audio_stream) :
+    _url(url), _ffmpeg(ffmpeg), _audio_stream(audio_stream), _blob()
+{
+}
+
+int64_t audio_decode_thread::handle_timestamp(int64_t timestamp)
+{
+    int64_t ts = timestamp_helper(_ffmpeg->audio_last_timestamps[_audio_stream], timestamp);
+    _ffmpeg->pos = ts;
+    return ts;
+}
+
+int64_t audio_decode_thread::packet_timestamp(const AVPacket &packet)
+{
+    if (packet.dts == static_cast<int64_t>(AV_NOPTS_VALUE))
+    {
+        return std::numeric_limits<int64_t>::min();
+    }
+    AVRational time_base = _ffmpeg->format_ctx->streams[_ffmpeg->audio_streams[_audio_stream]]->time_base;
+    return packet.dts * 1000000 * time_base.num / time_base.den;
+}
+
+void audio_decode_thread::decode_pending_packet()
+{
+    audio_ring_buffer &audio_buffer = _ffmpeg->audio_buffers[_audio_stream];
+    AVPacket &tmppacket = _ffmpeg->audio_tmppackets[_audio_stream];
+
+    // Decode audio data directly into the decoded audio data buffer. The rest
+    // of the packet stays pending if the buffer runs out of aligned free space.
+    while (tmppacket.size > 0 && audio_buffer.write_space() >= audio_tmpbuf_size
+            && reinterpret_cast<uintptr_t>(audio_buffer.write_ptr()) % 16 == 0)
+    {
+        void *tmpbuf_v = static_cast<void *>(audio_buffer.write_ptr());
+        int tmpbuf_size = audio_tmpbuf_size;
+        int len = avcodec_decode_audio3(_ffmpeg->audio_codec_ctxs[_audio_stream],
+                static_cast<int16_t *>(tmpbuf_v), &tmpbuf_size, &tmppacket);
+        if (len < 0)
+        {
+            tmppacket.size = 0;
+            break;
+        }
+        tmppacket.data += len;
+        tmppacket.size -= len;
+        if (tmpbuf_size <= 0)
+        {
+            continue;
+        }
+        if (_ffmpeg->audio_codec_ctxs[_audio_stream]->sample_fmt == AV_SAMPLE_FMT_S32)
+        {
+            // we need to convert this to AV_SAMPLE_FMT_FLT
+            assert(sizeof(int32_t) == sizeof(float));
+            assert(tmpbuf_size % sizeof(int32_t) == 0);
+            convert_audio_samples_s32_to_f32(static_cast<int32_t *>(tmpbuf_v),
+                    static_cast<float *>(tmpbuf_v), tmpbuf_size / sizeof(int32_t));
+        }
+        audio_buffer.commit(tmpbuf_size);
+    }
+}
+
+int64_t audio_decode_thread::skip_to_seek_target()
+{
+    // After an exact seek, decode and discard audio data up to the sample at the
+    // seek target. Return the time stamp of the remaining decoded data, or the
+    // minimum value if it is unknown.
+    int64_t &seek_target = _ffmpeg->audio_seek_targets[_audio_stream];
+    audio_ring_buffer &audio_buffer = _ffmpeg->audio_buffers[_audio_stream];
+    AVPacket &packet = _ffmpeg->audio_packets[_audio_stream];
+    AVPacket &tmppacket = _ffmpeg->audio_tmppackets[_audio_stream];
+    const audio_blob &blob_template = _ffmpeg->audio_blob_templates[_audio_stream];
+    const int64_t frame_size = blob_template.channels * blob_template.sample_bits() / 8;
+    int64_t timestamp = std::numeric_limits<int64_t>::min();
+    while (seek_target != std::numeric_limits<int64_t>::min())
+    {
+        if (audio_buffer.size() > 0)
+        {
+            int64_t frames = std::max((seek_target - timestamp) * blob_template.rate / 1000000,
+                    static_cast<int64_t>(0));
+            size_t n = std::min(static_cast<size_t>(frames * frame_size), audio_buffer.size());
+            audio_buffer.skip(n);
+            timestamp += static_cast<int64_t>(n) / frame_size * 1000000 / blob_template.rate;
+            if (audio_buffer.size() > 0)
+            {
+                break;
+            }
+        }
+        if (tmppacket.size <= 0)
+        {
+            if (timer::get_microseconds(timer::monotonic) >= _ffmpeg->seek_deadline)
+            {
+                msg::dbg(_url + ": audio stream " + str::from(_audio_stream)
+                        + ": exact seek gave up before the target");
+                timestamp = std::numeric_limits<int64_t>::min();
+                break;
+            }
+            av_free_packet(&packet);
+            if (!_ffmpeg->audio_packet_queues[_audio_stream].pop(packet))
+            {
+                // End of input; run() will notice, too.
+                timestamp = std::numeric_limits<int64_t>::min();
+                break;
+            }
+            tmppacket = packet;
+            timestamp = packet_timestamp(packet);
+            if (timestamp == std::numeric_limits<int64_t>::min())
+            {
+                // Without a time stamp, we do not know which samples to skip.
+                break;
+            }
+        }
+        decode_pending_packet();
+    }
+    seek_target = std::numeric_limits<int64_t>::min();
+    return timestamp;
+}
+
+void audio_decode_thread::run()
+{
+    audio_ring_buffer &audio_buffer = _ffmpeg->audio_buffers[_audio_stream];
+    if (audio_buffer.capacity() == 0)
+    {
+        // The buffer is allocated on first use, and again after release_buffers().
+        audio_buffer.init(audio_buffer_capacity, audio_tmpbuf_size);
+    }
+    AVPacket &packet = _ffmpeg->audio_packets[_audio_stream];
+    AVPacket &tmppacket = _ffmpeg->audio_tmppackets[_audio_stream];
+    size_t size = _ffmpeg->audio_blobs[_audio_stream].size();
+    unsigned char *buffer = static_cast<unsigned char *>(_ffmpeg->audio_blobs[_audio_stream].ptr());
+    int64_t timestamp = skip_to_seek_target();
+    size_t i = 0;
+    while (i < size)
+    {
+        // Use available decoded audio data
+        i += audio_buffer.read(buffer + i, size - i);
+        if (i == size)
+        {
+            break;
+        }
+
+        if (tmppacket.size <= 0)
+        {
+            // Read more audio data
+            av_free_packet(&packet);
+            if (!_ffmpeg->audio_packet_queues[_audio_stream].pop(packet))
             {
-                timestamp = packet.dts * 1000000
-                    * _ffmpeg->format_ctx->streams[_ffmpeg->audio_streams[_audio_stream]]->time_base.num
-                    / _ffmpeg->format_ctx->streams[_ffmpeg->audio_streams[_audio_stream]]->time_base.den;
+                // End of input, or the queues were aborted. Throw a read error, if any.
+                _ffmpeg->queue_sync.throw_read_error();
+                _blob = audio_blob();
+                return;
             }
-
-            // Decode audio data
-            tmppacket = packet;
-            while (tmppacket.size > 0)
+            if (timestamp == std::numeric_limits<int64_t>::min())
             {
-                int tmpbuf_size = audio_tmpbuf_size;
-                int len = avcodec_decode_audio3(_ffmpeg->audio_codec_ctxs[_audio_stream],
-                        reinterpret_cast<int16_t *>(&(_ffmpeg->audio_tmpbufs[_audio_stream][0])), &tmpbuf_size, &tmppacket);
-                if (len < 0)
-                {
-                    tmppacket.size = 0;
-                    break;
-                }
-                tmppacket.data += len;
-                tmppacket.size -= len;
-                if (tmpbuf_size <= 0)
-                {
-                    continue;
-                }
-                // Put it in the decoded audio data buffer
-                if (_ffmpeg->audio_codec_ctxs[_audio_stream]->sample_fmt == AV_SAMPLE_FMT_S32)
-                {
-                    // we need to convert this to AV_SAMPLE_FMT_FLT
-                    assert(sizeof(int32_t) == sizeof(float));
-                    assert(tmpbuf_size % sizeof(int32_t) == 0);
-                    void *tmpbuf_v = static_cast<void *>(&(_ffmpeg->audio_tmpbufs[_audio_stream][0]));
-                    int32_t *tmpbuf_i32 = static_cast<int32_t *>(tmpbuf_v);
-                    float *tmpbuf_flt = static_cast<float *>(tmpbuf_v);
-                    const float posdiv = +static_cast<float>(std::numeric_limits<int32_t>::max());
-                    const float negdiv = -static_cast<float>(std::numeric_limits<int32_t>::min());
-                    for (size_t j = 0; j < tmpbuf_size / sizeof(int32_t); j++)
-                    {
-                        int32_t sample_i32 = tmpbuf_i32[j];
-                        float sample_flt = sample_i32 / (sample_i32 >= 0 ? posdiv : negdiv);
-                        tmpbuf_flt[j] = sample_flt;
-                    }
-                }
-                size_t old_size = _ffmpeg->audio_buffers[_audio_stream].size();
-                _ffmpeg->audio_buffers[_audio_stream].resize(old_size + tmpbuf_size);
-                memcpy(&(_ffmpeg->audio_buffers[_audio_stream][old_size]), _ffmpeg->audio_tmpbufs[_audio_stream], tmpbuf_size);
+                timestamp = packet_timestamp(packet);
             }
-
-            av_free_packet(&packet);
+            tmppacket = packet;
         }
+
+        decode_pending_packet();
     }
     if (timestamp == std::numeric_limits<int64_t>::min())
     {
@@ -1585,8 +4548,106 @@ audio_blob media_object::finish_audio_blob_read(int audio_stream)
     return _ffmpeg->audio_decode_threads[audio_stream].blob();
 }
 
+// Decode a subtitle packet of the given stream and append the resulting boxes.
+// The codec context may differ from the one of the stream.
+static void decode_subtitle_packet(const AVStream *stream, AVCodecContext *codec_ctx,
+        const subtitle_box &box_template, const AVPacket &packet, std::deque<subtitle_box> &boxes)
+{
+    int64_t timestamp = packet.pts * 1000000 * stream->time_base.num / stream->time_base.den;
+    AVSubtitle subtitle;
+    int got_subtitle;
+    AVPacket tmppacket = packet;
+
+    // CODEC_ID_TEXT does not have any decoder; it is just UTF-8 text in the packet data.
+    if (codec_ctx->codec_id == CODEC_ID_TEXT)
+    {
+        int64_t duration = packet.convergence_duration * 1000000
+            * stream->time_base.num / stream->time_base.den;
+
+        // Put it in the subtitle buffer
+        subtitle_box box = box_template;
+        box.presentation_start_time = timestamp;
+        box.presentation_stop_time = timestamp + duration;
+
+        box.format = subtitle_box::text;
+        box.str = reinterpret_cast<const char *>(packet.data);
+
+        boxes.push_back(box);
+
+        tmppacket.size = 0;
+    }
+
+    while (tmppacket.size > 0)
+    {
+        int len = avcodec_decode_subtitle2(codec_ctx, &subtitle, &got_subtitle, &tmppacket);
+        if (len < 0)
+        {
+            tmppacket.size = 0;
+            break;
+        }
+        tmppacket.data += len;
+        tmppacket.size -= len;
+        if (!got_subtitle)
+        {
+            continue;
+        }
+        // Put it in the subtitle buffer
+        subtitle_box box = box_template;
+        box.presentation_start_time = timestamp + subtitle.start_display_time * 1000;
+        box.presentation_stop_time = box.presentation_start_time + subtitle.end_display_time * 1000;
+        for (unsigned int i = 0; i < subtitle.num_rects; i++)
+        {
+            AVSubtitleRect *rect = subtitle.rects[i];
+            switch (rect->type)
+            {
+            case SUBTITLE_BITMAP:
+                box.format = subtitle_box::image;
+                box.images.push_back(subtitle_box::image_t());
+                box.images.back().w = rect->w;
+                box.images.back().h = rect->h;
+                box.images.back().x = rect->x;
+                box.images.back().y = rect->y;
+                box.images.back().palette.resize(4 * rect->nb_colors);
+                std::memcpy(&(box.images.back().palette[0]), rect->pict.data[1],
+                        box.images.back().palette.size());
+                box.images.back().linesize = rect->pict.linesize[0];
+                box.images.back().data.resize(box.images.back().h * box.images.back().linesize);
+                std::memcpy(&(box.images.back().data[0]), rect->pict.data[0],
+                        box.images.back().data.size() * sizeof(uint8_t));
+                break;
+            case SUBTITLE_TEXT:
+                box.format = subtitle_box::text;
+                if (!box.str.empty())
+                {
+                    box.str += '\n';
+                }
+                box.str += rect->text;
+                break;
+            case SUBTITLE_ASS:
+                box.format = subtitle_box::ass;
+                box.style = std::string(reinterpret_cast<const char *>(codec_ctx->subtitle_header),
+                        codec_ctx->subtitle_header_size);
+                if (!box.str.empty())
+                {
+                    box.str += '\n';
+                }
+                box.str += rect->ass;
+                break;
+            case SUBTITLE_NONE:
+                // Should never happen, but make sure we have a valid subtitle box anyway.
+                box.format = subtitle_box::text;
+                box.str = ' ';
+                break;
+            }
+        }
+        boxes.push_back(box);
+        avsubtitle_free(&subtitle);
+    }
+}
+
 subtitle_decode_thread::subtitle_decode_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg, int subtitle_stream) :
-    _url(url), _ffmpeg(ffmpeg), _subtitle_stream(subtitle_stream), _box()
+    _url(url), _ffmpeg(ffmpeg), _subtitle_stream(subtitle_stream),
+    _min_stop_time(std::numeric_limits<int64_t>::min()), _box()
 {
 }
 
@@ -1597,149 +4658,276 @@ int64_t subtitle_decode_thread::handle_timestamp(int64_t timestamp)
     return ts;
 }
 
-void subtitle_decode_thread::run()
+void subtitle_decode_thread::decode_box()
 {
     if (_ffmpeg->subtitle_box_buffers[_subtitle_stream].empty())
     {
         // Read more subtitle data
-        AVPacket packet, tmppacket;
-        bool empty;
-        do
+        AVPacket packet;
+        if (!_ffmpeg->subtitle_packet_queues[_subtitle_stream].pop(packet))
         {
-            _ffmpeg->subtitle_packet_queue_mutexes[_subtitle_stream].lock();
-            empty = _ffmpeg->subtitle_packet_queues[_subtitle_stream].empty();
-            _ffmpeg->subtitle_packet_queue_mutexes[_subtitle_stream].unlock();
-            if (empty)
-            {
-                if (_ffmpeg->reader->eof())
-                {
-                    _box = subtitle_box();
-                    return;
-                }
-                msg::dbg(_url + ": subtitle stream " + str::from(_subtitle_stream) + ": need to wait for packets...");
-                _ffmpeg->reader->start();
-                _ffmpeg->reader->finish();
-            }
+            // End of input, or the queues were aborted. Throw a read error, if any.
+            _ffmpeg->queue_sync.throw_read_error();
+            _box = subtitle_box();
+            return;
         }
-        while (empty);
-        _ffmpeg->subtitle_packet_queue_mutexes[_subtitle_stream].lock();
-        packet = _ffmpeg->subtitle_packet_queues[_subtitle_stream].front();
-        _ffmpeg->subtitle_packet_queues[_subtitle_stream].pop_front();
-        _ffmpeg->subtitle_packet_queue_mutexes[_subtitle_stream].unlock();
-        _ffmpeg->reader->start();   // Refill the packet queue
-
         // Decode subtitle data
-        int64_t timestamp = packet.pts * 1000000
-            * _ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[_subtitle_stream]]->time_base.num
-            / _ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[_subtitle_stream]]->time_base.den;
-        AVSubtitle subtitle;
-        int got_subtitle;
-        tmppacket = packet;
+        decode_subtitle_packet(_ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[_subtitle_stream]],
+                _ffmpeg->subtitle_codec_ctxs[_subtitle_stream],
+                _ffmpeg->subtitle_box_templates[_subtitle_stream],
+                packet, _ffmpeg->subtitle_box_buffers[_subtitle_stream]);
+        av_free_packet(&packet);
+    }
+    if (_ffmpeg->subtitle_box_buffers[_subtitle_stream].empty())
+    {
+        _box = subtitle_box();
+        return;
+    }
+    _box = _ffmpeg->subtitle_box_buffers[_subtitle_stream].front();
+    _ffmpeg->subtitle_box_buffers[_subtitle_stream].pop_front();
+}
+
+void subtitle_decode_thread::index_box()
+{
+    const subtitle_index &index = _ffmpeg->subtitle_indexes[_subtitle_stream];
+    size_t &cursor = _ffmpeg->subtitle_index_cursors[_subtitle_stream];
+    if (cursor == SIZE_MAX)
+    {
+        // After opening, after seeking, or when the index just became ready:
+        // continue after the last box, and forget what the demuxer delivered.
+        cursor = index.find(std::max(_ffmpeg->subtitle_resume_times[_subtitle_stream], _min_stop_time));
+        _ffmpeg->subtitle_box_buffers[_subtitle_stream].clear();
+        _ffmpeg->subtitle_packet_queues[_subtitle_stream].flush();
+    }
+    while (cursor < index.size() && index.box(cursor).presentation_stop_time < _min_stop_time)
+    {
+        cursor++;
+    }
+    if (cursor < index.size())
+    {
+        _box = index.box(cursor);
+        cursor++;
+    }
+    else
+    {
+        _box = subtitle_box();
+    }
+}
+
+void subtitle_decode_thread::decode_collected_packets(std::vector<AVPacket> &packets)
+{
+    // The packets cover the complete stream, so the decoder starts afresh.
+    AVStream *stream = _ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[_subtitle_stream]];
+    AVCodecContext *codec_ctx = _ffmpeg->subtitle_codec_ctxs[_subtitle_stream];
+    if (codec_ctx->codec_id != CODEC_ID_TEXT)
+    {
+        avcodec_flush_buffers(codec_ctx);
+    }
+    std::deque<subtitle_box> boxes;
+    for (size_t i = 0; i < packets.size(); i++)
+    {
+        decode_subtitle_packet(stream, codec_ctx, _ffmpeg->subtitle_box_templates[_subtitle_stream],
+                packets[i], boxes);
+        av_free_packet(&(packets[i]));
+    }
+    packets.clear();
+    if (codec_ctx->codec_id != CODEC_ID_TEXT)
+    {
+        avcodec_flush_buffers(codec_ctx);
+    }
+    _ffmpeg->subtitle_indexes[_subtitle_stream].set(boxes);
+    msg::dbg(_url + ": subtitle stream " + str::from(_subtitle_stream) + ": "
+            + str::from(boxes.size()) + " boxes decoded from collected packets.");
+}
 
-        // CODEC_ID_TEXT does not have any decoder; it is just UTF-8 text in the packet data.
-        if (_ffmpeg->subtitle_codec_ctxs[_subtitle_stream]->codec_id == CODEC_ID_TEXT)
+void subtitle_decode_thread::run()
+{
+    std::vector<AVPacket> packets;
+    if (_ffmpeg->subtitle_indexes[_subtitle_stream].take_packets(packets))
+    {
+        decode_collected_packets(packets);
+    }
+    if (_ffmpeg->subtitle_indexes[_subtitle_stream].ready())
+    {
+        index_box();
+    }
+    else
+    {
+        do
         {
-            int64_t duration = packet.convergence_duration * 1000000
-                * _ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[_subtitle_stream]]->time_base.num
-                / _ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[_subtitle_stream]]->time_base.den;
+            decode_box();
+        }
+        while (_box.is_valid() && _box.presentation_stop_time < _min_stop_time);
+        if (_box.is_valid())
+        {
+            _ffmpeg->subtitle_resume_times[_subtitle_stream] = _box.presentation_stop_time + 1;
+        }
+    }
+}
+
+void subtitle_index::set(const std::deque<subtitle_box> &boxes)
+{
+    std::vector<std::pair<int64_t, size_t> > order(boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++)
+    {
+        order[i] = std::make_pair(boxes[i].presentation_start_time, i);
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<subtitle_box> sorted_boxes(boxes.size());
+    std::vector<int64_t> max_stop_times(boxes.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        sorted_boxes[i] = boxes[order[i].second];
+        max_stop_times[i] = (i == 0 ? sorted_boxes[i].presentation_stop_time
+                : std::max(max_stop_times[i - 1], sorted_boxes[i].presentation_stop_time));
+    }
+    _mutex.lock();
+    _boxes.swap(sorted_boxes);
+    _max_stop_times.swap(max_stop_times);
+    _ready = true;
+    _mutex.unlock();
+}
 
-            // Put it in the subtitle buffer
-            subtitle_box box = _ffmpeg->subtitle_box_templates[_subtitle_stream];
-            box.presentation_start_time = timestamp;
-            box.presentation_stop_time = timestamp + duration;
+void subtitle_index::put_packets(std::vector<AVPacket> &packets)
+{
+    _mutex.lock();
+    _packets.swap(packets);
+    _mutex.unlock();
+}
 
-            box.format = subtitle_box::text;
-            box.str = reinterpret_cast<const char *>(packet.data);
+bool subtitle_index::take_packets(std::vector<AVPacket> &packets)
+{
+    _mutex.lock();
+    _packets.swap(packets);
+    _mutex.unlock();
+    return !packets.empty();
+}
 
-            _ffmpeg->subtitle_box_buffers[_subtitle_stream].push_back(box);
+bool subtitle_index::ready()
+{
+    _mutex.lock();
+    bool r = _ready;
+    _mutex.unlock();
+    return r;
+}
 
-            tmppacket.size = 0;
-        }
+size_t subtitle_index::find(int64_t time) const
+{
+    return std::lower_bound(_max_stop_times.begin(), _max_stop_times.end(), time) - _max_stop_times.begin();
+}
+
+subtitle_preload_thread::subtitle_preload_thread(const std::string &url, struct ffmpeg_stuff *ffmpeg) :
+    _url(url), _ffmpeg(ffmpeg), _abort(false)
+{
+}
 
-        while (tmppacket.size > 0)
+void subtitle_preload_thread::run()
+{
+    AVFormatContext *format_ctx = NULL;
+    if (avformat_open_input(&format_ctx, _url.c_str(), NULL, NULL) != 0)
+    {
+        msg::dbg(_url + ": Cannot open input for subtitle preloading.");
+        return;
+    }
+    // The streams must be the same as in the main AVFormatContext.
+    bool ok = (av_find_stream_info(format_ctx) >= 0);
+    for (unsigned int i = 0; ok && i < format_ctx->nb_streams; i++)
+    {
+        format_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+    std::vector<bool> preload(_ffmpeg->subtitle_streams.size(), false);
+    std::vector<AVCodecContext *> codec_ctxs(_ffmpeg->subtitle_streams.size(), NULL);
+    for (size_t i = 0; ok && i < _ffmpeg->subtitle_streams.size(); i++)
+    {
+        enum CodecID codec_id = _ffmpeg->subtitle_codec_ctxs[i]->codec_id;
+        if (!is_text_subtitle(codec_id))
         {
-            int len = avcodec_decode_subtitle2(_ffmpeg->subtitle_codec_ctxs[_subtitle_stream],
-                    &subtitle, &got_subtitle, &tmppacket);
-            if (len < 0)
-            {
-                tmppacket.size = 0;
-                break;
-            }
-            tmppacket.data += len;
-            tmppacket.size -= len;
-            if (!got_subtitle)
+            continue;
+        }
+        ok = (static_cast<unsigned int>(_ffmpeg->subtitle_streams[i]) < format_ctx->nb_streams
+                && format_ctx->streams[_ffmpeg->subtitle_streams[i]]->codec->codec_id == codec_id);
+        if (!ok)
+        {
+            break;
+        }
+        AVCodecContext *codec_ctx = format_ctx->streams[_ffmpeg->subtitle_streams[i]]->codec;
+        if (codec_id != CODEC_ID_TEXT)
+        {
+            AVCodec *codec = avcodec_find_decoder(codec_id);
+            if (!codec || avcodec_open(codec_ctx, codec) < 0)
             {
                 continue;
             }
-            // Put it in the subtitle buffer
-            subtitle_box box = _ffmpeg->subtitle_box_templates[_subtitle_stream];
-            box.presentation_start_time = timestamp + subtitle.start_display_time * 1000;
-            box.presentation_stop_time = box.presentation_start_time + subtitle.end_display_time * 1000;
-            for (unsigned int i = 0; i < subtitle.num_rects; i++)
+        }
+        format_ctx->streams[_ffmpeg->subtitle_streams[i]]->discard = AVDISCARD_DEFAULT;
+        preload[i] = true;
+        codec_ctxs[i] = codec_ctx;
+    }
+    std::vector<std::deque<subtitle_box> > boxes(_ffmpeg->subtitle_streams.size());
+    while (ok)
+    {
+        _abort_mutex.lock();
+        bool abort = _abort;
+        _abort_mutex.unlock();
+        if (abort)
+        {
+            ok = false;
+            break;
+        }
+        AVPacket packet;
+        int e = av_read_frame(format_ctx, &packet);
+        if (e < 0)
+        {
+            ok = (e == AVERROR_EOF);
+            break;
+        }
+        for (size_t i = 0; i < _ffmpeg->subtitle_streams.size(); i++)
+        {
+            if (preload[i] && packet.stream_index == _ffmpeg->subtitle_streams[i]
+                    && packet.pts != static_cast<int64_t>(AV_NOPTS_VALUE))
             {
-                AVSubtitleRect *rect = subtitle.rects[i];
-                switch (rect->type)
-                {
-                case SUBTITLE_BITMAP:
-                    box.format = subtitle_box::image;
-                    box.images.push_back(subtitle_box::image_t());
-                    box.images.back().w = rect->w;
-                    box.images.back().h = rect->h;
-                    box.images.back().x = rect->x;
-                    box.images.back().y = rect->y;
-                    box.images.back().palette.resize(4 * rect->nb_colors);
-                    std::memcpy(&(box.images.back().palette[0]), rect->pict.data[1],
-                            box.images.back().palette.size());
-                    box.images.back().linesize = rect->pict.linesize[0];
-                    box.images.back().data.resize(box.images.back().h * box.images.back().linesize);
-                    std::memcpy(&(box.images.back().data[0]), rect->pict.data[0],
-                            box.images.back().data.size() * sizeof(uint8_t));
-                    break;
-                case SUBTITLE_TEXT:
-                    box.format = subtitle_box::text;
-                    if (!box.str.empty())
-                    {
-                        box.str += '\n';
-                    }
-                    box.str += rect->text;
-                    break;
-                case SUBTITLE_ASS:
-                    box.format = subtitle_box::ass;
-                    box.style = std::string(reinterpret_cast<const char *>(
-                                _ffmpeg->subtitle_codec_ctxs[_subtitle_stream]->subtitle_header),
-                            _ffmpeg->subtitle_codec_ctxs[_subtitle_stream]->subtitle_header_size);
-                    if (!box.str.empty())
-                    {
-                        box.str += '\n';
-                    }
-                    box.str += rect->ass;
-                    break;
-                case SUBTITLE_NONE:
-                    // Should never happen, but make sure we have a valid subtitle box anyway.
-                    box.format = subtitle_box::text;
-                    box.str = ' ';
-                    break;
-                }
+                decode_subtitle_packet(format_ctx->streams[packet.stream_index], codec_ctxs[i],
+                        _ffmpeg->subtitle_box_templates[i], packet, boxes[i]);
             }
-            _ffmpeg->subtitle_box_buffers[_subtitle_stream].push_back(box);
-            avsubtitle_free(&subtitle);
         }
-
         av_free_packet(&packet);
     }
-    if (_ffmpeg->subtitle_box_buffers[_subtitle_stream].empty())
+    for (size_t i = 0; i < codec_ctxs.size(); i++)
     {
-        _box = subtitle_box();
+        if (codec_ctxs[i] && codec_ctxs[i]->codec_id != CODEC_ID_TEXT)
+        {
+            avcodec_close(codec_ctxs[i]);
+        }
+    }
+    av_close_input_file(format_ctx);
+    if (!ok)
+    {
+        msg::dbg(_url + ": Subtitle preloading stopped.");
         return;
     }
-    _box = _ffmpeg->subtitle_box_buffers[_subtitle_stream].front();
-    _ffmpeg->subtitle_box_buffers[_subtitle_stream].pop_front();
+    for (size_t i = 0; i < _ffmpeg->subtitle_streams.size(); i++)
+    {
+        if (preload[i])
+        {
+            _ffmpeg->subtitle_indexes[i].set(boxes[i]);
+            msg::dbg(_url + ": subtitle stream " + str::from(i) + ": "
+                    + str::from(boxes[i].size()) + " boxes preloaded.");
+        }
+    }
 }
 
-void media_object::start_subtitle_box_read(int subtitle_stream)
+void subtitle_preload_thread::abort()
+{
+    _abort_mutex.lock();
+    _abort = true;
+    _abort_mutex.unlock();
+}
+
+void media_object::start_subtitle_box_read(int subtitle_stream, int64_t min_stop_time)
 {
     assert(subtitle_stream >= 0);
     assert(subtitle_stream < subtitle_streams());
+    _ffmpeg->subtitle_decode_threads[subtitle_stream].set_min_stop_time(min_stop_time);
     _ffmpeg->subtitle_decode_threads[subtitle_stream].start();
 }
 
@@ -1756,10 +4944,14 @@ int64_t media_object::tell()
     return _ffmpeg->pos;
 }
 
-void media_object::seek(int64_t dest_pos)
+void media_object::stop_and_flush()
 {
-    msg::dbg(_url + ": Seeking from " + str::from(_ffmpeg->pos / 1e6f) + " to " + str::from(dest_pos / 1e6f) + ".");
-
+    // Make all threads that wait for packets or frames give up
+    _ffmpeg->queue_sync.abort();
+    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
+    {
+        _ffmpeg->video_frame_queues[i].abort();
+    }
     // Stop decoder threads
     for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
     {
@@ -1775,33 +4967,21 @@ void media_object::seek(int64_t dest_pos)
     }
     // Stop reading packets
     _ffmpeg->reader->finish();
-    // Seek
-    int e = av_seek_frame(_ffmpeg->format_ctx, -1,
-            dest_pos * AV_TIME_BASE / 1000000,
-            dest_pos < _ffmpeg->pos ?  AVSEEK_FLAG_BACKWARD : 0);
-    if (e < 0)
-    {
-        msg::err(_("%s: Seeking failed."), _url.c_str());
-    }
     // Throw away all queued packets
     for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
     {
         avcodec_flush_buffers(_ffmpeg->format_ctx->streams[_ffmpeg->video_streams[i]]->codec);
-        for (size_t j = 0; j < _ffmpeg->video_packet_queues[i].size(); j++)
-        {
-            av_free_packet(&_ffmpeg->video_packet_queues[i][j]);
-        }
-        _ffmpeg->video_packet_queues[i].clear();
+        _ffmpeg->video_packet_queues[i].flush();
+        _ffmpeg->video_frame_queues[i].flush();
+        _ffmpeg->video_frame_queues[i].resume();
     }
     for (size_t i = 0; i < _ffmpeg->audio_streams.size(); i++)
     {
         avcodec_flush_buffers(_ffmpeg->format_ctx->streams[_ffmpeg->audio_streams[i]]->codec);
         _ffmpeg->audio_buffers[i].clear();
-        for (size_t j = 0; j < _ffmpeg->audio_packet_queues[i].size(); j++)
-        {
-            av_free_packet(&_ffmpeg->audio_packet_queues[i][j]);
-        }
-        _ffmpeg->audio_packet_queues[i].clear();
+        av_free_packet(&(_ffmpeg->audio_packets[i]));
+        _ffmpeg->audio_tmppackets[i].size = 0;
+        _ffmpeg->audio_packet_queues[i].flush();
     }
     for (size_t i = 0; i < _ffmpeg->subtitle_streams.size(); i++)
     {
@@ -1811,29 +4991,93 @@ void media_object::seek(int64_t dest_pos)
             avcodec_flush_buffers(_ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[i]]->codec);
         }
         _ffmpeg->subtitle_box_buffers[i].clear();
-        for (size_t j = 0; j < _ffmpeg->subtitle_packet_queues[i].size(); j++)
-        {
-            av_free_packet(&_ffmpeg->subtitle_packet_queues[i][j]);
-        }
-        _ffmpeg->subtitle_packet_queues[i].clear();
+        _ffmpeg->subtitle_packet_queues[i].flush();
     }
-    // The next read request must update the position
-    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
+}
+
+void media_object::seek(int64_t dest_pos, int64_t exact_budget)
+{
+    msg::dbg(_url + ": Seeking from " + str::from(_ffmpeg->pos / 1e6f) + " to " + str::from(dest_pos / 1e6f) + ".");
+
+    // Seeking does not stop the read thread and the video decode threads; they
+    // notice the new generation by themselves (see read_thread::run() and
+    // video_decode_thread::decode()). This function therefore returns quickly,
+    // and the media objects of an input seek concurrently.
+    // The audio and subtitle decode threads only run during a read request, so
+    // their state can be reset right here.
+    for (size_t i = 0; i < _ffmpeg->audio_streams.size(); i++)
+    {
+        _ffmpeg->audio_decode_threads[i].finish();
+    }
+    for (size_t i = 0; i < _ffmpeg->subtitle_streams.size(); i++)
     {
-        _ffmpeg->video_last_timestamps[i] = std::numeric_limits<int64_t>::min();
+        _ffmpeg->subtitle_decode_threads[i].finish();
     }
+    // For an exact seek, the decode threads discard data before the destination;
+    // see video_decode_thread::decode() and audio_decode_thread::skip_to_seek_target().
+    int64_t seek_target = (exact_budget > 0 ? dest_pos : std::numeric_limits<int64_t>::min());
+    _ffmpeg->seek_deadline = timer::get_microseconds(timer::monotonic) + exact_budget;
     for (size_t i = 0; i < _ffmpeg->audio_streams.size(); i++)
     {
+        avcodec_flush_buffers(_ffmpeg->format_ctx->streams[_ffmpeg->audio_streams[i]]->codec);
+        _ffmpeg->audio_buffers[i].clear();
+        av_free_packet(&(_ffmpeg->audio_packets[i]));
+        _ffmpeg->audio_tmppackets[i].size = 0;
         _ffmpeg->audio_last_timestamps[i] = std::numeric_limits<int64_t>::min();
+        _ffmpeg->audio_seek_targets[i] = seek_target;
     }
     for (size_t i = 0; i < _ffmpeg->subtitle_streams.size(); i++)
     {
+        if (_ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[i]]->codec->codec_id != CODEC_ID_TEXT)
+        {
+            // CODEC_ID_TEXT has no decoder, so we cannot flush its buffers
+            avcodec_flush_buffers(_ffmpeg->format_ctx->streams[_ffmpeg->subtitle_streams[i]]->codec);
+        }
+        _ffmpeg->subtitle_box_buffers[i].clear();
         _ffmpeg->subtitle_last_timestamps[i] = std::numeric_limits<int64_t>::min();
+        _ffmpeg->subtitle_index_cursors[i] = SIZE_MAX;
+        _ffmpeg->subtitle_resume_times[i] = std::numeric_limits<int64_t>::min();
+    }
+    // Start a new generation. The frame queues must reject frames of the old
+    // generation before the decode threads can produce frames of the new one.
+    // Only this function changes the generation, so it can be read without locking.
+    int generation = _ffmpeg->queue_sync.generation + 1;
+    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
+    {
+        _ffmpeg->video_frame_queues[i].flush(generation);
+        // The lateness before the seek says nothing about the lateness after it.
+        _ffmpeg->video_lateness[i] = 0;
+        _ffmpeg->video_lateness_reports[i] = 0;
     }
+    // An exact seek must not land after the destination.
+    _ffmpeg->queue_sync.request_seek(dest_pos, dest_pos < _ffmpeg->pos || exact_budget > 0,
+            seek_target, _ffmpeg->seek_deadline);
+    // The next read request must update the position.
     _ffmpeg->pos = std::numeric_limits<int64_t>::min();
-    // Restart packet reading
-    _ffmpeg->reader->reset();
-    _ffmpeg->reader->start();
+    // The read thread is only stopped after release_buffers() or a fatal error.
+    if (!_ffmpeg->reader->is_running())
+    {
+        _ffmpeg->queue_sync.reset();
+        _ffmpeg->reader->reset();
+        _ffmpeg->reader->start();
+    }
+}
+
+void media_object::release_buffers()
+{
+    msg::dbg(_url + ": Releasing buffers.");
+
+    stop_and_flush();
+    // Free the memory that the flushed buffers left unused
+    for (size_t i = 0; i < _ffmpeg->video_streams.size(); i++)
+    {
+        _ffmpeg->video_buffer_pools[i].clear();
+        _ffmpeg->video_out_buffer_pools[i].clear();
+    }
+    for (size_t i = 0; i < _ffmpeg->audio_streams.size(); i++)
+    {
+        _ffmpeg->audio_buffers[i].deinit();
+    }
 }
 
 void media_object::close()
@@ -1842,6 +5086,12 @@ void media_object::close()
     {
         try
         {
+            // Make all threads that wait for packets or frames give up
+            _ffmpeg->queue_sync.abort();
+            for (size_t i = 0; i < _ffmpeg->video_frame_queues.size(); i++)
+            {
+                _ffmpeg->video_frame_queues[i].abort();
+            }
             // Stop decoder threads
             for (size_t i = 0; i < _ffmpeg->video_decode_threads.size(); i++)
             {
@@ -1857,6 +5107,18 @@ void media_object::close()
             }
             // Stop reading packets
             _ffmpeg->reader->finish();
+            // Stop building the keyframe index
+            if (_ffmpeg->indexer)
+            {
+                _ffmpeg->indexer->abort();
+                _ffmpeg->indexer->finish();
+            }
+            // Stop preloading subtitles
+            if (_ffmpeg->subtitle_preloader)
+            {
+                _ffmpeg->subtitle_preloader->abort();
+                _ffmpeg->subtitle_preloader->finish();
+            }
         }
         catch (...)
         {
@@ -1867,14 +5129,6 @@ void media_object::close()
             {
                 av_free(_ffmpeg->video_frames[i]);
             }
-            for (size_t i = 0; i < _ffmpeg->video_out_frames.size(); i++)
-            {
-                av_free(_ffmpeg->video_out_frames[i]);
-            }
-            for (size_t i = 0; i < _ffmpeg->video_buffers.size(); i++)
-            {
-                av_free(_ffmpeg->video_buffers[i]);
-            }
             for (size_t i = 0; i < _ffmpeg->video_codec_ctxs.size(); i++)
             {
                 if (i < _ffmpeg->video_codecs.size() && _ffmpeg->video_codecs[i])
@@ -1882,9 +5136,12 @@ void media_object::close()
                     avcodec_close(_ffmpeg->video_codec_ctxs[i]);
                 }
             }
-            for (size_t i = 0; i < _ffmpeg->video_img_conv_ctxs.size(); i++)
+            for (size_t i = 0; i < _ffmpeg->video_convert_threads.size(); i++)
             {
-                sws_freeContext(_ffmpeg->video_img_conv_ctxs[i]);
+                for (size_t b = 0; b < _ffmpeg->video_convert_threads[i].size(); b++)
+                {
+                    sws_freeContext(_ffmpeg->video_convert_threads[i][b].ctx());
+                }
             }
             for (size_t i = 0; i < _ffmpeg->video_packet_queues.size(); i++)
             {
@@ -1893,10 +5150,7 @@ void media_object::close()
                     msg::dbg(_url + ": " + str::from(_ffmpeg->video_packet_queues[i].size())
                             + " unprocessed packets in video stream " + str::from(i));
                 }
-                for (size_t j = 0; j < _ffmpeg->video_packet_queues[i].size(); j++)
-                {
-                    av_free_packet(&_ffmpeg->video_packet_queues[i][j]);
-                }
+                _ffmpeg->video_packet_queues[i].flush();
             }
             for (size_t i = 0; i < _ffmpeg->video_packets.size(); i++)
             {
@@ -1916,14 +5170,20 @@ void media_object::close()
                     msg::dbg(_url + ": " + str::from(_ffmpeg->audio_packet_queues[i].size())
                             + " unprocessed packets in audio stream " + str::from(i));
                 }
-                for (size_t j = 0; j < _ffmpeg->audio_packet_queues[i].size(); j++)
+                _ffmpeg->audio_packet_queues[i].flush();
+            }
+            for (size_t i = 0; i < _ffmpeg->audio_buffers.size(); i++)
+            {
+                if (_ffmpeg->audio_buffers[i].size() > 0)
                 {
-                    av_free_packet(&_ffmpeg->audio_packet_queues[i][j]);
+                    msg::dbg(_url + ": " + str::from(_ffmpeg->audio_buffers[i].size())
+                            + " bytes of unused decoded audio data in audio stream " + str::from(i));
                 }
+                _ffmpeg->audio_buffers[i].deinit();
             }
-            for (size_t i = 0; i < _ffmpeg->audio_tmpbufs.size(); i++)
+            for (size_t i = 0; i < _ffmpeg->audio_packets.size(); i++)
             {
-                av_free(_ffmpeg->audio_tmpbufs[i]);
+                av_free_packet(&(_ffmpeg->audio_packets[i]));
             }
             for (size_t i = 0; i < _ffmpeg->subtitle_codec_ctxs.size(); i++)
             {
@@ -1939,14 +5199,36 @@ void media_object::close()
                     msg::dbg(_url + ": " + str::from(_ffmpeg->subtitle_packet_queues[i].size())
                             + " unprocessed packets in subtitle stream " + str::from(i));
                 }
-                for (size_t j = 0; j < _ffmpeg->subtitle_packet_queues[i].size(); j++)
+                _ffmpeg->subtitle_packet_queues[i].flush();
+            }
+            for (size_t i = 0; i < _ffmpeg->subtitle_indexes.size(); i++)
+            {
+                std::vector<AVPacket> packets;
+                _ffmpeg->subtitle_indexes[i].take_packets(packets);
+                packets.insert(packets.end(), _ffmpeg->subtitle_collected_packets[i].begin(),
+                        _ffmpeg->subtitle_collected_packets[i].end());
+                for (size_t j = 0; j < packets.size(); j++)
                 {
-                    av_free_packet(&_ffmpeg->subtitle_packet_queues[i][j]);
+                    av_free_packet(&(packets[j]));
                 }
             }
             av_close_input_file(_ffmpeg->format_ctx);
         }
+        msg::dbg(_url + ": " + str::from(_ffmpeg->arena.allocations()) + " packet arena allocations");
+        if (_ffmpeg->registered_queue_sync)
+        {
+            packet_memory.unregister_sync(&_ffmpeg->queue_sync);
+        }
+        if (_ffmpeg->read_ahead)
+        {
+            // The demuxer does not close its custom I/O context; this happens here.
+            _ffmpeg->read_ahead->stop();
+            _ffmpeg->read_ahead->wait();
+        }
         delete _ffmpeg->reader;
+        delete _ffmpeg->indexer;
+        delete _ffmpeg->read_ahead;
+        delete _ffmpeg->subtitle_preloader;
         delete _ffmpeg;
         _ffmpeg = NULL;
     }
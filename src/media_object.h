@@ -24,6 +24,7 @@
 
 #include <string>
 #include <vector>
+#include <limits>
 
 #include "media_data.h"
 
@@ -44,6 +45,9 @@ private:
     void set_audio_blob_template(int audio_stream);
     void set_subtitle_box_template(int subtitle_stream);
 
+    // Stop all threads and throw away all queued data
+    void stop_and_flush();
+
     // The threaded implementation can access private members
     friend class read_thread;
     friend class video_decode_thread;
@@ -60,8 +64,31 @@ public:
      * Initialization
      */
 
-    /* Open a media object. The URL may simply be a file name. */
-    void open(const std::string &url, const device_request &dev_request);
+    /* Open a media object. The URL may simply be a file name.
+     * Up to decode_ahead video frames are decoded ahead of time per video stream.
+     * Detecting the streams reads up to probe_size bytes and probe_duration
+     * microseconds of the input; 0 means to use the FFmpeg defaults.
+     * If cache_stream_info is set, the detected stream parameters of a file are
+     * cached in the per-user cache directory, and detection is skipped when the
+     * file is opened again.
+     * If index_keyframes is set, the keyframes of files in formats without an index
+     * of their own are indexed in the background to make seeking fast and accurate.
+     * The video decoders use threads according to the given threading policy.
+     * The packets of each stream are read ahead for queue_duration microseconds
+     * of presentation time; see also set_queue_memory().
+     * If read_ahead is not zero, a separate thread reads up to read_ahead bytes
+     * of a file ahead of the demuxer, so that slow storage does not stall it.
+     * Media objects may be opened in parallel. */
+    void open(const std::string &url, const device_request &dev_request, int decode_ahead = 4,
+            int64_t probe_size = 0, int64_t probe_duration = 0, bool cache_stream_info = false,
+            bool index_keyframes = false, const decoder_threading &threading = decoder_threading(),
+            int64_t queue_duration = 2000000, size_t read_ahead = 0);
+
+    /* Set the memory budget for the packets that all media objects read ahead,
+     * in bytes. 0 means unlimited. When a decoder starves because its input is
+     * badly interleaved, the packets of the other streams of the input are
+     * queued regardless of the budget, so that playback can go on. */
+    static void set_queue_memory(size_t bytes);
 
     /* Get metadata */
     const std::string &url() const;
@@ -114,6 +141,23 @@ public:
     /* Wait for the video frame reading to finish, and return the frame.
      * An invalid frame means that EOF was reached. */
     video_frame finish_video_frame_read(int video_stream);
+    /* Return the number of video frames that are already decoded and ready. */
+    int video_frames_ahead(int video_stream);
+    /* Report how late (in microseconds) a video frame of the stream was shown.
+     * If the video output stays late, the decoder skips more and more work (the
+     * loop filter, then non-reference frames, then everything but keyframes)
+     * until it keeps up, and returns to full decoding when it can. */
+    void report_video_lateness(int video_stream, int64_t lateness);
+    /* Request that the frames of the stream are reduced to 1/2^lowres of their
+     * size in both directions (lowres is 0, 1, or 2). The decoder switches at the
+     * next keyframe, using the codec lowres feature if available and decimation
+     * otherwise. The frames carry the reduced size; the frame template does not
+     * change. */
+    void set_video_lowres(int video_stream, int lowres);
+    /* Set the number of video streams (of all media objects) that are decoded
+     * at the same time, so that the decoding thread budget is shared among them.
+     * The decoders change their number of threads at the next keyframe. */
+    void set_concurrent_video_streams(int streams);
 
     /* Start to read the given amount of audio data asynchronously (in a separate thread). */
     void start_audio_blob_read(int audio_stream, size_t size);
@@ -121,8 +165,13 @@ public:
      * An invalid blob means that EOF was reached. */
     audio_blob finish_audio_blob_read(int audio_stream);
 
-    /* Start to read a subtitle box asynchronously (in a separate thread). */
-    void start_subtitle_box_read(int subtitle_stream);
+    /* Start to read a subtitle box asynchronously (in a separate thread).
+     * Boxes that stop before min_stop_time are skipped. Text and ASS subtitles
+     * of files are read into memory in the background when their stream is
+     * activated; from then on, boxes are taken from there, and skipping after
+     * a seek is a single lookup. */
+    void start_subtitle_box_read(int subtitle_stream,
+            int64_t min_stop_time = std::numeric_limits<int64_t>::min());
     /* Wait for the subtitle box reading to finish, and return the box.
      * An invalid box means that EOF was reached. */
     subtitle_box finish_subtitle_box_read(int subtitle_stream);
@@ -136,8 +185,22 @@ public:
      * The real position after seeking is only revealed after reading the next video frame,
      * audio blob, or subtitle box. This position may differ from the requested position
      * for various reasons (seeking is only possible to keyframes, seeking is not supported
-     * by the stream, ...) */
-    void seek(int64_t pos);
+     * by the stream, ...)
+     * For files, a keyframe index may be built in the background and cached in the
+     * per-user cache directory; once it is available, seeking jumps directly to the
+     * right keyframe.
+     * If exact_budget is positive, the seek is exact: video frames and audio samples
+     * before the position are decoded and discarded, for at most exact_budget
+     * microseconds. If that is not enough (e.g. because of long GOPs), the seek
+     * ends at the last frame decoded so far.
+     * This function does not wait for the seek to happen: the decoding threads keep
+     * running and drop the data that was read before the seek. */
+    void seek(int64_t pos, int64_t exact_budget = 0);
+
+    /* Stop all threads and free all buffered data and all unused buffer memory,
+     * e.g. during a long pause. Frames that were already read stay valid.
+     * The next seek() restarts everything. */
+    void release_buffers();
 
     /*
      * Cleanup
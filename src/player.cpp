@@ -45,6 +45,17 @@ player_init_data::player_init_data() :
     log_level(msg::INF),
     dev_request(),
     urls(),
+    decode_ahead(4),
+    idle_release(0),
+    exact_seek(0),
+    probe_size(0),
+    probe_duration(0),
+    cache_stream_info(false),
+    index_keyframes(false),
+    threading(),
+    queue_duration(2000),
+    queue_memory(256),
+    read_ahead(16),
     video_stream(0),
     audio_stream(0),
     subtitle_stream(-1),
@@ -70,6 +81,17 @@ void player_init_data::save(std::ostream &os) const
     s11n::save(os, static_cast<int>(log_level));
     s11n::save(os, dev_request);
     s11n::save(os, urls);
+    s11n::save(os, decode_ahead);
+    s11n::save(os, idle_release);
+    s11n::save(os, exact_seek);
+    s11n::save(os, probe_size);
+    s11n::save(os, probe_duration);
+    s11n::save(os, cache_stream_info);
+    s11n::save(os, index_keyframes);
+    s11n::save(os, threading);
+    s11n::save(os, queue_duration);
+    s11n::save(os, queue_memory);
+    s11n::save(os, read_ahead);
     s11n::save(os, video_stream);
     s11n::save(os, audio_stream);
     s11n::save(os, subtitle_stream);
@@ -92,6 +114,17 @@ void player_init_data::load(std::istream &is)
     log_level = static_cast<msg::level_t>(x);
     s11n::load(is, dev_request);
     s11n::load(is, urls);
+    s11n::load(is, decode_ahead);
+    s11n::load(is, idle_release);
+    s11n::load(is, exact_seek);
+    s11n::load(is, probe_size);
+    s11n::load(is, probe_duration);
+    s11n::load(is, cache_stream_info);
+    s11n::load(is, index_keyframes);
+    s11n::load(is, threading);
+    s11n::load(is, queue_duration);
+    s11n::load(is, queue_memory);
+    s11n::load(is, read_ahead);
     s11n::load(is, video_stream);
     s11n::load(is, audio_stream);
     s11n::load(is, subtitle_stream);
@@ -148,6 +181,7 @@ void player::reset_playstate()
     _drop_next_frame = false;
     _previous_frame_dropped = false;
     _in_pause = false;
+    _idle_released = false;
     _quit_request = false;
     _pause_request = false;
     _seek_request = 0;
@@ -202,11 +236,18 @@ void player::open(const player_init_data &init_data)
     // Initialize basics
     msg::set_level(init_data.log_level);
     _benchmark = init_data.benchmark;
+    _idle_release = init_data.idle_release;
+    _exact_seek = init_data.exact_seek;
     reset_playstate();
 
     // Create media input
     _media_input = new media_input();
-    _media_input->open(init_data.urls, init_data.dev_request);
+    _media_input->open(init_data.urls, init_data.dev_request, init_data.decode_ahead,
+            init_data.probe_size, init_data.probe_duration * static_cast<int64_t>(1000),
+            init_data.cache_stream_info, init_data.index_keyframes, init_data.threading,
+            init_data.queue_duration * static_cast<int64_t>(1000),
+            static_cast<size_t>(init_data.queue_memory) << 20,
+            static_cast<size_t>(init_data.read_ahead) << 20);
     if (_media_input->video_streams() == 0)
     {
         throw exc(_("No video streams found."));
@@ -341,18 +382,14 @@ int64_t player::step(bool *more_steps, int64_t *seek_to, bool *prep_frame, bool
         _video_pos = _video_frame.presentation_time;
         if (_media_input->selected_subtitle_stream() >= 0)
         {
-            do
+            _media_input->start_subtitle_box_read(_video_pos);
+            _next_subtitle_box = _media_input->finish_subtitle_box_read();
+            if (!_next_subtitle_box.is_valid())
             {
-                _media_input->start_subtitle_box_read();
-                _next_subtitle_box = _media_input->finish_subtitle_box_read();
-                if (!_next_subtitle_box.is_valid())
-                {
-                    msg::dbg("Empty subtitle stream.");
-                    stop_playback();
-                    return 0;
-                }
+                msg::dbg("Empty subtitle stream.");
+                stop_playback();
+                return 0;
             }
-            while (_next_subtitle_box.presentation_stop_time < _video_pos);
         }
         if (_audio_output)
         {
@@ -396,10 +433,22 @@ int64_t player::step(bool *more_steps, int64_t *seek_to, bool *prep_frame, bool
             return 0;
         }
     }
-    if (_seek_request != 0 || _set_pos_request >= 0.0f)
+    if (_seek_request != 0 || _set_pos_request >= 0.0f || (_idle_released && !_pause_request))
     {
         int64_t old_pos = _current_pos;
-        if (_set_pos_request >= 0.0f)
+        int64_t exact_budget = _exact_seek * static_cast<int64_t>(1000);
+        if (_seek_request == 0 && _set_pos_request < 0.0f)
+        {
+            // Resume after the buffers were released: seek back to the paused position.
+            // This must continue with the frame that was shown, so the seek is always
+            // exact, regardless of the seek mode that the user chose. The target is the
+            // video position: the audio position is ahead of it by the data that was
+            // queued for audio output, and audio resynchronizes after the seek anyway.
+            const int64_t idle_resume_exact_budget = 2000000;
+            *seek_to = _video_pos;
+            exact_budget = std::max(exact_budget, idle_resume_exact_budget);
+        }
+        else if (_set_pos_request >= 0.0f)
         {
             int64_t dest_pos_min = _start_pos + _media_input->initial_skip();
             int64_t dest_pos_max = dest_pos_min + _media_input->duration() - 2000000;
@@ -430,7 +479,8 @@ int64_t player::step(bool *more_steps, int64_t *seek_to, bool *prep_frame, bool
         }
         _seek_request = 0;
         _set_pos_request = -1.0f;
-        _media_input->seek(*seek_to);
+        _idle_released = false;
+        _media_input->seek(*seek_to, exact_budget);
         _next_subtitle_box = subtitle_box();
         _current_subtitle_box = subtitle_box();
 
@@ -445,18 +495,14 @@ int64_t player::step(bool *more_steps, int64_t *seek_to, bool *prep_frame, bool
         _video_pos = _video_frame.presentation_time;
         if (_media_input->selected_subtitle_stream() >= 0)
         {
-            do
+            _media_input->start_subtitle_box_read(_video_pos);
+            _next_subtitle_box = _media_input->finish_subtitle_box_read();
+            if (!_next_subtitle_box.is_valid())
             {
-                _media_input->start_subtitle_box_read();
-                _next_subtitle_box = _media_input->finish_subtitle_box_read();
-                if (!_next_subtitle_box.is_valid())
-                {
-                    msg::dbg("Seeked to end of subtitle?!");
-                    stop_playback();
-                    return 0;
-                }
+                msg::dbg("Seeked to end of subtitle?!");
+                stop_playback();
+                return 0;
             }
-            while (_next_subtitle_box.presentation_stop_time < _video_pos);
         }
         if (_audio_output)
         {
@@ -479,6 +525,7 @@ int64_t player::step(bool *more_steps, int64_t *seek_to, bool *prep_frame, bool
         else
         {
             _master_time_start = timer::get_microseconds(timer::monotonic);
+            _pause_start = _master_time_start;  // the pause time before the seek does not count
             _master_time_pos = _video_pos;
             _current_pos = _video_pos;
         }
@@ -499,13 +546,23 @@ int64_t player::step(bool *more_steps, int64_t *seek_to, bool *prep_frame, bool
             {
                 _audio_output->pause();
             }
-            else
-            {
-                _pause_start = timer::get_microseconds(timer::monotonic);
-            }
+            _pause_start = timer::get_microseconds(timer::monotonic);
             _in_pause = true;
             controller::notify_all(notification::pause, false, true);
         }
+        else if (_idle_release > 0 && !_idle_released
+                && timer::get_microseconds(timer::monotonic) - _pause_start >= _idle_release * static_cast<int64_t>(1000000))
+        {
+            // Release everything that is not needed to show the current frame.
+            // Unpausing seeks back to the current position, which restores it.
+            msg::dbg("Releasing buffers during pause.");
+            _media_input->release_buffers();
+            if (_video_output)
+            {
+                _video_output->release_inactive_resources();
+            }
+            _idle_released = true;
+        }
         *more_steps = true;
         return 1000;    // allow some sleep in pause mode
     }
@@ -638,10 +695,31 @@ int64_t player::step(bool *more_steps, int64_t *seek_to, bool *prep_frame, bool
         {
             // Output current video frame
             _drop_next_frame = false;
+            if (!_benchmark && !_media_input->is_device())
+            {
+                // Let the decoder skip work if this happens too often
+                _media_input->report_video_lateness(_master_time_current - _video_pos);
+            }
+            if (!_benchmark && !_media_input->is_device() && _video_output)
+            {
+                // Let the decoder reduce the frame size if the video output
+                // cannot show the details anyway
+                const video_frame &t = _media_input->video_frame_template();
+                int w = _video_output->view_pixels_width();
+                int h = _video_output->view_pixels_height();
+                int lowres = 0;
+                while (lowres < 2 && w > 0 && h > 0
+                        && (t.width >> (lowres + 1)) >= w && (t.height >> (lowres + 1)) >= h)
+                {
+                    lowres++;
+                }
+                _media_input->set_video_lowres(lowres);
+            }
             if (_master_time_current - _video_pos > _media_input->video_frame_duration() * 75 / 100
                     && !_benchmark && !_media_input->is_device())
             {
                 msg::wrn(_("Video: delay %g seconds; dropping next frame."), (_master_time_current - _video_pos) / 1e6f);
+                msg::dbg("Video: %d frames decoded ahead.", _media_input->video_frames_ahead());
                 _drop_next_frame = true;
             }
             if (!_previous_frame_dropped)
@@ -703,6 +781,37 @@ bool player::run_step()
             _master_time_start += _video_output->wait_for_subtitle_renderer();
         }
         _video_output->prepare_next_frame(_video_frame, _current_subtitle_box);
+        if (_next_subtitle_box.is_valid())
+        {
+            // Let the video output render the next subtitle in the background.
+            // Constant subtitles are rendered once, before they are shown.
+            // Animated subtitles are rendered for the next few frames.
+            std::vector<int64_t> timestamps;
+            int64_t frame_duration = _media_input->video_frame_duration();
+            if (_next_subtitle_box.is_constant())
+            {
+                if (_next_subtitle_box != _current_subtitle_box)
+                {
+                    timestamps.push_back(_next_subtitle_box.presentation_start_time);
+                }
+            }
+            else
+            {
+                for (int i = 1; i <= 4; i++)
+                {
+                    int64_t t = _video_pos + i * frame_duration;
+                    if (t > _next_subtitle_box.presentation_stop_time)
+                    {
+                        break;
+                    }
+                    if (t + frame_duration > _next_subtitle_box.presentation_start_time)
+                    {
+                        timestamps.push_back(t);
+                    }
+                }
+            }
+            _video_output->prerender_subtitle(_video_frame, _next_subtitle_box, timestamps);
+        }
     }
     else if (drop_frame)
     {
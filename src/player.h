@@ -43,6 +43,17 @@ public:
     msg::level_t log_level;                     // Level of log messages
     device_request dev_request;                 // Request for input device settings
     std::vector<std::string> urls;              // Input media objects
+    int decode_ahead;                           // Number of video frames to decode ahead of time
+    int idle_release;                           // Seconds of pause after which buffers are released (0 = never)
+    int exact_seek;                             // Time budget for exact seeking in milliseconds (0 = keyframe seeking)
+    int probe_size;                             // Bytes to read for stream detection (0 = default)
+    int probe_duration;                         // Milliseconds to read for stream detection (0 = default)
+    bool cache_stream_info;                     // Cache detected stream parameters of input files?
+    bool index_keyframes;                       // Index the keyframes of input files in the background?
+    decoder_threading threading;                // Threading policy for video decoding
+    int queue_duration;                         // Milliseconds of packets to read ahead per stream
+    int queue_memory;                           // Memory budget for read ahead packets in MiB (0 = unlimited)
+    int read_ahead;                             // MiB of file data to read ahead in a separate thread (0 = off)
     int video_stream;                           // Selected video stream
     int audio_stream;                           // Selected audio stream
     int subtitle_stream;                        // Selected subtitle stream
@@ -109,6 +120,9 @@ private:
     bool _drop_next_frame;                      // Do we need to drop the next video frame (to catch up)?
     bool _previous_frame_dropped;               // Did we drop the previous video frame?
     bool _in_pause;                             // Are we in pause mode?
+    int _idle_release;                          // Seconds of pause after which buffers are released (0 = never)
+    bool _idle_released;                        // Were the buffers released during the current pause?
+    int _exact_seek;                            // Time budget for exact seeking in milliseconds (0 = keyframe seeking)
 
     // Requests made by controller commands
     bool _quit_request;                         // Request to quit
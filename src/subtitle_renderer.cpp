@@ -26,8 +26,13 @@
 #include <limits>
 #include <cstring>
 #include <cstdio>
+#include <algorithm>
 #include <stdint.h>
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
 #include <GL/glew.h>
 
 #if (defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__
@@ -66,25 +71,27 @@ void subtitle_renderer_initializer::run()
 }
 
 
-/* Rendering subtitles with LibASS is not thread-safe.
- *
- * We have multiple concurrent subtitle rendering threads if we are running from Equalizer
+/* We have multiple concurrent subtitle rendering threads if we are running from Equalizer
  * and the Equalizer configuration contains multiple channels per node (since each channel
  * has a video output, which in turn has a subtitle renderer).
  *
- * Everything works fine as long as every channel is connected to the same X11 display.
- * But if channels are connected to different X11 displays, the application crashes.
- * The culprit here seems to be the freetype library, as this library causes the same
- * trouble in other applications that are not related to LibASS.
- *
- * Anyway, to fix this we use one big global lock around LibASS calls.
+ * Each subtitle renderer has its own ASS_Library and ASS_Renderer, and with them its own
+ * FreeType library instance and font cache. But the setup and teardown of these objects
+ * touches process-wide state (fontconfig and its caches, FreeType initialization), which
+ * caused crashes when channels were connected to different X11 displays, so creating and
+ * destroying LibASS objects is serialized with a global lock. Rendering also uses
+ * fontconfig: LibASS selects a font through it the first time the font is used. Since
+ * fontconfig is only thread-safe since version 2.10.91, rendering takes the global lock
+ * too unless configure found such a version. The fontconfig configuration file, if we
+ * need one, is created once and shared by all renderers.
  */
 static mutex global_libass_mutex;
+static const char *global_fontconfig_conffile = NULL;
+static int global_fontconfig_conffile_users = 0;
 
 subtitle_renderer::subtitle_renderer() :
     _initializer(*this),
     _initialized(false),
-    _fontconfig_conffile(NULL),
     _ass_library(NULL),
     _ass_renderer(NULL),
     _ass_track(NULL)
@@ -104,6 +111,7 @@ subtitle_renderer::~subtitle_renderer()
         {
         }
     }
+    global_libass_mutex.lock();
     if (_ass_track)
     {
         ass_free_track(_ass_track);
@@ -116,10 +124,16 @@ subtitle_renderer::~subtitle_renderer()
     {
         ass_library_done(_ass_library);
     }
-    if (_fontconfig_conffile)
+    if (_initialized)
     {
-        (void)std::remove(_fontconfig_conffile);
+        global_fontconfig_conffile_users--;
+        if (global_fontconfig_conffile_users == 0 && global_fontconfig_conffile)
+        {
+            (void)std::remove(global_fontconfig_conffile);
+            global_fontconfig_conffile = NULL;
+        }
     }
+    global_libass_mutex.unlock();
 }
 
 static void libass_msg_callback(int level, const char *fmt, va_list args, void *)
@@ -152,6 +166,7 @@ const char *subtitle_renderer::get_fontconfig_conffile()
         return NULL;
 # else /* __APPLE__ */
     static char tmpfilename[] = "/tmp/fontsXXXXXX.conf";
+    std::strcpy(tmpfilename, "/tmp/fontsXXXXXX.conf");  // the file may be recreated
     int d = mkstemps(tmpfilename, 5);
     if (d == -1)
         return NULL;
@@ -232,10 +247,14 @@ void subtitle_renderer::init()
                 throw exc(_("Cannot initialize LibASS renderer."));
             }
             ass_set_hinting(ass_renderer, ASS_HINTING_NATIVE);
-            _fontconfig_conffile = get_fontconfig_conffile();
-            ass_set_fonts(ass_renderer, NULL, "sans-serif", 1, _fontconfig_conffile, 1);
+            if (global_fontconfig_conffile_users == 0)
+            {
+                global_fontconfig_conffile = get_fontconfig_conffile();
+            }
+            ass_set_fonts(ass_renderer, NULL, "sans-serif", 1, global_fontconfig_conffile, 1);
             _ass_renderer = ass_renderer;
 
+            global_fontconfig_conffile_users++;
             _initialized = true;
             global_libass_mutex.unlock();
         }
@@ -307,12 +326,87 @@ void subtitle_renderer::render(uint32_t *bgra32_buffer)
     }
 }
 
+/* Divide a value in [0, 255 * 255] by 255, with the same result as an integer division. */
+
+static inline unsigned int div255(unsigned int x)
+{
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+#if defined(__SSE2__)
+static inline __m128i div255(__m128i x)
+{
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+
+/* Blend two source pixels onto two destination pixels. Both are BGRA32 pixels
+ * expanded to 16 bit per component. */
+
+static inline __m128i blend2(__m128i src, __m128i dst)
+{
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i color = div255(_mm_add_epi16(_mm_mullo_epi16(a, src),
+                _mm_mullo_epi16(_mm_sub_epi16(_mm_set1_epi16(255), a), dst)));
+    __m128i alpha = _mm_min_epi16(_mm_add_epi16(a, dst), _mm_set1_epi16(255));
+    __m128i alpha_mask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    return _mm_or_si128(_mm_andnot_si128(alpha_mask, color), _mm_and_si128(alpha_mask, alpha));
+}
+#endif
+
+/* Blend a row of n BGRA32 source pixels onto the destination row. The inner loop
+ * uses SSE2 if the compiler targets it; the scalar fallback has the same results. */
+
+static void blend_row(const uint32_t *src, uint32_t *dst, int n)
+{
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_bytes = _mm_set1_epi32(0xff000000);
+    for (; x + 4 <= n; x += 4)
+    {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alpha_bytes), zero)) == 0xffff)
+        {
+            // All source pixels are transparent
+            continue;
+        }
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + x));
+        __m128i lo = blend2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = blend2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; x < n; x++)
+    {
+        uint32_t srcval = src[x];
+        unsigned int A = (srcval >> 24u);
+        if (A == 0)
+        {
+            continue;
+        }
+        unsigned int R = (srcval >> 16u) & 0xffu;
+        unsigned int G = (srcval >> 8u) & 0xffu;
+        unsigned int B = srcval & 0xffu;
+        uint32_t oldval = dst[x];
+        // XXX: The BGRA layout used here may be wrong on big endian system
+        dst[x] = std::min(A + (oldval >> 24u), 255u) << 24u
+            | div255(A * R + (255u - A) * ((oldval >> 16u) & 0xffu)) << 16u
+            | div255(A * G + (255u - A) * ((oldval >>  8u) & 0xffu)) << 8u
+            | div255(A * B + (255u - A) * ((oldval       ) & 0xffu));
+    }
+}
+
 void subtitle_renderer::blend_ass_image(const ASS_Image *img, uint32_t *buf)
 {
-    const unsigned int R = (img->color >> 24u) & 0xffu;
-    const unsigned int G = (img->color >> 16u) & 0xffu;
-    const unsigned int B = (img->color >>  8u) & 0xffu;
+    const uint32_t color = (img->color >> 8u) & 0xffffffu;
     const unsigned int A = 255u - (img->color & 0xffu);
+    const int dst_x = img->dst_x - _bb_x;
+    const int w = std::min(img->w, _bb_w - dst_x);
+    if (w <= 0)
+    {
+        return;
+    }
+    _blend_row.resize(w);
 
     unsigned char *src = img->bitmap;
     for (int src_y = 0; src_y < img->h; src_y++)
@@ -322,30 +416,18 @@ void subtitle_renderer::blend_ass_image(const ASS_Image *img, uint32_t *buf)
         {
             break;
         }
-        for (int src_x = 0; src_x < img->w; src_x++)
+        for (int x = 0; x < w; x++)
         {
-            unsigned int a = src[src_x] * A / 255u;
-            int dst_x = src_x + img->dst_x - _bb_x;
-            if (dst_x >= _bb_w)
-            {
-                break;
-            }
-            uint32_t oldval = buf[dst_y * _bb_w + dst_x];
-            // XXX: The BGRA layout used here may be wrong on big endian system
-            uint32_t newval = std::min(a + (oldval >> 24u), 255u) << 24u
-                | ((a * R + (255u - a) * ((oldval >> 16u) & 0xffu)) / 255u) << 16u
-                | ((a * G + (255u - a) * ((oldval >>  8u) & 0xffu)) / 255u) << 8u
-                | ((a * B + (255u - a) * ((oldval       ) & 0xffu)) / 255u);
-            buf[dst_y * _bb_w + dst_x] = newval;
+            _blend_row[x] = (div255(src[x] * A) << 24u) | color;
         }
+        blend_row(&(_blend_row[0]), buf + dst_y * _bb_w + dst_x, w);
         src += img->stride;
     }
 }
 
-void subtitle_renderer::set_ass_parameters(const parameters &params)
+std::vector<std::string> subtitle_renderer::ass_style_overrides(const parameters &params)
 {
     std::vector<std::string> overrides;
-    overrides.clear();
     if (params.subtitle_font != "")
     {
         overrides.push_back(std::string("Default.Fontname=") + params.subtitle_font);
@@ -365,86 +447,144 @@ void subtitle_renderer::set_ass_parameters(const parameters &params)
         overrides.push_back(std::string("Default.PrimaryColour=") + color_str);
         overrides.push_back(std::string("Default.SecondaryColour=") + color_str);
     }
-    const char *ass_overrides[overrides.size() + 1];
-    for (size_t i = 0; i < overrides.size(); i++)
-    {
-        ass_overrides[i] = ::strdup(overrides[i].c_str());
-    }
-    ass_overrides[overrides.size()] = NULL;
-    ass_set_style_overrides(_ass_library, const_cast<char **>(ass_overrides));
-    ass_set_font_scale(_ass_renderer, (params.subtitle_scale >= 0.0f ? params.subtitle_scale : 1.0));
-    ass_process_force_style(_ass_track);
+    return overrides;
 }
 
-void subtitle_renderer::prerender_ass(const subtitle_box &box, int64_t timestamp,
-        const parameters &params, int width, int height, float pixel_aspect_ratio)
+void subtitle_renderer::set_ass_track(const subtitle_box &box, const parameters &params)
 {
-    // Lock
-    global_libass_mutex.lock();
-
-    // Set basic parameters
-    ass_set_frame_size(_ass_renderer, width, height);
-    ass_set_aspect_ratio(_ass_renderer, 1.0, pixel_aspect_ratio);
+    std::string style;
+    if (box.format == subtitle_box::ass)
+    {
+        style = box.style;
+    }
+    else
+    {
+        // Set a default ASS style for text subtitles
+        style =
+            "[Script Info]\n"
+            "ScriptType: v4.00+\n"
+            "\n"
+            "[V4+ Styles]\n"
+            "Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, "
+            "OutlineColour, BackColour, Bold, Italic, Underline, BorderStyle, "
+            "Outline, Shadow, Alignment, MarginL, MarginR, MarginV, AlphaLevel, Encoding\n"
+            "Style: Default,Arial,16,&Hffffff,&Hffffff,&H0,&H0,0,0,0,1,1,0,2,10,10,10,0,0\n"
+            "\n"
+            "[Events]\n"
+            "Format: Layer, Start, End, Text\n"
+            "\n";
+    }
+    std::vector<std::string> overrides = ass_style_overrides(params);
+    // ASS events stay in the track, so each subtitle stream needs its own track,
+    // even if it has the same styles as another one.
+    std::string key = box.stream_id + '\n' + str::from(static_cast<int>(box.format)) + '\n'
+        + params.subtitle_encoding + '\n';
+    for (size_t i = 0; i < overrides.size(); i++)
+    {
+        key += overrides[i] + '\n';
+    }
+    key += style;
+    if (_ass_track && key == _ass_track_key)
+    {
+        return;
+    }
 
-    // Put subtitle data into ASS track
+    // Create a new track with the given styles
     if (_ass_track)
     {
         ass_free_track(_ass_track);
     }
+    _ass_track_key.clear();
+    _ass_track_events.clear();
+    _ass_text_box = subtitle_box();
     _ass_track = ass_new_track(_ass_library);
     if (!_ass_track)
     {
-        global_libass_mutex.unlock();
         throw exc(_("Cannot initialize LibASS track."));
     }
+    ass_process_codec_private(_ass_track, const_cast<char *>(style.c_str()), style.length());
+    const char *ass_overrides[overrides.size() + 1];
+    for (size_t i = 0; i < overrides.size(); i++)
+    {
+        ass_overrides[i] = overrides[i].c_str();
+    }
+    ass_overrides[overrides.size()] = NULL;
+    // LibASS copies the overrides.
+    ass_set_style_overrides(_ass_library, const_cast<char **>(ass_overrides));
+    ass_process_force_style(_ass_track);
+    _ass_track_key = key;
+}
+
+void subtitle_renderer::add_ass_events(const subtitle_box &box, const parameters &params)
+{
+    if (box.format == subtitle_box::ass
+            ? _ass_track_events.find(box.str) != _ass_track_events.end()
+            : box == _ass_text_box && box.str == _ass_text_box.str)
+    {
+        return;
+    }
     std::string conv_str = box.str;
+    bool conv_ok = true;
     if (params.subtitle_encoding != "")
     {
         try
         {
-            conv_str = str::convert(box.str, params.subtitle_encoding, "UTF-8");
+            conv_str = _converter.convert(box.str, params.subtitle_encoding, "UTF-8");
         }
         catch (std::exception &e)
         {
             msg::err(_("Subtitle character set conversion failed: %s"), e.what());
-            conv_str = std::string("Dialogue: 0,0:00:00.00,9:59:59.99,") + e.what();
+            conv_str = e.what();
+            conv_ok = false;
         }
     }
     if (box.format == subtitle_box::ass)
     {
-        ass_process_codec_private(_ass_track, const_cast<char *>(box.style.c_str()), box.style.length());
-        ass_process_data(_ass_track, const_cast<char *>(conv_str.c_str()), conv_str.length());
+        // The event stays in the track, so it must not be added again. An event
+        // that could not be converted is skipped, since the message would stay, too.
+        if (conv_ok)
+        {
+            ass_process_data(_ass_track, const_cast<char *>(conv_str.c_str()), conv_str.length());
+        }
+        _ass_track_events.insert(box.str);
     }
     else
     {
-        // Set a default ASS style for text subtitles
-        std::string style =
-            "[Script Info]\n"
-            "ScriptType: v4.00+\n"
-            "\n"
-            "[V4+ Styles]\n"
-            "Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, "
-            "OutlineColour, BackColour, Bold, Italic, Underline, BorderStyle, "
-            "Outline, Shadow, Alignment, MarginL, MarginR, MarginV, AlphaLevel, Encoding\n"
-            "Style: Default,Arial,16,&Hffffff,&Hffffff,&H0,&H0,0,0,0,1,1,0,2,10,10,10,0,0\n"
-            "\n"
-            "[Events]\n"
-            "Format: Layer, Start, End, Text\n"
-            "\n";
-        ass_process_codec_private(_ass_track, const_cast<char *>(style.c_str()), style.length());
+        // Replace the event of the previous text subtitle
+        for (int i = _ass_track->n_events - 1; i >= 0; i--)
+        {
+            ass_free_event(_ass_track, i);
+        }
+        _ass_track->n_events = 0;
         // Convert text to ASS
         str::replace(conv_str, "\r\n", "\\N");
         str::replace(conv_str, "\n", "\\N");
         std::string str = "Dialogue: 0,0:00:00.00,9:59:59.99," + conv_str;
         ass_process_data(_ass_track, const_cast<char *>(str.c_str()), str.length());
+        _ass_text_box = box;
     }
-    set_ass_parameters(params);
+}
+
+void subtitle_renderer::prerender_ass(const subtitle_box &box, int64_t timestamp,
+        const parameters &params, int width, int height, float pixel_aspect_ratio)
+{
+    // Set basic parameters
+    ass_set_frame_size(_ass_renderer, width, height);
+    ass_set_aspect_ratio(_ass_renderer, 1.0, pixel_aspect_ratio);
+    ass_set_font_scale(_ass_renderer, (params.subtitle_scale >= 0.0f ? params.subtitle_scale : 1.0));
+
+    // Put subtitle data into ASS track
+    set_ass_track(box, params);
+    add_ass_events(box, params);
 
     // Render subtitle
+#if !HAVE_THREADSAFE_FONTCONFIG
+    global_libass_mutex.lock();
+#endif
     _ass_img = ass_render_frame(_ass_renderer, _ass_track, timestamp / 1000, NULL);
-
-    // Unlock
+#if !HAVE_THREADSAFE_FONTCONFIG
     global_libass_mutex.unlock();
+#endif
 
     // Determine bounding box
     int min_x = width;
@@ -541,6 +681,21 @@ void subtitle_renderer::render_img(uint32_t *bgra32_buffer)
     for (size_t i = 0; i < _img_box->images.size(); i++)
     {
         const subtitle_box::image_t &img = _img_box->images[i];
+        const int dst_x = img.x - _bb_x;
+        const int w = std::min(img.w, _bb_w - dst_x);
+        if (w <= 0)
+        {
+            continue;
+        }
+        _blend_row.resize(w);
+        // Expand the palette once per image, so that indices beyond it are transparent.
+        uint32_t palette[256];
+        size_t palette_size = std::min(img.palette.size() / 4, static_cast<size_t>(256));
+        if (palette_size > 0)
+        {
+            std::memcpy(palette, &(img.palette[0]), palette_size * sizeof(uint32_t));
+        }
+        std::fill(palette + palette_size, palette + 256, 0u);
         const uint8_t *src = &(img.data[0]);
         for (int src_y = 0; src_y < img.h; src_y++)
         {
@@ -549,28 +704,193 @@ void subtitle_renderer::render_img(uint32_t *bgra32_buffer)
             {
                 break;
             }
-            for (int src_x = 0; src_x < img.w; src_x++)
+            for (int x = 0; x < w; x++)
             {
-                int dst_x = src_x + img.x - _bb_x;
-                if (dst_x >= _bb_w)
-                {
-                    break;
-                }
-                int palette_index = src[src_x];
-                uint32_t palette_entry = reinterpret_cast<const uint32_t *>(&(img.palette[0]))[palette_index];
-                unsigned int A = (palette_entry >> 24u);
-                unsigned int R = (palette_entry >> 16u) & 0xffu;
-                unsigned int G = (palette_entry >> 8u) & 0xffu;
-                unsigned int B = palette_entry & 0xffu;
-                uint32_t oldval = bgra32_buffer[dst_y * _bb_w + dst_x];
-                // XXX: The BGRA layout used here may be wrong on big endian system
-                uint32_t newval = std::min(A + (oldval >> 24u), 255u) << 24u
-                    | ((A * R + (255u - A) * ((oldval >> 16u) & 0xffu)) / 255u) << 16u
-                    | ((A * G + (255u - A) * ((oldval >>  8u) & 0xffu)) / 255u) << 8u
-                    | ((A * B + (255u - A) * ((oldval       ) & 0xffu)) / 255u);
-                bgra32_buffer[dst_y * _bb_w + dst_x] = newval;
+                _blend_row[x] = palette[src[x]];
             }
+            blend_row(&(_blend_row[0]), bgra32_buffer + dst_y * _bb_w + dst_x, w);
             src += img.linesize;
         }
     }
 }
+
+subtitle_image::subtitle_image() :
+    timestamp(0), width(0), height(0), pixel_aspect_ratio(0.0f),
+    bb_x(0), bb_y(0), bb_w(0), bb_h(0)
+{
+}
+
+subtitle_image::subtitle_image(const subtitle_box &box, int64_t timestamp, const parameters &params,
+        int width, int height, float pixel_aspect_ratio) :
+    box(box), timestamp(timestamp), params(params),
+    width(width), height(height), pixel_aspect_ratio(pixel_aspect_ratio),
+    bb_x(0), bb_y(0), bb_w(0), bb_h(0)
+{
+}
+
+bool subtitle_image::matches(const subtitle_image &img) const
+{
+    // libass renders with millisecond precision, so animated subtitles
+    // look the same for all timestamps within the same millisecond.
+    return (box == img.box
+            && box.stream_id == img.box.stream_id
+            && box.str == img.box.str
+            && (box.is_constant() || timestamp / 1000 == img.timestamp / 1000)
+            && width == img.width
+            && height == img.height
+            && !(pixel_aspect_ratio < img.pixel_aspect_ratio
+                || pixel_aspect_ratio > img.pixel_aspect_ratio)
+            && params.subtitle_encoding == img.params.subtitle_encoding
+            && params.subtitle_font == img.params.subtitle_font
+            && params.subtitle_size == img.params.subtitle_size
+            && !(params.subtitle_scale < img.params.subtitle_scale
+                || params.subtitle_scale > img.params.subtitle_scale)
+            && params.subtitle_color == img.params.subtitle_color);
+}
+
+subtitle_prerenderer::subtitle_prerenderer(subtitle_renderer &renderer) :
+    _renderer(renderer), _stop(false)
+{
+}
+
+void subtitle_prerenderer::render(subtitle_image &img)
+{
+    // The renderer must be locked by the caller.
+    _renderer.prerender(img.box, img.timestamp, img.params,
+            img.width, img.height, img.pixel_aspect_ratio,
+            img.bb_x, img.bb_y, img.bb_w, img.bb_h);
+    if (img.bb_w > 0 && img.bb_h > 0)
+    {
+        img.data.resize(img.bb_w * img.bb_h);
+        _renderer.render(&(img.data[0]));
+    }
+    else
+    {
+        img.data.clear();
+    }
+}
+
+bool subtitle_prerenderer::lookup(subtitle_image &img)
+{
+    // The mutex must be locked by the caller.
+    for (size_t i = 0; i < _cache.size(); i++)
+    {
+        if (_cache[i].matches(img))
+        {
+            // Keep the image in the cache: the video output has more than one
+            // subtitle texture, and each of them may need it.
+            img.bb_x = _cache[i].bb_x;
+            img.bb_y = _cache[i].bb_y;
+            img.bb_w = _cache[i].bb_w;
+            img.bb_h = _cache[i].bb_h;
+            img.data = _cache[i].data;
+            return true;
+        }
+    }
+    return false;
+}
+
+void subtitle_prerenderer::run()
+{
+    for (;;)
+    {
+        subtitle_image img;
+        _mutex.lock();
+        while (!_stop && _requests.empty())
+        {
+            _cond.wait(_mutex);
+        }
+        if (_stop)
+        {
+            _mutex.unlock();
+            break;
+        }
+        img = _requests.front();
+        _requests.pop_front();
+        bool cached = false;
+        for (size_t i = 0; !cached && i < _cache.size(); i++)
+        {
+            cached = _cache[i].matches(img);
+        }
+        _mutex.unlock();
+        if (cached)
+        {
+            continue;
+        }
+        _render_mutex.lock();
+        try
+        {
+            render(img);
+        }
+        catch (std::exception &e)
+        {
+            // The video output will report this when it renders the subtitle itself.
+            msg::dbg(_("Cannot prerender subtitle: %s"), e.what());
+            _render_mutex.unlock();
+            continue;
+        }
+        _render_mutex.unlock();
+        _mutex.lock();
+        if (_cache.size() >= _cache_size)
+        {
+            _cache.pop_front();
+        }
+        _cache.push_back(img);
+        _mutex.unlock();
+    }
+}
+
+void subtitle_prerenderer::stop()
+{
+    _mutex.lock();
+    _stop = true;
+    _requests.clear();
+    _cache.clear();
+    _cond.wake_one();
+    _mutex.unlock();
+    wait();
+    _stop = false;
+}
+
+void subtitle_prerenderer::request(const subtitle_box &box, const std::vector<int64_t> &timestamps,
+        const parameters &params, int width, int height, float pixel_aspect_ratio)
+{
+    start();
+    _mutex.lock();
+    _requests.clear();
+    for (size_t i = 0; i < timestamps.size(); i++)
+    {
+        _requests.push_back(subtitle_image(box, timestamps[i], params,
+                    width, height, pixel_aspect_ratio));
+    }
+    _cond.wake_one();
+    _mutex.unlock();
+}
+
+void subtitle_prerenderer::get(subtitle_image &img)
+{
+    _mutex.lock();
+    bool found = lookup(img);
+    _mutex.unlock();
+    if (!found)
+    {
+        // The image may have been rendered while we waited for the renderer.
+        _render_mutex.lock();
+        _mutex.lock();
+        found = lookup(img);
+        _mutex.unlock();
+        try
+        {
+            if (!found)
+            {
+                render(img);
+            }
+        }
+        catch (...)
+        {
+            _render_mutex.unlock();
+            throw;
+        }
+        _render_mutex.unlock();
+    }
+}
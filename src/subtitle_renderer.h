@@ -23,6 +23,9 @@
 #define SUBTITLE_RENDERER_H
 
 #include <vector>
+#include <deque>
+#include <set>
+#include <string>
 
 #include <GL/glew.h>
 
@@ -31,6 +34,7 @@ extern "C"
 #include <ass/ass.h>
 }
 
+#include "str.h"
 #include "thread.h"
 
 #include "media_data.h"
@@ -54,8 +58,7 @@ private:
     // Initialization
     subtitle_renderer_initializer _initializer;
     bool _initialized;
-    const char *_fontconfig_conffile;
-    const char *get_fontconfig_conffile();
+    static const char *get_fontconfig_conffile();
     void init();
     friend class subtitle_renderer_initializer;
 
@@ -63,16 +66,29 @@ private:
     ASS_Library *_ass_library;
     ASS_Renderer *_ass_renderer;
 
+    // The ASS track is kept as long as the style header, the style overrides and
+    // the encoding stay the same, i.e. usually for all subtitles of a stream. The
+    // styles are therefore parsed only once. ASS events are added once and stay
+    // in the track, since they carry their own times; a text subtitle replaces
+    // the event of the previous one.
+    ASS_Track *_ass_track;
+    std::string _ass_track_key;                 // Stream, format, style header, overrides and encoding of the track
+    std::set<std::string> _ass_track_events;    // The ASS events in the track
+    subtitle_box _ass_text_box;                 // The text subtitle in the track
+    str::converter _converter;                  // For the subtitle encoding
+
     // Dynamic data (changes with each subtitle)
     subtitle_box::format_t _fmt;
-    ASS_Track *_ass_track;
     ASS_Image *_ass_img;
     const subtitle_box *_img_box;
+    std::vector<uint32_t> _blend_row;           // Source pixels of the row that is blended
     int _bb_x, _bb_y, _bb_w, _bb_h;
 
     // ASS helper functions
     void blend_ass_image(const ASS_Image *img, uint32_t *buf);
-    void set_ass_parameters(const parameters &params);
+    std::vector<std::string> ass_style_overrides(const parameters &params);
+    void set_ass_track(const subtitle_box &box, const parameters &params);
+    void add_ass_events(const subtitle_box &box, const parameters &params);
 
     // Rendering ASS and text subtitles
     void prerender_ass(const subtitle_box &box, int64_t timestamp,
@@ -126,4 +142,63 @@ public:
     void render(uint32_t *bgra32_buffer);
 };
 
+// A subtitle rendered into a BGRA32 buffer, together with the settings it was
+// rendered with.
+class subtitle_image
+{
+public:
+    subtitle_box box;
+    int64_t timestamp;                  // Only relevant if the box is not constant
+    parameters params;
+    int width, height;                  // Size of the subtitle overlay image
+    float pixel_aspect_ratio;
+    int bb_x, bb_y, bb_w, bb_h;         // Bounding box inside the overlay image
+    std::vector<uint32_t> data;         // BGRA32 data of the bounding box
+
+    subtitle_image();
+    subtitle_image(const subtitle_box &box, int64_t timestamp, const parameters &params,
+            int width, int height, float pixel_aspect_ratio);
+
+    // Whether this image shows the same as an image with the settings of the given one.
+    bool matches(const subtitle_image &img) const;
+};
+
+// The subtitle prerenderer.
+// This thread renders upcoming subtitles into a small cache in the background,
+// so that the video output only needs to upload them when they are due. For
+// subtitles that change over time, it renders the images for the requested
+// frame times. Images that are not in the cache are rendered on demand; the
+// prerenderer serializes this with its own use of the subtitle renderer.
+class subtitle_prerenderer : public thread
+{
+private:
+    static const size_t _cache_size = 8;
+    subtitle_renderer &_renderer;
+    mutex _render_mutex;                        // Serializes the use of the renderer
+    mutex _mutex;                               // Guards the following
+    condition _cond;
+    bool _stop;
+    std::deque<subtitle_image> _requests;       // Images to render next (without data)
+    std::deque<subtitle_image> _cache;          // Rendered images, the oldest first
+
+    void render(subtitle_image &img);
+    bool lookup(subtitle_image &img);
+
+public:
+    subtitle_prerenderer(subtitle_renderer &renderer);
+
+    void run();
+    // Stop the thread and wait for it. It can be started again afterwards.
+    void stop();
+
+    // Replace the pending requests with the given subtitle, for each of the
+    // given timestamps, and start the thread if necessary. The subtitle
+    // renderer must be initialized.
+    void request(const subtitle_box &box, const std::vector<int64_t> &timestamps,
+            const parameters &params, int width, int height, float pixel_aspect_ratio);
+    // Get the image with the settings of the given one, from the cache or by
+    // rendering it now. The image data and the bounding box are filled in.
+    void get(subtitle_image &img);
+};
+
 #endif
@@ -0,0 +1,279 @@
+/*
+ * This file is part of bino, a 3D video player.
+ *
+ * Copyright (C) 2010-2011
+ * Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+#include "video_convert.h"
+
+#include "dbg.h"
+
+
+/* Convert a normalized color component to 8 bit. The shader output is clamped
+ * to [0,1] and rounded to the nearest representable value. */
+
+static inline uint8_t to_u8(float x)
+{
+    x = std::min(std::max(x, 0.0f), 1.0f);
+    return static_cast<uint8_t>(static_cast<int>(x * 255.0f + 0.5f));
+}
+
+#if defined(__SSE2__)
+/* Load four Y values and convert them to float. */
+
+static inline __m128 load4(const uint8_t *src)
+{
+    int32_t v;
+    std::memcpy(&v, src, sizeof(v));
+    __m128i zero = _mm_setzero_si128();
+    __m128i x = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero));
+}
+
+static inline __m128 load4(const uint16_t *src)
+{
+    __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, _mm_setzero_si128()));
+}
+
+static inline __m128i to_u8(__m128 x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f)));
+}
+#endif
+
+
+video_yuv_converter::video_yuv_converter() :
+    _chroma_width(0), _chroma_height(0), _chroma_offset_y(0.0f),
+    _y_factor(0.0f), _y_offset(0.0f), _c_factor(0.0f), _c_offset(0.0f),
+    _rv(0.0f), _gu(0.0f), _gv(0.0f), _bu(0.0f)
+{
+}
+
+video_yuv_converter::video_yuv_converter(const video_frame &format) :
+    _format(format)
+{
+    assert(supports(format));
+
+    int w = _format.raw_width;
+    int h = _format.raw_height;
+
+    // Chroma plane size and chroma offsets, as set up by the video output for the shader.
+    int width_divisor = (_format.layout == video_frame::yuv444p ? 1 : 2);
+    int height_divisor = (_format.layout == video_frame::yuv420p ? 2 : 1);
+    _chroma_width = std::max(w / width_divisor, 1);
+    _chroma_height = std::max(h / height_divisor, 1);
+    float chroma_offset_x = 0.0f;
+    _chroma_offset_y = 0.0f;
+    if (_format.layout != video_frame::yuv444p)
+    {
+        if (_format.chroma_location == video_frame::left)
+        {
+            chroma_offset_x = 0.5f;
+        }
+        else if (_format.chroma_location == video_frame::topleft)
+        {
+            chroma_offset_x = 0.5f;
+            _chroma_offset_y = 0.5f;
+        }
+    }
+
+    // Value range. The shader first normalizes to [0,1] and then expands the MPEG range.
+    float max_value, y_scale, c_scale, black;
+    if (_format.value_range == video_frame::u8_full)
+    {
+        max_value = 255.0f;
+        y_scale = 1.0f;
+        c_scale = 1.0f;
+        black = 0.0f;
+    }
+    else if (_format.value_range == video_frame::u8_mpeg)
+    {
+        max_value = 255.0f;
+        y_scale = 256.0f / 220.0f;
+        c_scale = 256.0f / 225.0f;
+        black = 16.0f / 255.0f;
+    }
+    else if (_format.value_range == video_frame::u10_full)
+    {
+        max_value = 1023.0f;
+        y_scale = 1.0f;
+        c_scale = 1.0f;
+        black = 0.0f;
+    }
+    else
+    {
+        max_value = 1023.0f;
+        y_scale = 1024.0f / 877.0f;
+        c_scale = 1024.0f / 897.0f;
+        black = 64.0f / 1023.0f;
+    }
+    _y_factor = y_scale / max_value;
+    _y_offset = -black * y_scale;
+    _c_factor = c_scale / max_value;
+    _c_offset = -black * c_scale - 0.5f;
+
+    // Color space
+    if (_format.color_space == video_frame::yuv709)
+    {
+        // According to ITU.BT-709 (see entries 3.2 and 3.3 in Sec. 3 ("Signal format"))
+        _rv = 1.5748f;
+        _gu = -0.187324f;
+        _gv = -0.468124f;
+        _bu = 1.8556f;
+    }
+    else
+    {
+        // According to ITU.BT-601 (see formulas in Sec. 2.5.1 and 2.5.2)
+        _rv = 1.402f;
+        _gu = -0.344136f;
+        _gv = -0.714136f;
+        _bu = 1.772f;
+    }
+
+    // Horizontal chroma interpolation, like a GL_LINEAR lookup with GL_CLAMP_TO_EDGE.
+    _cx0.resize(w);
+    _cx1.resize(w);
+    _cfx.resize(w);
+    for (int x = 0; x < w; x++)
+    {
+        float p = (x + 0.5f) * _chroma_width / w - 0.5f + chroma_offset_x;
+        float p0 = std::floor(p);
+        _cx0[x] = std::min(std::max(static_cast<int>(p0), 0), _chroma_width - 1);
+        _cx1[x] = std::min(std::max(static_cast<int>(p0) + 1, 0), _chroma_width - 1);
+        _cfx[x] = p - p0;
+    }
+    _tmp_u.resize(_chroma_width);
+    _tmp_v.resize(_chroma_width);
+    _row_u.resize(w);
+    _row_v.resize(w);
+}
+
+bool video_yuv_converter::supports(const video_frame &format)
+{
+    return ((format.layout == video_frame::yuv444p
+                || format.layout == video_frame::yuv422p
+                || format.layout == video_frame::yuv420p)
+            && (format.color_space == video_frame::yuv601
+                || format.color_space == video_frame::yuv709)
+            && format.raw_width > 0 && format.raw_height > 0);
+}
+
+template<typename T>
+void video_yuv_converter::interpolate_chroma(const uint8_t *const src[3], const int src_linesize[3], int y)
+{
+    // Vertical interpolation, like a GL_LINEAR lookup with GL_CLAMP_TO_EDGE.
+    float p = (y + 0.5f) * _chroma_height / _format.raw_height - 0.5f + _chroma_offset_y;
+    float p0 = std::floor(p);
+    int y0 = std::min(std::max(static_cast<int>(p0), 0), _chroma_height - 1);
+    int y1 = std::min(std::max(static_cast<int>(p0) + 1, 0), _chroma_height - 1);
+    float fy = p - p0;
+    const T *u0 = reinterpret_cast<const T *>(src[1] + y0 * src_linesize[1]);
+    const T *u1 = reinterpret_cast<const T *>(src[1] + y1 * src_linesize[1]);
+    const T *v0 = reinterpret_cast<const T *>(src[2] + y0 * src_linesize[2]);
+    const T *v1 = reinterpret_cast<const T *>(src[2] + y1 * src_linesize[2]);
+    for (int i = 0; i < _chroma_width; i++)
+    {
+        _tmp_u[i] = u0[i] * (1.0f - fy) + u1[i] * fy;
+        _tmp_v[i] = v0[i] * (1.0f - fy) + v1[i] * fy;
+    }
+    // Horizontal interpolation
+    for (int x = 0; x < _format.raw_width; x++)
+    {
+        float fx = _cfx[x];
+        _row_u[x] = _tmp_u[_cx0[x]] * (1.0f - fx) + _tmp_u[_cx1[x]] * fx;
+        _row_v[x] = _tmp_v[_cx0[x]] * (1.0f - fx) + _tmp_v[_cx1[x]] * fx;
+    }
+}
+
+template<typename T>
+void video_yuv_converter::convert_row(const T *src_y, uint8_t *dst)
+{
+    int w = _format.raw_width;
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128 y_factor = _mm_set1_ps(_y_factor);
+    const __m128 y_offset = _mm_set1_ps(_y_offset);
+    const __m128 c_factor = _mm_set1_ps(_c_factor);
+    const __m128 c_offset = _mm_set1_ps(_c_offset);
+    const __m128 rv = _mm_set1_ps(_rv);
+    const __m128 gu = _mm_set1_ps(_gu);
+    const __m128 gv = _mm_set1_ps(_gv);
+    const __m128 bu = _mm_set1_ps(_bu);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    for (; x + 4 <= w; x += 4)
+    {
+        __m128 yy = _mm_add_ps(_mm_mul_ps(load4(src_y + x), y_factor), y_offset);
+        __m128 u = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&_row_u[x]), c_factor), c_offset);
+        __m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&_row_v[x]), c_factor), c_offset);
+        __m128i r = to_u8(_mm_add_ps(yy, _mm_mul_ps(rv, v)));
+        __m128i g = to_u8(_mm_add_ps(_mm_add_ps(yy, _mm_mul_ps(gu, u)), _mm_mul_ps(gv, v)));
+        __m128i b = to_u8(_mm_add_ps(yy, _mm_mul_ps(bu, u)));
+        __m128i bgra = _mm_or_si128(_mm_or_si128(b, _mm_slli_epi32(g, 8)),
+                _mm_or_si128(_mm_slli_epi32(r, 16), alpha));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4 * x), bgra);
+    }
+#endif
+    for (; x < w; x++)
+    {
+        float yy = src_y[x] * _y_factor + _y_offset;
+        float u = _row_u[x] * _c_factor + _c_offset;
+        float v = _row_v[x] * _c_factor + _c_offset;
+        dst[4 * x + 0] = to_u8(yy + _bu * u);
+        dst[4 * x + 1] = to_u8((yy + _gu * u) + _gv * v);
+        dst[4 * x + 2] = to_u8(yy + _rv * v);
+        dst[4 * x + 3] = 0xff;
+    }
+}
+
+template<typename T>
+void video_yuv_converter::convert_rows(const uint8_t *const src[3], const int src_linesize[3],
+        int y, int h, uint8_t *dst, int dst_linesize)
+{
+    for (int r = y; r < y + h; r++)
+    {
+        interpolate_chroma<T>(src, src_linesize, r);
+        convert_row(reinterpret_cast<const T *>(src[0] + r * src_linesize[0]), dst + r * dst_linesize);
+    }
+}
+
+void video_yuv_converter::convert(const uint8_t *const src[3], const int src_linesize[3],
+        int y, int h, uint8_t *dst, int dst_linesize)
+{
+    assert(supports(_format));
+    assert(y >= 0 && h >= 0 && y + h <= _format.raw_height);
+
+    if (_format.value_range == video_frame::u8_full || _format.value_range == video_frame::u8_mpeg)
+    {
+        convert_rows<uint8_t>(src, src_linesize, y, h, dst, dst_linesize);
+    }
+    else
+    {
+        convert_rows<uint16_t>(src, src_linesize, y, h, dst, dst_linesize);
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is part of bino, a 3D video player.
+ *
+ * Copyright (C) 2010-2011
+ * Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIDEO_CONVERT_H
+#define VIDEO_CONVERT_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "media_data.h"
+
+/* Conversion of planar YUV video data to BGRA32.
+ * This is used instead of libswscale for the formats that the video output
+ * could otherwise handle itself. The arithmetic is the same as in
+ * video_output_color.fs.glsl without the color adjustments (the video output
+ * applies those to BGRA32 data, too): the color space, value range and chroma
+ * location of the source format are respected, and chroma is interpolated
+ * bilinearly like the GL_LINEAR texture lookups of the shader do.
+ * The inner loop uses SSE2 if the compiler targets it (always on x86_64); a
+ * scalar fallback with the same results handles everything else. */
+
+class video_yuv_converter
+{
+private:
+    video_frame _format;                // Source format
+    int _chroma_width;                  // Width of the U and V planes
+    int _chroma_height;                 // Height of the U and V planes
+    float _chroma_offset_y;             // Vertical chroma offset in chroma rows
+    float _y_factor, _y_offset;         // Raw Y value to normalized Y
+    float _c_factor, _c_offset;         // Raw U/V value to normalized U/V, centered at zero
+    float _rv, _gu, _gv, _bu;           // YUV to RGB matrix coefficients that are not 0 or 1
+    std::vector<int> _cx0, _cx1;        // Horizontal chroma sample indices for each pixel
+    std::vector<float> _cfx;            // Horizontal chroma interpolation weights for each pixel
+    std::vector<float> _tmp_u, _tmp_v;  // Vertically interpolated chroma rows
+    std::vector<float> _row_u, _row_v;  // Chroma rows interpolated to the full width
+
+    template<typename T> void interpolate_chroma(const uint8_t *const src[3], const int src_linesize[3], int y);
+    template<typename T> void convert_row(const T *src_y, uint8_t *dst);
+    template<typename T> void convert_rows(const uint8_t *const src[3], const int src_linesize[3],
+            int y, int h, uint8_t *dst, int dst_linesize);
+
+public:
+    // An unusable converter.
+    video_yuv_converter();
+    // A converter for frames of the given format. The layout must be one of the
+    // YUV layouts.
+    video_yuv_converter(const video_frame &format);
+
+    // Whether the converter supports frames of the given format.
+    static bool supports(const video_frame &format);
+
+    // Convert the h rows of the source frame starting at row y to BGRA32.
+    // The source and destination pointers point to the first row of the frame;
+    // rows outside of the band are read for chroma interpolation, but only the
+    // rows of the band are written. Different converters may therefore work on
+    // different bands of the same frame in parallel.
+    void convert(const uint8_t *const src[3], const int src_linesize[3],
+            int y, int h, uint8_t *dst, int dst_linesize);
+};
+
+#endif
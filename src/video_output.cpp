@@ -26,6 +26,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <cmath>
+#include <algorithm>
 
 #include <GL/glew.h>
 
@@ -98,7 +99,8 @@ static const float full_tex_coords[2][4][2] =
     { { 0.0f, 0.0f }, { 1.0f, 0.0f }, { 1.0f, 1.0f }, { 0.0f, 1.0f } }
 };
 
-video_output::video_output() : controller(), _initialized(false)
+video_output::video_output() : controller(), _initialized(false),
+    _subtitle_prerenderer(_subtitle_renderer)
 {
     _input_pbo = 0;
     _input_fbo = 0;
@@ -123,10 +125,13 @@ video_output::video_output() : controller(), _initialized(false)
     _render_prg = 0;
     _render_dummy_tex = 0;
     _render_mask_tex = 0;
+    std::memset(_viewport, 0, sizeof(_viewport));
+    std::memcpy(_tex_coords, full_tex_coords, sizeof(_tex_coords));
 }
 
 video_output::~video_output()
 {
+    _subtitle_prerenderer.stop();
 }
 
 void video_output::init()
@@ -142,6 +147,7 @@ void video_output::deinit()
 {
     if (_initialized)
     {
+        _subtitle_prerenderer.stop();
         make_context_current();
         assert(xgl::CheckError(HERE));
         clear();
@@ -405,6 +411,30 @@ void video_output::prepare_next_frame(const video_frame &frame, const subtitle_b
     update_subtitle_tex(index, frame, subtitle, _params);
 }
 
+void video_output::prerender_subtitle(const video_frame &frame, const subtitle_box &subtitle,
+        const std::vector<int64_t> &timestamps)
+{
+    if (!subtitle.is_valid() || timestamps.empty() || !frame.is_valid()
+            || _viewport[0][2] <= 0 || _viewport[0][3] <= 0
+            || !_subtitle_renderer.is_initialized())
+    {
+        return;
+    }
+    int width, height;
+    if (_subtitle_renderer.render_to_display_size(subtitle))
+    {
+        width = video_display_width();
+        height = video_display_height();
+    }
+    else
+    {
+        width = frame.width;
+        height = frame.height;
+    }
+    _subtitle_prerenderer.request(subtitle, timestamps, _params,
+            width, height, screen_pixel_aspect_ratio());
+}
+
 int video_output::video_display_width()
 {
     assert(_viewport[0][2] > 0);
@@ -417,6 +447,27 @@ int video_output::video_display_height()
     return _viewport[0][3];
 }
 
+int video_output::view_pixels_width()
+{
+    // The tex coords cover less than the full frame if the video is zoomed.
+    float w = _viewport[0][2] / std::max(_tex_coords[0][1][0] - _tex_coords[0][0][0], 0.01f);
+    if (_params.stereo_mode == parameters::even_odd_columns)
+    {
+        w /= 2.0f;
+    }
+    return w;
+}
+
+int video_output::view_pixels_height()
+{
+    float h = _viewport[0][3] / std::max(_tex_coords[0][2][1] - _tex_coords[0][1][1], 0.01f);
+    if (_params.stereo_mode == parameters::even_odd_rows)
+    {
+        h /= 2.0f;
+    }
+    return h;
+}
+
 void video_output::update_subtitle_tex(int index, const video_frame &frame, const subtitle_box &subtitle, const parameters &params)
 {
     assert(xgl::CheckError(HERE));
@@ -476,15 +527,15 @@ void video_output::update_subtitle_tex(int index, const video_frame &frame, cons
                 GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, _input_subtitle_tex[index], 0);
         glClear(GL_COLOR_BUFFER_BIT);
         glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
-        // Prerender the subtitle to get a bounding box
-        int bb_x, bb_y, bb_w, bb_h;
-        _subtitle_renderer.prerender(subtitle, frame.presentation_time, params,
-                width, height, screen_pixel_aspect_ratio(),
-                bb_x, bb_y, bb_w, bb_h);
-        if (bb_w > 0 && bb_h > 0)
+        // Get the rendered subtitle. Usually the prerenderer has it ready;
+        // otherwise it is rendered now.
+        subtitle_image img(subtitle, frame.presentation_time, params,
+                width, height, screen_pixel_aspect_ratio());
+        _subtitle_prerenderer.get(img);
+        if (img.bb_w > 0 && img.bb_h > 0)
         {
             // Get a PBO buffer of appropriate size for the bounding box.
-            size_t size = bb_w * bb_h * sizeof(uint32_t);
+            size_t size = img.bb_w * img.bb_h * sizeof(uint32_t);
             glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _input_pbo);
             glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
             void *pboptr = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
@@ -493,15 +544,15 @@ void video_output::update_subtitle_tex(int index, const video_frame &frame, cons
                 throw exc(_("Cannot create a PBO buffer."));
             }
             assert(reinterpret_cast<uintptr_t>(pboptr) % 4 == 0);
-            // Render the subtitle into the buffer.
-            _subtitle_renderer.render(static_cast<uint32_t *>(pboptr));
+            // Copy the subtitle into the buffer.
+            std::memcpy(pboptr, &(img.data[0]), size);
             // Update the appropriate part of the texture.
             glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-            glPixelStorei(GL_UNPACK_ROW_LENGTH, bb_w);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, img.bb_w);
             glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
             glActiveTexture(GL_TEXTURE0);
             glBindTexture(GL_TEXTURE_2D, _input_subtitle_tex[index]);
-            glTexSubImage2D(GL_TEXTURE_2D, 0, bb_x, bb_y, bb_w, bb_h,
+            glTexSubImage2D(GL_TEXTURE_2D, 0, img.bb_x, img.bb_y, img.bb_w, img.bb_h,
                     GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
             glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
         }
@@ -752,6 +803,60 @@ void video_output::activate_next_frame()
     trigger_update();
 }
 
+void video_output::release_inactive_resources()
+{
+    if (!_initialized)
+    {
+        return;
+    }
+    make_context_current();
+    assert(xgl::CheckError(HERE));
+    int index = (_active_index == 0 ? 1 : 0);
+    for (int i = 0; i < 2; i++)
+    {
+        if (_input_yuv_y_tex[index][i] != 0)
+        {
+            glDeleteTextures(1, &(_input_yuv_y_tex[index][i]));
+            _input_yuv_y_tex[index][i] = 0;
+        }
+        if (_input_yuv_u_tex[index][i] != 0)
+        {
+            glDeleteTextures(1, &(_input_yuv_u_tex[index][i]));
+            _input_yuv_u_tex[index][i] = 0;
+        }
+        if (_input_yuv_v_tex[index][i] != 0)
+        {
+            glDeleteTextures(1, &(_input_yuv_v_tex[index][i]));
+            _input_yuv_v_tex[index][i] = 0;
+        }
+        if (_input_bgra32_tex[index][i] != 0)
+        {
+            glDeleteTextures(1, &(_input_bgra32_tex[index][i]));
+            _input_bgra32_tex[index][i] = 0;
+        }
+    }
+    if (_input_subtitle_tex[index] != 0)
+    {
+        glDeleteTextures(1, &(_input_subtitle_tex[index]));
+        _input_subtitle_tex[index] = 0;
+    }
+    _input_subtitle_box[index] = subtitle_box();
+    _input_subtitle_width[index] = -1;
+    _input_subtitle_height[index] = -1;
+    _input_subtitle_time[index] = std::numeric_limits<int64_t>::min();
+    // The prepared frame is gone, so the next frame needs new textures.
+    // This also drops our reference to its data.
+    _frame[index] = video_frame();
+    // Orphan the storage of the pixel buffer object
+    if (_input_pbo != 0)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _input_pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, 0, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    assert(xgl::CheckError(HERE));
+}
+
 void video_output::set_parameters(const parameters &params)
 {
     _params = params;
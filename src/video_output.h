@@ -95,6 +95,7 @@ private:
 
 protected:
     subtitle_renderer _subtitle_renderer;
+    subtitle_prerenderer _subtitle_prerenderer;
 
     // Get total size of the video display area. For single window output, this
     // is the same as the current viewport. The Equalizer video output can override
@@ -167,12 +168,26 @@ public:
     /* Process window system events (if applicable) */
     virtual void process_events() = 0;
     
+    /* Get the number of screen pixels available for the width and height of
+     * one view of the video frame. This depends on the video area size, the
+     * stereo mode, and the zoom. It is 0 until the video area was set up. */
+    int view_pixels_width();
+    int view_pixels_height();
+
     /* Prepare a new frame for display. */
     void prepare_next_frame(const video_frame &frame, const subtitle_box &subtitle);
+    /* Render the given upcoming subtitle in the background, for each of the
+     * given timestamps, so that preparing the frames that show it only needs
+     * to upload it. The frame determines the size of bitmap subtitles. */
+    void prerender_subtitle(const video_frame &frame, const subtitle_box &subtitle,
+            const std::vector<int64_t> &timestamps);
     /* Switch to the next frame (make it the current one) */
     void activate_next_frame();
     /* Set display parameters. */
     void set_parameters(const parameters &params);
+    /* Free the GPU resources that are not needed to display the current frame,
+     * e.g. during a long pause. They are recreated when the next frame is prepared. */
+    void release_inactive_resources();
 
     /* Receive a notification from the player. */
     virtual void receive_notification(const notification &note) = 0;